@@ -0,0 +1,48 @@
+# Compare NEWOBJ hooks specialized for common key sets with the generic
+# hook (forced by RUBY_ALLOCATION_TRACER_GENERIC_HOOKS). Both are run
+# alternately and the best time of each is shown, as tracing overhead
+# per allocation.
+#
+#   ruby -Ilib benchmark/hook_variants.rb [allocations] [rounds]
+
+require 'allocation_tracer'
+
+N = Integer(ARGV[0] || 1_000_000)
+ROUNDS = Integer(ARGV[1] || 10)
+
+def allocate
+  i = 0
+  while i < N
+    Object.new
+    i += 1
+  end
+end
+
+# results are made outside of the measurement
+def measure trace
+  GC.start
+  ObjectSpace::AllocationTracer.start if trace
+  t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  allocate
+  t = Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+  ObjectSpace::AllocationTracer.stop if trace
+  t * 1e9 / N
+end
+
+base = Array.new(ROUNDS){ measure(false) }.min
+puts format('%-18s %8.1f ns/alloc', 'no tracing', base)
+
+[%i(path line), %i(path line type), %i(path line class), %i(type)].each{|keys|
+  ObjectSpace::AllocationTracer.setup(keys)
+  generic = []
+  specialized = []
+  ROUNDS.times{
+    ENV['RUBY_ALLOCATION_TRACER_GENERIC_HOOKS'] = '1'
+    generic << measure(true) - base
+    ENV.delete('RUBY_ALLOCATION_TRACER_GENERIC_HOOKS')
+    specialized << measure(true) - base
+  }
+  g, s = generic.min, specialized.min
+  puts format('%-18s generic %7.1f  specialized %7.1f ns/alloc (%+.1f%%)',
+              keys.join('+'), g, s, (s / g - 1) * 100)
+}
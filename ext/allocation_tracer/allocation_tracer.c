@@ -8,24 +8,136 @@
 #include "ruby/ruby.h"
 #include "ruby/debug.h"
 #include <assert.h>
+#include <math.h>
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+#include <signal.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
 
 size_t rb_obj_memsize_of(VALUE obj); /* in gc.c */
+#ifdef HAVE_RB_GC_OBJ_SLOT_SIZE
+size_t rb_gc_obj_slot_size(VALUE obj); /* in gc.c (Ruby 3.2+) */
+#endif
+#ifdef HAVE_RB_OBJ_GC_FLAGS
+size_t rb_obj_gc_flags(VALUE obj, ID *flags, size_t max); /* in gc.c */
+#endif
 
 static VALUE rb_mAllocationTracer;
+static VALUE sym_major_by;
+static ID id_fiber_id;
+
+struct allocation_info;
+
+/* set of object addresses. system malloc is used, so it can be updated during GC */
+struct addr_set {
+    VALUE *slots;               /* 0 for empty slots */
+    size_t capa;                /* power of 2 */
+    size_t num;
+};
 
 struct traceobj_arg {
     int running;
+    int exporting;              /* tables are walked by write_json */
     int keys, vals;
     st_table *object_table;     /* obj (VALUE)      -> allocation_info */
     st_table *str_table;        /* cstr             -> refcount */
+    st_table *class_table;      /* klass (VALUE)    -> class id. not marked (see forget_class) */
 
-    st_table *aggregate_table;  /* user defined key -> [count, total_age, max_age, min_age] */
+    st_table *aggregate_table;  /* user defined key -> aggregate_values */
     struct allocation_info *freed_allocation_info;
 
     /* */
     size_t **lifetime_table;
     size_t allocated_count_table[T_MASK];
     size_t freed_count_table[T_MASK];
+
+    /* young objects checked at GC_END_MARK (see check_promotion). system malloc */
+    VALUE *promotion_candidates;
+    size_t promotion_candidates_num, promotion_candidates_capa;
+
+    struct gc_records *gc_records;
+    struct alarm *alarm;
+
+    /* class registry. class_entries[0] is reserved for "no class" */
+    struct class_entry *class_entries;
+    size_t class_entries_num, class_entries_capa;
+    VALUE last_klass;           /* one entry cache for class_table */
+    size_t last_class_id;
+    int class_grouping;
+
+    /* thread registry. threads are pinned while tracing, so they are
+     * registered only for :thread and :fiber keys, or with thread_count */
+    int thread_count;           /* count allocations per thread (see thread_count_setup) */
+    double start_time;          /* when tracing is started or cleared (see elapsed_time) */
+    st_table *thread_table;     /* thread (VALUE)   -> thread id */
+    struct thread_entry *thread_entries;
+    size_t thread_entries_num, thread_entries_capa;
+    VALUE last_thread;          /* one entry cache for thread_table */
+    size_t last_thread_id;
+    size_t fiber_num;           /* last fiber id */
+
+    /* method registry. method_entries[0] is reserved for "no Ruby frame" */
+    st_table *method_table;     /* frame (VALUE)    -> method id. frames are pinned while tracing */
+    struct method_entry *method_entries;
+    size_t method_entries_num, method_entries_capa;
+    VALUE last_frame;           /* one entry cache for method_table */
+    size_t last_method_id;
+
+    /* objects and classes moved by compaction. they are re-inserted after GC */
+    int moved;
+    struct moved_object *moved_objects; /* sorted by obj */
+    size_t moved_objects_num, moved_objects_capa;
+    struct moved_class *moved_classes;  /* reserved for all keys of class_table */
+    size_t moved_classes_num, moved_classes_capa;
+
+    /* sampling: trace only one of sampling_rate allocations */
+    size_t sampling_rate;
+    size_t base_sampling_rate;  /* set by sampling_setup. sampling_rate can be lowered by memory budget */
+    size_t sampling_count;
+
+    /* memory budget (0 means no limit) */
+    size_t memory_budget;
+    size_t budget_check;
+    int budget_approached;
+    int budget_exceeded;        /* do not trace new objects until memsize is under the budget */
+    size_t sampled_out_count;   /* allocations skipped by sampling */
+    size_t evicted_count;       /* live objects moved into evicted_table before their death */
+    st_table *evicted_table;    /* user defined key -> aggregate_values of evicted live objects */
+    size_t str_bytes;           /* bytes of paths in str_table (see path_bytes) */
+    size_t str_bytes_num;       /* number of paths when str_bytes is counted */
+    size_t dropped_count;       /* allocations skipped because of budget_exceeded */
+
+    /* control channel. deadline of tracing (0 means no limit). see control_deadline */
+    double stop_at;
+
+    /* hooks specialized for the configuration (see select_hook_variant) */
+    void (*newobj_func)(VALUE tpval, void *data);
+    void (*aggregate_info)(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj);
+
+    /* count-only mode: no object_table and no FREEOBJ hook */
+    int count_only;
+    struct count_cache *count_cache;
+
+    /* fork-aware mode. tables inherited from the parent process are read only (see after_fork) */
+    int fork_aware;
+    st_table *parent_object_table; /* obj (VALUE) -> allocation_info of the parent process */
+    st_table *parent_str_table;    /* paths of parent_object_table */
+    struct addr_set parent_gone;   /* addresses in parent_object_table which are freed or moved */
+    struct addr_set parent_moved;  /* addresses of parent-era objects moved by compaction */
+    size_t parent_freed_count;
+
+    /* boot profile: objects living at fork (see boot_snapshot) */
+    int boot_profile;
+    struct boot_object *boot_objects; /* sorted by obj */
+    size_t boot_objects_num;
+    int boot_paths_owned;       /* paths are referred in str_table (0 in a child process) */
 };
 
 struct allocation_info {
@@ -34,23 +146,221 @@ struct allocation_info {
     /* all of information don't need marking. */
     int living;
     VALUE flags;
-    VALUE klass;
+    size_t class_id;
     size_t generation;
     size_t memsize;
 
     /* allocator info */
     const char *path;
     unsigned long line;
+
+    /* promotion info (0 if not promoted yet) */
+    size_t promoted_generation;
+
+    /* heap slot size at free time (only with size distribution) */
+    unsigned int slot_size;
+
+    unsigned int thread_id;
+    unsigned int fiber_id;      /* 0 for root fibers */
+    unsigned int method_id;
+
+    /* rb_data_type_t of typed data objects. not set at NEWOBJ (the type is not filled yet) */
+    const rb_data_type_t *data_type;
+
+    /* hash of the content at free time (only with duplicate detection) or 0 */
+    st_index_t content_hash;
+};
+
+struct moved_object {
+    VALUE obj;
+    struct allocation_info *info;
+};
+
+struct moved_class {
+    VALUE klass;                /* 0 if freed before re-inserted */
+    size_t id;
+};
+
+#define BOOT_OLD          (1<<0)
+#define BOOT_WB_PROTECTED (1<<1)
+#define BOOT_FREED        (1<<2)
+
+struct boot_object {
+    VALUE obj;
+    const char *path;
+    size_t memsize;             /* at fork */
+    unsigned int flags;
+};
+
+struct class_entry {
+    VALUE klass; /* grouped class */
+    VALUE name;  /* cached permanent name or Qnil */
+};
+
+struct thread_entry {
+    VALUE thread;
+    VALUE label;                /* resolved at result time */
+    size_t allocated_count;
+    size_t fiber_id;            /* id of the current fiber (see fiber_switch_i) */
+};
+
+struct method_entry {
+    VALUE frame;                /* method entry or iseq returned by rb_profile_frames() */
+    VALUE label;                /* resolved at result time */
+};
+
+#define CLASS_GROUP_SINGLETON      (1<<1) /* count singleton classes separately */
+#define CLASS_GROUP_ANON_SUPERCLASS (1<<2) /* count anonymous classes as named superclass */
+
+struct aggregate_values {
+    size_t count;
+    size_t old_count;
+    size_t total_age;
+    size_t min_age;
+    size_t max_age;
+    size_t memsize;
+
+    /* promotion tracking */
+    size_t promoted_count;
+    size_t total_promotion_age;
+    size_t died_old_count;
+
+    /* objects living at result time */
+    size_t retained_count;
+    size_t retained_memsize;
+
+    struct size_distribution *dist; /* only with size distribution */
+    struct content_stats *contents; /* only with duplicate detection */
+};
+
+#define SIZE_BUCKETS 32 /* power-of-two buckets of memsize */
+#define SLOT_SIZE_CLASSES 8
+
+struct size_distribution {
+    size_t buckets[SIZE_BUCKETS];
+    struct {
+	size_t slot_size;
+	size_t count;
+    } slots[SLOT_SIZE_CLASSES];
+    size_t non_embedded_count; /* memsize is larger than the slot */
+};
+
+#define CONTENT_HASHES_MAX 256 /* per site. more contents are counted as distinct */
+#define CONTENT_ARRAY_MAX_LEN 16
+#define CONTENT_FREED_STRING_MAX 128 /* longer strings are not hashed at FREEOBJ */
+
+static size_t content_hashes_num; /* entries of all content_stats::hashes (see tracer_memsize) */
+
+struct content_stats {
+    st_table *hashes;           /* content hash -> memsize of the first object */
+    size_t count;               /* hashed objects */
+    size_t distinct_count;
+    size_t duplicate_memsize;
+};
+
+#define GC_RECORD_SITES 8
+#define GC_SITE_TABLE_SIZE 1024 /* should be power of 2 */
+
+struct gc_site {
+    const char *path;
+    unsigned long line;
+    size_t count;
+    size_t memsize;
+};
+
+struct gc_record {
+    size_t gc_count;
+    int major;
+    double mark_wall_time;      /* wall clock. includes mutator time of incremental marking */
+    double sweep_wall_time;     /* wall clock. includes mutator time of lazy sweeping */
+    size_t allocated_count; /* traced allocations since the previous GC */
+    size_t freed_count;
+    size_t freed_memsize;
+    int site_num;
+    struct gc_site sites[GC_RECORD_SITES];
+};
+
+struct gc_records {
+    int sweeping;
+    double start_time;
+    double end_mark_time;
+    size_t allocated_count;
+    struct gc_record current;
+
+    /*
+     * per cycle site counters. They are updated during GC, where malloc is
+     * not allowed: paths are only referred with keep_unique_str() (no
+     * allocation for existing keys) and released with delete_unique_str(),
+     * which may free a path string. Freeing is allowed during GC.
+     */
+    struct gc_site site_table[GC_SITE_TABLE_SIZE];
+    int site_table_num;
+
+    /* ring buffer */
+    size_t size;
+    size_t num; /* total number of recorded cycles */
+    struct gc_record records[1]; /* size */
+};
+
+#define ALARM_SITE_TABLE_SIZE 4096 /* should be power of 2 */
+#define ALARM_MAX_PENDING 16
+
+struct alarm_site {
+    int used;
+    const char *path;
+    unsigned long line;
+    size_t count;               /* allocations in the current epoch */
+    double baseline;            /* moving average of count per epoch */
+};
+
+struct alarm_event {
+    const char *path;           /* NULL for type alarms */
+    unsigned long line;
+    int type;                   /* -1 for site alarms */
+    size_t count;
+    double baseline;
+    double elapsed;
+    size_t gc_count;
+};
+
+/*
+ * alarms are evaluated per epoch, which ends when GC starts or after
+ * interval seconds (see alarm_tick)
+ */
+struct alarm {
+    size_t epoch;               /* rb_gc_count() at the epoch start */
+    double epoch_start;
+    double interval;            /* max length of an epoch */
+    size_t site_threshold;      /* 0 means no site alarm */
+    double factor;              /* 0 means no baseline check */
+    size_t type_thresholds[T_MASK];
+    size_t type_counts[T_MASK]; /* allocated_count_table at the epoch start */
+
+    /* rebuilt each epoch without cold sites (see alarm_finish_epoch) */
+    struct alarm_site sites[ALARM_SITE_TABLE_SIZE];
+    int site_num;
+    struct alarm_site kept_sites[ALARM_SITE_TABLE_SIZE / 4 * 3];
+
+    int pending_num;
+    struct alarm_event pending[ALARM_MAX_PENDING];
+    size_t dropped_count;       /* events not fired because pending is full */
 };
 
-#define MAX_KEY_DATA 4
+#define MAX_KEY_DATA 9
 
 #define KEY_PATH    (1<<1)
 #define KEY_LINE    (1<<2)
 #define KEY_TYPE    (1<<3)
 #define KEY_CLASS   (1<<4)
+#define KEY_CLASS_NAME (1<<5)
+#define KEY_CLASS_MASK (KEY_CLASS | KEY_CLASS_NAME)
+#define KEY_THREAD  (1<<6)
+#define KEY_FIBER   (1<<7)
+#define KEY_THREAD_MASK (KEY_THREAD | KEY_FIBER)
+#define KEY_METHOD  (1<<8)
+#define KEY_DATA_TYPE (1<<9)
 
-#define MAX_VAL_DATA 6
+#define MAX_VAL_DATA 17
 
 #define VAL_COUNT     (1<<1)
 #define VAL_OLDCOUNT  (1<<2)
@@ -58,23 +368,46 @@ struct allocation_info {
 #define VAL_MIN_AGE   (1<<4)
 #define VAL_MAX_AGE   (1<<5)
 #define VAL_MEMSIZE   (1<<6)
+#define VAL_PROMOTED_COUNT      (1<<7)
+#define VAL_TOTAL_PROMOTION_AGE (1<<8)
+#define VAL_DIED_OLD_COUNT      (1<<9)
+
+#define VAL_SIZE_HISTOGRAM      (1<<10)
+#define VAL_SLOT_SIZES          (1<<11)
+#define VAL_NON_EMBEDDED_COUNT  (1<<12)
+
+#define VAL_CONTENT_COUNT          (1<<13)
+#define VAL_DISTINCT_CONTENT_COUNT (1<<14)
+#define VAL_DUPLICATE_MEMSIZE      (1<<15)
+#define VAL_RETAINED_COUNT         (1<<16)
+#define VAL_RETAINED_MEMSIZE       (1<<17)
+
+#define VAL_PROMOTION (VAL_PROMOTED_COUNT | VAL_TOTAL_PROMOTION_AGE | VAL_DIED_OLD_COUNT)
+#define VAL_SIZE_DISTRIBUTION (VAL_SIZE_HISTOGRAM | VAL_SLOT_SIZES | VAL_NON_EMBEDDED_COUNT)
+#define VAL_DUPLICATE (VAL_CONTENT_COUNT | VAL_DISTINCT_CONTENT_COUNT | VAL_DUPLICATE_MEMSIZE)
+#define VAL_RETAINED (VAL_RETAINED_COUNT | VAL_RETAINED_MEMSIZE)
+
+#define BUDGET_CHECK_INTERVAL 0x3fff
+#define BUDGET_MAX_SAMPLING_RATE 1024
+#define BUDGET_AGE_BUCKETS 64
+
+/* increment the count of an existing key with one lookup (hashing the string once) */
+static int
+keep_unique_str_i(st_data_t *key, st_data_t *value, st_data_t data, int existing)
+{
+    if (!existing) return ST_STOP;
+    *value += 1;
+    *(char **)data = (char *)*key;
+    return ST_CONTINUE;
+}
 
 static char *
 keep_unique_str(st_table *tbl, const char *str)
 {
-    st_data_t n;
+    char *result = NULL;
 
-    if (str && st_lookup(tbl, (st_data_t)str, &n)) {
-	char *result;
-
-	st_insert(tbl, (st_data_t)str, n+1);
-	st_get_key(tbl, (st_data_t)str, (st_data_t *)&result);
-
-	return result;
-    }
-    else {
-	return NULL;
-    }
+    if (str) st_update(tbl, (st_data_t)str, keep_unique_str_i, (st_data_t)&result);
+    return result;
 }
 
 static const char *
@@ -86,6 +419,7 @@ make_unique_str(st_table *tbl, const char *str, long len)
     else {
 	char *result;
 
+	/* not allocated in st_update(): GC can run FREEOBJ hooks, which delete keys */
 	if ((result = keep_unique_str(tbl, str)) == NULL) {
 	    result = (char *)ruby_xmalloc(len+1);
 	    strncpy(result, str, len);
@@ -96,22 +430,331 @@ make_unique_str(st_table *tbl, const char *str, long len)
     }
 }
 
+/*
+ * The path of the last allocation. Allocations of the same path (compared
+ * by contents, Ruby strings of paths can be recycled) only increment
+ * pending, which is added to the count in the table when the cache is
+ * flushed. The cache itself also refers to the string.
+ */
+static struct path_cache {
+    st_table *tbl;              /* NULL if empty */
+    const char *str;
+    long len;
+    size_t pending;
+} path_cache;
+
+static void path_cache_flush(void);
+
+/* decrement the count with one lookup. the key is returned to be freed if it is deleted */
+static int
+delete_unique_str_i(st_data_t *key, st_data_t *value, st_data_t data, int existing)
+{
+    if (!existing) rb_bug("delete_unique_str: unreachable");
+    if (*value == 1) {
+	*(char **)data = (char *)*key;
+	return ST_DELETE;
+    }
+    *value -= 1;
+    return ST_CONTINUE;
+}
+
 static void
 delete_unique_str(st_table *tbl, const char *str)
 {
     if (str) {
-	st_data_t n;
+	char *deleted = NULL;
+
+	/* the count in the table is not accurate while cached */
+	if (str == path_cache.str && tbl == path_cache.tbl) path_cache_flush();
+	st_update(tbl, (st_data_t)str, delete_unique_str_i, (st_data_t)&deleted);
+	if (deleted) ruby_xfree(deleted);
+    }
+}
+
+static int
+path_cache_flush_i(st_data_t *key, st_data_t *value, st_data_t data, int existing)
+{
+    *value += (st_data_t)data;
+    return ST_CONTINUE;
+}
+
+static void
+path_cache_flush(void)
+{
+    st_table *tbl = path_cache.tbl;
+
+    if (tbl) {
+	path_cache.tbl = NULL;
+	if (path_cache.pending) st_update(tbl, (st_data_t)path_cache.str, path_cache_flush_i, (st_data_t)path_cache.pending);
+	delete_unique_str(tbl, path_cache.str); /* reference of the cache */
+    }
+}
+
+/* forget the cache without touching tbl, which is cleared */
+static void
+path_cache_reset(void)
+{
+    path_cache.tbl = NULL;
+}
+
+/* make_unique_str() which doesn't look up the table for the last path */
+static const char *
+cached_unique_str(st_table *tbl, const char *str, long len)
+{
+    const char *result;
+
+    if (tbl == path_cache.tbl && len == path_cache.len && memcmp(str, path_cache.str, len) == 0) {
+	path_cache.pending++;
+	return path_cache.str;
+    }
+
+    path_cache_flush();
+    result = make_unique_str(tbl, str, len);
+    keep_unique_str(tbl, result);
+    path_cache.tbl = tbl;
+    path_cache.str = result;
+    path_cache.len = len;
+    path_cache.pending = 0;
+    return result;
+}
+
+static double
+current_time(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+static void
+gc_record_release_sites(st_table *str_table, struct gc_record *record)
+{
+    int i;
+    for (i=0; i<record->site_num; i++) {
+	delete_unique_str(str_table, record->sites[i].path);
+    }
+    record->site_num = 0;
+}
+
+static void
+gc_records_add_freed_site(struct gc_records *records, st_table *str_table, const char *path, unsigned long line, size_t memsize)
+{
+    unsigned long h = ((unsigned long)path >> 3) ^ (line * 31);
+    int i;
+
+    records->current.freed_count++;
+    records->current.freed_memsize += memsize;
 
-	if (st_lookup(tbl, (st_data_t)str, &n) == 0) rb_bug("delete_unique_str: unreachable");
+    for (i=0; i<GC_SITE_TABLE_SIZE; i++) {
+	struct gc_site *site = &records->site_table[(h + i) & (GC_SITE_TABLE_SIZE - 1)];
 
-	if (n == 1) {
-	    st_delete(tbl, (st_data_t *)&str, NULL);
-	    ruby_xfree((char *)str);
+	if (site->count == 0) {
+	    if (records->site_table_num >= GC_SITE_TABLE_SIZE / 4 * 3) return; /* table is full */
+	    site->path = keep_unique_str(str_table, path);
+	    site->line = line;
+	    records->site_table_num++;
+	}
+	else if (site->path != path || site->line != line) {
+	    continue;
+	}
+	site->count++;
+	site->memsize += memsize;
+	return;
+    }
+}
+
+static void
+gc_records_finish_cycle(struct gc_records *records, st_table *str_table)
+{
+    struct gc_record *record = &records->current;
+    int i, j;
+
+    /* pick up top sites by freed memsize and count */
+    record->site_num = 0;
+    for (i=0; i<GC_SITE_TABLE_SIZE; i++) {
+	struct gc_site *site = &records->site_table[i];
+
+	if (site->count == 0) continue;
+
+	for (j=record->site_num; j>0; j--) {
+	    struct gc_site *s = &record->sites[j-1];
+	    if (s->memsize > site->memsize || (s->memsize == site->memsize && s->count >= site->count)) break;
+	}
+	if (j < GC_RECORD_SITES) {
+	    if (record->site_num == GC_RECORD_SITES) {
+		delete_unique_str(str_table, record->sites[GC_RECORD_SITES-1].path);
+		record->site_num--;
+	    }
+	    MEMMOVE(&record->sites[j+1], &record->sites[j], struct gc_site, record->site_num - j);
+	    record->sites[j] = *site;
+	    record->site_num++;
 	}
 	else {
-	    st_insert(tbl, (st_data_t)str, n-1);
+	    delete_unique_str(str_table, site->path);
+	}
+    }
+    MEMZERO(records->site_table, struct gc_site, GC_SITE_TABLE_SIZE);
+    records->site_table_num = 0;
+
+    {
+	struct gc_record *slot = &records->records[records->num % records->size];
+	gc_record_release_sites(str_table, slot);
+	*slot = *record;
+	records->num++;
+    }
+}
+
+static void
+gc_records_clear(struct gc_records *records, st_table *str_table)
+{
+    size_t i;
+    for (i=0; i<GC_SITE_TABLE_SIZE; i++) {
+	if (records->site_table[i].count) delete_unique_str(str_table, records->site_table[i].path);
+    }
+    for (i=0; i<records->size; i++) {
+	gc_record_release_sites(str_table, &records->records[i]);
+    }
+    MEMZERO(records->site_table, struct gc_site, GC_SITE_TABLE_SIZE);
+    records->site_table_num = 0;
+    records->num = 0;
+    records->sweeping = 0;
+    records->allocated_count = 0;
+}
+
+/* return the slot of the site or an empty slot */
+static struct alarm_site *
+alarm_site_slot(struct alarm *alarm, const char *path, unsigned long line)
+{
+    size_t h = (((size_t)path >> 3) * 31 + line) & (ALARM_SITE_TABLE_SIZE - 1);
+    int i;
+
+    for (i=0; i<ALARM_SITE_TABLE_SIZE; i++) {
+	struct alarm_site *site = &alarm->sites[(h + i) & (ALARM_SITE_TABLE_SIZE - 1)];
+
+	if (!site->used || (site->path == path && site->line == line)) return site;
+    }
+    return NULL; /* not reached. the table is kept 3/4 full at most */
+}
+
+static void
+alarm_count_site(struct alarm *alarm, st_table *str_table, const char *path, unsigned long line)
+{
+    struct alarm_site *site = alarm_site_slot(alarm, path, line);
+
+    if (!site->used) {
+	/* full until cold sites are evicted at the end of the epoch */
+	if (alarm->site_num >= ALARM_SITE_TABLE_SIZE / 4 * 3) return;
+	site->used = 1;
+	site->path = keep_unique_str(str_table, path);
+	site->line = line;
+	site->count = 0;
+	site->baseline = 0;
+	alarm->site_num++;
+    }
+    site->count++;
+}
+
+/*
+ * A site is cold if it doesn't allocate in the epoch and its baseline
+ * can't suppress alarms. Forgetting it doesn't change alarms, and
+ * makes room for new sites.
+ */
+static int
+alarm_site_cold_p(const struct alarm *alarm, const struct alarm_site *site)
+{
+    return site->count == 0 &&
+	(alarm->factor == 0 || site->baseline * alarm->factor < alarm->site_threshold);
+}
+
+static void
+alarm_add_event(struct alarm *alarm, st_table *str_table, const char *path, unsigned long line, int type,
+		size_t count, double baseline, double elapsed)
+{
+    struct alarm_event *event;
+
+    if (alarm->pending_num == ALARM_MAX_PENDING) {
+	alarm->dropped_count++;
+	return;
+    }
+    event = &alarm->pending[alarm->pending_num++];
+    event->path = keep_unique_str(str_table, path);
+    event->line = line;
+    event->type = type;
+    event->count = count;
+    event->baseline = baseline;
+    event->elapsed = elapsed;
+    event->gc_count = alarm->epoch;
+}
+
+/*
+ * evaluate counters of the finished epoch. return true if some alarms are tripped.
+ * called in the GC_START hook, so it doesn't allocate.
+ */
+static int
+alarm_finish_epoch(struct alarm *alarm, st_table *str_table, const size_t *allocated_count_table, size_t gc_count)
+{
+    double now = current_time(), elapsed = now - alarm->epoch_start;
+    int i, pending_num = alarm->pending_num;
+
+    if (alarm->site_threshold) {
+	int kept = 0;
+
+	for (i=0; i<ALARM_SITE_TABLE_SIZE; i++) {
+	    struct alarm_site *site = &alarm->sites[i];
+
+	    if (!site->used) continue;
+	    if (site->count >= alarm->site_threshold &&
+		(alarm->factor == 0 || site->count >= site->baseline * alarm->factor)) {
+		alarm_add_event(alarm, str_table, site->path, site->line, -1, site->count, site->baseline, elapsed);
+	    }
+	    site->baseline = site->baseline * 7 / 8 + (double)site->count / 8;
+
+	    if (alarm_site_cold_p(alarm, site)) {
+		delete_unique_str(str_table, site->path); /* can free. allowed during GC */
+	    }
+	    else {
+		site->count = 0;
+		alarm->kept_sites[kept++] = *site;
+	    }
+	}
+
+	/* rebuild the table. open addressing can't delete entries in place */
+	MEMZERO(alarm->sites, struct alarm_site, ALARM_SITE_TABLE_SIZE);
+	for (i=0; i<kept; i++) {
+	    *alarm_site_slot(alarm, alarm->kept_sites[i].path, alarm->kept_sites[i].line) = alarm->kept_sites[i];
+	}
+	alarm->site_num = kept;
+    }
+    for (i=0; i<T_MASK; i++) {
+	size_t count = allocated_count_table[i] - alarm->type_counts[i];
+	if (alarm->type_thresholds[i] && count >= alarm->type_thresholds[i]) {
+	    alarm_add_event(alarm, str_table, NULL, 0, i, count, 0, elapsed);
 	}
+	alarm->type_counts[i] = allocated_count_table[i];
     }
+
+    alarm->epoch = gc_count;
+    alarm->epoch_start = now;
+    return alarm->pending_num > pending_num;
+}
+
+/* forget counters and pending events. str_table is cleared by the caller */
+static void
+alarm_reset(struct alarm *alarm, const size_t *allocated_count_table)
+{
+    MEMZERO(alarm->sites, struct alarm_site, ALARM_SITE_TABLE_SIZE);
+    MEMCPY(alarm->type_counts, allocated_count_table, size_t, T_MASK);
+    alarm->site_num = 0;
+    alarm->pending_num = 0;
+    alarm->dropped_count = 0;
+    alarm->epoch = rb_gc_count();
+    alarm->epoch_start = current_time();
 }
 
 struct memcmp_key_data {
@@ -138,8 +781,22 @@ static const struct st_hash_type memcmp_hash_type = {
     memcmp_hash_compare, memcmp_hash_hash
 };
 
+/*
+ * one entry cache of the count-only hook. paths are compared by contents
+ * because path strings can be freed and their slots reused by other paths
+ * in the same GC cycle (lazy sweep).
+ */
+struct count_cache {
+    const char *path_cstr;      /* in str_table, owned by aggregate keys. NULL if invalid */
+    long path_len;
+    struct memcmp_key_data key;
+    struct aggregate_values *val; /* NULL if invalid */
+};
+
 static struct traceobj_arg *tmp_trace_arg; /* TODO: Do not use global variables */
 
+static void select_hook_variant(struct traceobj_arg *arg);
+
 static struct traceobj_arg *
 get_traceobj_arg(void)
 {
@@ -150,14 +807,80 @@ get_traceobj_arg(void)
 	tmp_trace_arg->keys = 0;
 	tmp_trace_arg->vals = VAL_COUNT | VAL_OLDCOUNT | VAL_TOTAL_AGE | VAL_MAX_AGE | VAL_MIN_AGE | VAL_MEMSIZE;
 	tmp_trace_arg->aggregate_table = st_init_table(&memcmp_hash_type);
+	tmp_trace_arg->evicted_table = st_init_table(&memcmp_hash_type);
 	tmp_trace_arg->object_table = st_init_numtable();
 	tmp_trace_arg->str_table = st_init_strtable();
+	tmp_trace_arg->class_table = st_init_numtable();
+	tmp_trace_arg->class_entries_capa = 64;
+	tmp_trace_arg->class_entries = ALLOC_N(struct class_entry, tmp_trace_arg->class_entries_capa);
+	tmp_trace_arg->class_entries[0].klass = Qnil;
+	tmp_trace_arg->class_entries[0].name = Qnil;
+	tmp_trace_arg->class_entries_num = 1;
+	tmp_trace_arg->last_klass = Qundef;
+	tmp_trace_arg->thread_table = st_init_numtable();
+	tmp_trace_arg->thread_entries_capa = 16;
+	tmp_trace_arg->thread_entries = ALLOC_N(struct thread_entry, tmp_trace_arg->thread_entries_capa);
+	tmp_trace_arg->last_thread = Qundef;
+	tmp_trace_arg->method_table = st_init_numtable();
+	tmp_trace_arg->method_entries_capa = 64;
+	tmp_trace_arg->method_entries = ALLOC_N(struct method_entry, tmp_trace_arg->method_entries_capa);
+	tmp_trace_arg->method_entries[0].frame = Qnil;
+	tmp_trace_arg->method_entries[0].label = Qnil;
+	tmp_trace_arg->method_entries_num = 1;
+	tmp_trace_arg->last_frame = Qundef;
 	tmp_trace_arg->freed_allocation_info = NULL;
 	tmp_trace_arg->lifetime_table = NULL;
+	tmp_trace_arg->count_cache = ALLOC(struct count_cache);
+	tmp_trace_arg->count_cache->path_cstr = NULL;
+	tmp_trace_arg->count_cache->val = NULL;
+	select_hook_variant(tmp_trace_arg);
     }
     return tmp_trace_arg;
 }
 
+/*
+ * Postponed jobs of the tracer. rb_postponed_job_register_one() is
+ * deprecated since Ruby 3.3, so jobs are preregistered (define_job) and
+ * triggered if possible. Jobs receive the tracer (tmp_trace_arg).
+ */
+enum tracer_job {
+    JOB_AGGREGATE_FREED,
+    JOB_FLUSH_MOVED,
+    JOB_CONTROL,
+    JOB_ALARM,
+    JOB_SCOPE_HOOK,
+    JOB_BUDGET,
+    JOB_NUM
+};
+
+static rb_postponed_job_func_t job_funcs[JOB_NUM];
+#ifdef HAVE_RB_POSTPONED_JOB_TRIGGER
+static rb_postponed_job_handle_t job_handles[JOB_NUM];
+#endif
+
+static void
+define_job(enum tracer_job job, rb_postponed_job_func_t func)
+{
+    job_funcs[job] = func;
+#ifdef HAVE_RB_POSTPONED_JOB_TRIGGER
+    job_handles[job] = rb_postponed_job_preregister(0, func, get_traceobj_arg());
+    if (job_handles[job] == POSTPONED_JOB_HANDLE_INVALID) {
+	rb_raise(rb_eRuntimeError, "can't preregister a postponed job");
+    }
+#endif
+}
+
+/* async-signal-safe. can be called during GC */
+static void
+trigger_job(enum tracer_job job)
+{
+#ifdef HAVE_RB_POSTPONED_JOB_TRIGGER
+    rb_postponed_job_trigger(job_handles[job]);
+#else
+    rb_postponed_job_register_one(0, job_funcs[job], tmp_trace_arg);
+#endif
+}
+
 static int
 free_keys_i(st_data_t key, st_data_t value, void *data)
 {
@@ -173,10 +896,20 @@ free_values_i(st_data_t key, st_data_t value, void *data)
 }
 
 static int
-free_key_values_i(st_data_t key, st_data_t value, void *data)
+free_aggregate_i(st_data_t key, st_data_t value, void *data)
 {
+    struct aggregate_values *val = (struct aggregate_values *)value;
+
     ruby_xfree((void *)key);
-    ruby_xfree((void *)value);
+    if (val->dist) ruby_xfree(val->dist);
+    if (val->contents) {
+	if (val->contents->hashes) {
+	    content_hashes_num -= val->contents->hashes->num_entries;
+	    st_free_table(val->contents->hashes);
+	}
+	ruby_xfree(val->contents);
+    }
+    ruby_xfree(val);
     return ST_CONTINUE;
 }
 
@@ -193,852 +926,4898 @@ delete_lifetime_table(struct traceobj_arg *arg)
     }
 }
 
+static int
+mark_class_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    rb_gc_mark((VALUE)key);
+    return ST_CONTINUE;
+}
+
 static void
-clear_traceobj_arg(void)
+tracer_holder_mark(void *ptr)
 {
-    struct traceobj_arg * arg = get_traceobj_arg();
+    struct traceobj_arg *arg = *(struct traceobj_arg **)ptr;
+    size_t i;
 
-    st_foreach(arg->aggregate_table, free_key_values_i, 0);
-    st_clear(arg->aggregate_table);
-    st_foreach(arg->object_table, free_values_i, 0);
-    st_clear(arg->object_table);
-    st_foreach(arg->str_table, free_keys_i, 0);
-    st_clear(arg->str_table);
-    arg->freed_allocation_info = NULL;
-    delete_lifetime_table(arg);
+    if (arg) {
+	if (arg->count_only) {
+	    /* no FREEOBJ hook to forget freed classes */
+	    st_foreach(arg->class_table, mark_class_i, 0);
+	}
+	for (i=1; i<arg->class_entries_num; i++) {
+	    if (arg->count_only) rb_gc_mark(arg->class_entries[i].klass);
+	    rb_gc_mark(arg->class_entries[i].name);
+	}
+	for (i=0; i<arg->thread_entries_num; i++) {
+	    rb_gc_mark(arg->thread_entries[i].thread);
+	    rb_gc_mark(arg->thread_entries[i].label);
+	}
+	for (i=1; i<arg->method_entries_num; i++) {
+	    rb_gc_mark(arg->method_entries[i].frame);
+	    rb_gc_mark(arg->method_entries[i].label);
+	}
+    }
 }
 
-static struct allocation_info *
-create_allocation_info(void)
+static size_t
+addr_set_hash(VALUE obj)
 {
-    return (struct allocation_info *)ruby_xmalloc(sizeof(struct allocation_info));
+    return (size_t)((obj >> 3) * 2654435761UL);
 }
 
-static void
-free_allocation_info(struct traceobj_arg *arg, struct allocation_info *info)
+static int
+addr_set_member_p(const struct addr_set *set, VALUE obj)
 {
-    delete_unique_str(arg->str_table, info->path);
-    ruby_xfree(info);
+    size_t i, mask = set->capa - 1;
+
+    if (set->num == 0) return 0;
+    for (i = addr_set_hash(obj) & mask; set->slots[i]; i = (i + 1) & mask) {
+	if (set->slots[i] == obj) return 1;
+    }
+    return 0;
 }
 
-static void
-newobj_i(VALUE tpval, void *data)
+/* return 1 if added, 0 if already added and -1 if out of memory */
+static int
+addr_set_add(struct addr_set *set, VALUE obj)
 {
-    struct traceobj_arg *arg = (struct traceobj_arg *)data;
-    struct allocation_info *info;
-    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
-    VALUE obj = rb_tracearg_object(tparg);
-    VALUE path = rb_tracearg_path(tparg);
-    VALUE line = rb_tracearg_lineno(tparg);
-    VALUE klass = Qnil;
-    switch(BUILTIN_TYPE(obj)) {
-        case T_NODE:
-        case T_IMEMO:
-            break;
-        default:
-            klass = RBASIC_CLASS(obj);
-    }
-    const char *path_cstr = RTEST(path) ? make_unique_str(arg->str_table, RSTRING_PTR(path), RSTRING_LEN(path)) : NULL;
+    size_t i, mask;
 
-    if (st_lookup(arg->object_table, (st_data_t)obj, (st_data_t *)&info)) {
-	if (info->living) {
-	    /* do nothing. there is possibility to keep living if FREEOBJ events while suppressing tracing */
+    if ((set->num + 1) * 2 > set->capa) {
+	size_t capa = set->capa ? set->capa * 2 : 256, j;
+	VALUE *slots = calloc(capa, sizeof(VALUE));
+
+	if (slots == NULL) return -1;
+	for (j=0; j<set->capa; j++) {
+	    if (set->slots[j]) {
+		for (i = addr_set_hash(set->slots[j]) & (capa - 1); slots[i]; i = (i + 1) & (capa - 1));
+		slots[i] = set->slots[j];
+	    }
 	}
-	/* reuse info */
-	delete_unique_str(arg->str_table, info->path);
-    }
-    else {
-	info = create_allocation_info();
+	free(set->slots);
+	set->slots = slots;
+	set->capa = capa;
     }
 
-    info->next = NULL;
-    info->flags = RBASIC(obj)->flags;
-    info->living = 1;
-    info->memsize = 0;
-    info->klass = (RTEST(klass) && !RB_TYPE_P(obj, T_NODE)) ? rb_class_real(klass) : Qnil;
-    info->generation = rb_gc_count();
+    mask = set->capa - 1;
+    for (i = addr_set_hash(obj) & mask; set->slots[i]; i = (i + 1) & mask) {
+	if (set->slots[i] == obj) return 0;
+    }
+    set->slots[i] = obj;
+    set->num++;
+    return 1;
+}
 
-    info->path = path_cstr;
-    info->line = NUM2INT(line);
+/* return 1 if deleted. later slots of the cluster are shifted back */
+static int
+addr_set_delete(struct addr_set *set, VALUE obj)
+{
+    size_t i, j, k, mask = set->capa - 1;
 
-    st_insert(arg->object_table, (st_data_t)obj, (st_data_t)info);
+    if (set->num == 0) return 0;
+    for (i = addr_set_hash(obj) & mask; set->slots[i] != obj; i = (i + 1) & mask) {
+	if (set->slots[i] == 0) return 0;
+    }
+    for (j = (i + 1) & mask; set->slots[j]; j = (j + 1) & mask) {
+	k = addr_set_hash(set->slots[j]) & mask;
+	/* move slots[j] to the hole unless its home is in (i, j] */
+	if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+	set->slots[i] = set->slots[j];
+	i = j;
+    }
+    set->slots[i] = 0;
+    set->num--;
+    return 1;
+}
 
-    arg->allocated_count_table[BUILTIN_TYPE(obj)]++;
+static void
+addr_set_free(struct addr_set *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+    set->capa = set->num = 0;
 }
 
-/* file, line, type, klass */
-#define MAX_KEY_SIZE 4
+static int
+boot_object_cmp(const void *a, const void *b)
+{
+    VALUE o1 = ((const struct boot_object *)a)->obj;
+    VALUE o2 = ((const struct boot_object *)b)->obj;
+    return o1 < o2 ? -1 : o1 > o2 ? 1 : 0;
+}
 
 static void
-aggregate_each_info(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count)
+free_boot_objects(struct traceobj_arg *arg)
 {
-    st_data_t key, val;
-    struct memcmp_key_data key_data;
-    size_t *val_buff;
-    size_t age = (int)(gc_count - info->generation);
-    int i = 0;
+    size_t i;
 
-    if (arg->keys & KEY_PATH) {
-	key_data.data[i++] = (st_data_t)info->path;
-    }
-    if (arg->keys & KEY_LINE) {
-	key_data.data[i++] = (st_data_t)info->line;
-    }
-    if (arg->keys & KEY_TYPE) {
-	key_data.data[i++] = (st_data_t)(info->flags & T_MASK);
-    }
-    if (arg->keys & KEY_CLASS) {
-	key_data.data[i++] = info->klass;
+    if (arg->boot_paths_owned) {
+	for (i=0; i<arg->boot_objects_num; i++) {
+	    delete_unique_str(arg->str_table, arg->boot_objects[i].path);
+	}
     }
-    key_data.n = i;
-    key = (st_data_t)&key_data;
+    free(arg->boot_objects);
+    arg->boot_objects = NULL;
+    arg->boot_objects_num = 0;
+    arg->boot_paths_owned = 0;
+}
 
-    if (st_lookup(arg->aggregate_table, key, &val) == 0) {
-	struct memcmp_key_data *key_buff = ruby_xmalloc(sizeof(struct memcmp_key_data));
-	key_buff->n = key_data.n;
+/* is obj a parent-era object which is not freed yet? (see after_fork) */
+static int
+parent_object_p(struct traceobj_arg *arg, VALUE obj)
+{
+    if (addr_set_member_p(&arg->parent_moved, obj)) return 1;
+    return !addr_set_member_p(&arg->parent_gone, obj) &&
+	st_lookup(arg->parent_object_table, (st_data_t)obj, NULL);
+}
 
-	for (i=0; i<key_data.n; i++) {
-	    key_buff->data[i] = key_data.data[i];
-	}
-	key = (st_data_t)key_buff;
+static void free_allocation_info(struct traceobj_arg *arg, struct allocation_info *info);
+
+#ifdef HAVE_RB_GC_LOCATION
+static int
+remove_moved_object_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    VALUE obj = rb_gc_location((VALUE)key);
 
-	/* count, old count, total age, max age, min age */
-	val_buff = ALLOC_N(size_t, 6);
-	val_buff[0] = val_buff[1] = val_buff[2] = 0;
-	val_buff[3] = val_buff[4] = age;
-	val_buff[5] = 0;
+    if (obj != (VALUE)key) {
+	struct moved_object *moved;
 
-	if (arg->keys & KEY_PATH) keep_unique_str(arg->str_table, info->path);
+	if (arg->moved_objects_num == arg->moved_objects_capa) {
+	    /* use system malloc instead of ruby_xmalloc */
+	    size_t capa = arg->moved_objects_capa ? arg->moved_objects_capa * 2 : 1024;
+	    struct moved_object *buff = realloc(arg->moved_objects, sizeof(struct moved_object) * capa);
 
-	st_insert(arg->aggregate_table, (st_data_t)key_buff, (st_data_t)val_buff);
-    }
-    else {
-	val_buff = (size_t *)val;
+	    if (buff == NULL) {
+		/* can't keep it. drop tracking of the object */
+		free_allocation_info(arg, (struct allocation_info *)val);
+		arg->dropped_count++;
+		return ST_DELETE;
+	    }
+	    arg->moved_objects = buff;
+	    arg->moved_objects_capa = capa;
+	}
+	moved = &arg->moved_objects[arg->moved_objects_num++];
+	moved->obj = obj;
+	moved->info = (struct allocation_info *)val;
+	return ST_DELETE;
     }
-
-    val_buff[0] += 1;
-#ifdef FL_PROMOTED
-    if (info->flags & FL_PROMOTED) val_buff[1] += 1;
-#elif defined(FL_PROMOTED0) && defined(FL_PROMOTED1)
-    if (info->flags & FL_PROMOTED0 &&
-	info->flags & FL_PROMOTED1) val_buff[1] += 1;
-#endif
-    val_buff[2] += age;
-    if (val_buff[3] > age) val_buff[3] = age; /* min */
-    if (val_buff[4] < age) val_buff[4] = age; /* max */
-    val_buff[5] += info->memsize;
+    return ST_CONTINUE;
 }
 
-static void
-aggregate_freed_info(void *data)
+/* moved_classes has room for all keys (see reserve_moved_classes) */
+static int
+remove_moved_class_i(st_data_t key, st_data_t val, st_data_t data)
 {
-    size_t gc_count = rb_gc_count();
     struct traceobj_arg *arg = (struct traceobj_arg *)data;
-    struct allocation_info *info = arg->freed_allocation_info;
-
-    arg->freed_allocation_info = NULL;
+    VALUE klass = rb_gc_location((VALUE)key);
 
-    if (arg->running) {
-	while (info) {
-	    struct allocation_info *next_info = info->next;
-	    aggregate_each_info(arg, info, gc_count);
-	    free_allocation_info(arg, info);
-	    info = next_info;
-	}
+    if (klass != (VALUE)key) {
+	struct moved_class *moved = &arg->moved_classes[arg->moved_classes_num++];
+	moved->klass = klass;
+	moved->id = (size_t)val;
+	return ST_DELETE;
     }
+    return ST_CONTINUE;
 }
 
-static void
-move_to_freed_list(struct traceobj_arg *arg, VALUE obj, struct allocation_info *info)
+struct move_parent_data {
+    struct traceobj_arg *arg;
+    struct addr_set *moved;
+};
+
+static int
+move_parent_object_i(st_data_t key, st_data_t val, st_data_t data)
 {
-    if (arg->freed_allocation_info == NULL) {
-	rb_postponed_job_register_one(0, aggregate_freed_info, arg);
-    }
+    struct move_parent_data *mpd = (struct move_parent_data *)data;
+    VALUE obj = (VALUE)key, dst;
 
-    info->next = arg->freed_allocation_info;
-    arg->freed_allocation_info = info;
-    st_delete(arg->object_table, (st_data_t *)&obj, (st_data_t *)&info);
+    if (addr_set_member_p(&mpd->arg->parent_gone, obj)) return ST_CONTINUE;
+
+    if ((dst = rb_gc_location(obj)) != obj) {
+	addr_set_add(&mpd->arg->parent_gone, obj);
+	addr_set_add(mpd->moved, dst);
+    }
+    return ST_CONTINUE;
 }
 
+/*
+ * parent_object_table is read only, so moved parent-era objects are
+ * followed with parent_gone and parent_moved. If the sets can't grow,
+ * the objects are not counted when freed.
+ */
 static void
-add_lifetime_table(size_t **lines, int type, struct allocation_info *info)
+move_parent_objects(struct traceobj_arg *arg)
 {
-    size_t age = rb_gc_count() - info->generation;
-    size_t *line = lines[type];
-    size_t len, i;
+    struct addr_set moved = {NULL, 0, 0};
+    struct move_parent_data mpd;
+    size_t i;
 
-    if (line == NULL) {
-	len = age + 1;
-	line = lines[type] = calloc(1 + len, sizeof(size_t));
-	assert(line != NULL);
-	line[0] = len;
+    for (i=0; i<arg->parent_moved.capa; i++) {
+	if (arg->parent_moved.slots[i]) addr_set_add(&moved, rb_gc_location(arg->parent_moved.slots[i]));
     }
-    else {
-	len = line[0];
+    mpd.arg = arg;
+    mpd.moved = &moved;
+    st_foreach(arg->parent_object_table, move_parent_object_i, (st_data_t)&mpd);
 
-	if (len < age + 1) {
-	    size_t old_len = len;
-	    len = age + 1;
-	    line = lines[type] = realloc(line, sizeof(size_t) * (1 + len));
+    addr_set_free(&arg->parent_moved);
+    arg->parent_moved = moved;
+}
 
-	    assert(line != NULL);
+static int
+moved_object_cmp(const void *a, const void *b)
+{
+    VALUE o1 = ((const struct moved_object *)a)->obj;
+    VALUE o2 = ((const struct moved_object *)b)->obj;
+    return o1 < o2 ? -1 : o1 > o2 ? 1 : 0;
+}
 
-	    for (i=old_len; i<len; i++) {
-		line[i+1] = 0;
-	    }
+static void
+flush_moved_objects(struct traceobj_arg *arg)
+{
+    size_t i;
+    struct moved_object *moved_objects = arg->moved_objects;
+    size_t num = arg->moved_objects_num;
 
-	    line[0] = len;
+    arg->moved = 0;
+    arg->moved_objects = NULL;
+    arg->moved_objects_num = arg->moved_objects_capa = 0;
+
+    for (i=0; i<num; i++) {
+	if (moved_objects[i].info) {
+	    st_insert(arg->object_table, (st_data_t)moved_objects[i].obj, (st_data_t)moved_objects[i].info);
 	}
     }
+    free(moved_objects);
 
-    line[1 + age]++;
+    /* class_table doesn't grow here, so moved_classes stays reserved */
+    for (i=0; i<arg->moved_classes_num; i++) {
+	if (arg->moved_classes[i].klass) {
+	    st_insert(arg->class_table, (st_data_t)arg->moved_classes[i].klass, (st_data_t)arg->moved_classes[i].id);
+	}
+    }
+    arg->moved_classes_num = 0;
 }
 
 static void
-freeobj_i(VALUE tpval, void *data)
+flush_moved_objects_job(void *data)
 {
-    struct traceobj_arg *arg = (struct traceobj_arg *)data;
-    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
-    VALUE obj = rb_tracearg_object(tparg);
-    struct allocation_info *info;
+    flush_moved_objects((struct traceobj_arg *)data);
+}
 
-    if (st_lookup(arg->object_table, (st_data_t)obj, (st_data_t *)&info)) {
+/*
+ * GC.compact moves objects and object_table and class_table are keyed
+ * by address. Moved entries are removed from the tables here in one walk
+ * and re-inserted after GC (flush_moved_objects) because malloc is not
+ * allowed during GC.
+ */
+static void
+tracer_holder_compact(void *ptr)
+{
+    struct traceobj_arg *arg = *(struct traceobj_arg **)ptr;
+    size_t i;
 
-	info->flags = RBASIC(obj)->flags;
-	info->memsize = rb_obj_memsize_of(obj);
+    if (arg == NULL) return;
 
-	move_to_freed_list(arg, obj, info);
+    if (arg->boot_objects_num > 0) {
+	for (i=0; i<arg->boot_objects_num; i++) {
+	    struct boot_object *bo = &arg->boot_objects[i];
+	    bo->obj = (bo->flags & BOOT_FREED) ? 0 : rb_gc_location(bo->obj);
+	}
+	qsort(arg->boot_objects, arg->boot_objects_num, sizeof(struct boot_object), boot_object_cmp);
+    }
+    for (i=0; i<arg->promotion_candidates_num; i++) {
+	arg->promotion_candidates[i] = rb_gc_location(arg->promotion_candidates[i]);
+    }
 
-	if (arg->lifetime_table) {
-	    add_lifetime_table(arg->lifetime_table, BUILTIN_TYPE(obj), info);
+
+    /* not flushed yet objects can move again */
+    for (i=0; i<arg->moved_objects_num; i++) {
+	arg->moved_objects[i].obj = rb_gc_location(arg->moved_objects[i].obj);
+    }
+    st_foreach(arg->object_table, remove_moved_object_i, (st_data_t)arg);
+    qsort(arg->moved_objects, arg->moved_objects_num, sizeof(struct moved_object), moved_object_cmp);
+
+    if (!arg->count_only) {
+	/* classes are not pinned */
+	for (i=1; i<arg->class_entries_num; i++) {
+	    arg->class_entries[i].klass = rb_gc_location(arg->class_entries[i].klass);
+	}
+	for (i=0; i<arg->moved_classes_num; i++) {
+	    arg->moved_classes[i].klass = rb_gc_location(arg->moved_classes[i].klass);
 	}
+	st_foreach(arg->class_table, remove_moved_class_i, (st_data_t)arg);
+	arg->last_klass = Qundef;
     }
 
-    arg->freed_count_table[BUILTIN_TYPE(obj)]++;
+    if (arg->parent_object_table) move_parent_objects(arg);
+
+    if (arg->moved_objects_num > 0 || arg->moved_classes_num > 0) {
+	arg->moved = 1;
+	trigger_job(JOB_FLUSH_MOVED);
+    }
 }
+#endif
 
-static void
-check_tracer_running(void)
+/* lookup an object moved by compaction and not re-inserted yet */
+static int
+lookup_moved_object(struct traceobj_arg *arg, VALUE obj, struct allocation_info **info, int remove)
 {
-    struct traceobj_arg * arg = get_traceobj_arg();
+#ifdef HAVE_RB_GC_LOCATION
+    if (arg->moved_objects_num > 0) {
+	struct moved_object key, *moved;
 
-    if (!arg->running) {
-	rb_raise(rb_eRuntimeError, "not started yet");
+	key.obj = obj;
+	moved = bsearch(&key, arg->moved_objects, arg->moved_objects_num, sizeof(struct moved_object), moved_object_cmp);
+
+	if (moved && moved->info) {
+	    *info = moved->info;
+	    if (remove) moved->info = NULL;
+	    return 1;
+	}
     }
+#endif
+    return 0;
 }
 
-static void
-enable_newobj_hook(void)
+/* lookup a class moved by compaction and not re-inserted yet */
+static int
+lookup_moved_class(struct traceobj_arg *arg, VALUE klass, st_data_t *id, int remove)
 {
-    VALUE newobj_hook;
-
-    check_tracer_running();
+    size_t i;
 
-    if (!rb_ivar_defined(rb_mAllocationTracer, rb_intern("newobj_hook"))) {
-	rb_raise(rb_eRuntimeError, "not started.");
-    }
-    newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"));
-    if (rb_tracepoint_enabled_p(newobj_hook)) {
-	rb_raise(rb_eRuntimeError, "newobj hooks is already enabled.");
+    for (i=0; i<arg->moved_classes_num; i++) {
+	if (arg->moved_classes[i].klass == klass) {
+	    *id = (st_data_t)arg->moved_classes[i].id;
+	    if (remove) arg->moved_classes[i].klass = 0;
+	    return 1;
+	}
     }
+    return 0;
+}
 
-    rb_tracepoint_enable(newobj_hook);
+static const rb_data_type_t tracer_holder_type = {
+    "allocation_tracer/holder",
+    {tracer_holder_mark, NULL, NULL,
+#ifdef HAVE_RB_GC_LOCATION
+     tracer_holder_compact,
+#endif
+    },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+free_parent_tables(struct traceobj_arg *arg)
+{
+    if (arg->parent_object_table) {
+	st_foreach(arg->parent_object_table, free_values_i, 0);
+	st_free_table(arg->parent_object_table);
+	st_foreach(arg->parent_str_table, free_keys_i, 0);
+	st_free_table(arg->parent_str_table);
+	arg->parent_object_table = arg->parent_str_table = NULL;
+    }
+    addr_set_free(&arg->parent_gone);
+    addr_set_free(&arg->parent_moved);
+    arg->parent_freed_count = 0;
 }
 
 static void
-disable_newobj_hook(void)
+clear_traceobj_arg(void)
 {
-    VALUE newobj_hook;
+    struct traceobj_arg * arg = get_traceobj_arg();
 
-    check_tracer_running();
+    if (arg->gc_records) gc_records_clear(arg->gc_records, arg->str_table);
+    if (arg->alarm) alarm_reset(arg->alarm, arg->allocated_count_table);
+#ifdef HAVE_RB_GC_LOCATION
+    if (arg->moved) flush_moved_objects(arg);
+#endif
+    st_foreach(arg->aggregate_table, free_aggregate_i, 0);
+    st_clear(arg->aggregate_table);
+    st_foreach(arg->evicted_table, free_aggregate_i, 0);
+    st_clear(arg->evicted_table);
+    st_foreach(arg->object_table, free_values_i, 0);
+    st_clear(arg->object_table);
+    arg->boot_paths_owned = 0; /* freed with str_table */
+    free_boot_objects(arg);
+    path_cache_reset();
+    st_foreach(arg->str_table, free_keys_i, 0);
+    st_clear(arg->str_table);
+    st_clear(arg->class_table);
+    arg->class_entries_num = 1;
+    arg->last_klass = Qundef;
+    st_clear(arg->thread_table);
+    arg->thread_entries_num = 0;
+    arg->last_thread = Qundef;
+    st_clear(arg->method_table);
+    arg->method_entries_num = 1;
+    arg->last_frame = Qundef;
+    arg->count_cache->path_cstr = NULL;
+    arg->count_cache->val = NULL;
+    arg->budget_approached = arg->budget_exceeded = 0;
+    arg->last_class_id = 0;
+    arg->freed_allocation_info = NULL;
+    free(arg->promotion_candidates);
+    arg->promotion_candidates = NULL;
+    arg->promotion_candidates_num = arg->promotion_candidates_capa = 0;
+    delete_lifetime_table(arg);
 
-    if ((!rb_ivar_defined(rb_mAllocationTracer, rb_intern("newobj_hook"))) || ((newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"))) == Qnil)) {
-	rb_raise(rb_eRuntimeError, "not started.");
-    }
-    if (rb_tracepoint_enabled_p(newobj_hook) == Qfalse) {
-	rb_raise(rb_eRuntimeError, "newobj hooks is already disabled.");
-    }
+    free_parent_tables(arg);
+}
 
-    rb_tracepoint_disable(newobj_hook);
+static struct allocation_info *
+create_allocation_info(void)
+{
+    return (struct allocation_info *)ruby_xmalloc(sizeof(struct allocation_info));
 }
 
 static void
-start_alloc_hooks(VALUE mod)
+free_allocation_info(struct traceobj_arg *arg, struct allocation_info *info)
 {
-    VALUE newobj_hook, freeobj_hook;
-    struct traceobj_arg *arg = get_traceobj_arg();
+    delete_unique_str(arg->str_table, info->path);
+    ruby_xfree(info);
+}
 
-    if (!rb_ivar_defined(rb_mAllocationTracer, rb_intern("newobj_hook"))) {
-	rb_ivar_set(rb_mAllocationTracer, rb_intern("newobj_hook"), newobj_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, newobj_i, arg));
-	rb_ivar_set(rb_mAllocationTracer, rb_intern("freeobj_hook"), freeobj_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_FREEOBJ, freeobj_i, arg));
+static VALUE
+group_class(struct traceobj_arg *arg, VALUE klass)
+{
+    if (!(arg->class_grouping & CLASS_GROUP_SINGLETON) || !FL_TEST(klass, FL_SINGLETON)) {
+	klass = rb_class_real(klass);
     }
-    else {
-	newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"));
-	freeobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("freeobj_hook"));
+    if (arg->class_grouping & CLASS_GROUP_ANON_SUPERCLASS) {
+	/* rb_mod_name() only returns a permanent name and doesn't allocate */
+	while (RB_TYPE_P(klass, T_CLASS) && !FL_TEST(klass, FL_SINGLETON) && NIL_P(rb_mod_name(klass))) {
+	    VALUE super = rb_class_get_superclass(klass);
+	    if (!RTEST(super)) break;
+	    klass = rb_class_real(super);
+	}
     }
+    return klass;
+}
 
-    rb_tracepoint_enable(newobj_hook);
-    rb_tracepoint_enable(freeobj_hook);
+/*
+ * Compaction can't allocate, so moved_classes has room for all keys of
+ * class_table. Return 0 if out of memory.
+ */
+static int
+reserve_moved_classes(struct traceobj_arg *arg, size_t num)
+{
+    if (num > arg->moved_classes_capa) {
+	size_t capa = arg->moved_classes_capa ? arg->moved_classes_capa * 2 : 64;
+	struct moved_class *buff;
+
+	while (capa < num) capa *= 2;
+	if ((buff = realloc(arg->moved_classes, sizeof(struct moved_class) * capa)) == NULL) return 0;
+	arg->moved_classes = buff;
+	arg->moved_classes_capa = capa;
+    }
+    return 1;
 }
 
-static VALUE
-stop_alloc_hooks(VALUE self)
+/*
+ * Return a dense id of the class of an object.
+ * klass is RBASIC_CLASS(obj). It is cached in class_table, so that
+ * rb_class_real() and grouping rules are applied only once per class.
+ */
+static size_t
+class_id(struct traceobj_arg *arg, VALUE klass)
 {
-    struct traceobj_arg * arg = get_traceobj_arg();
-    check_tracer_running();
+    st_data_t id;
+    VALUE grouped;
+
+    if (!RTEST(klass)) return 0;
+    if (klass == arg->last_klass) return arg->last_class_id;
+    if (st_lookup(arg->class_table, (st_data_t)klass, &id)) goto hit;
+    /* class_table is not flushed during GC */
+    if (arg->moved && lookup_moved_class(arg, klass, &id, FALSE)) return (size_t)id;
+    if (!reserve_moved_classes(arg, arg->class_table->num_entries + 2)) return 0;
+
+    grouped = group_class(arg, klass);
+
+    if (!st_lookup(arg->class_table, (st_data_t)grouped, &id)) {
+	if (arg->class_entries_num == arg->class_entries_capa) {
+	    arg->class_entries_capa *= 2;
+	    REALLOC_N(arg->class_entries, struct class_entry, arg->class_entries_capa);
+	}
+	id = (st_data_t)arg->class_entries_num++;
+	arg->class_entries[id].klass = grouped;
+	/* the class can be freed before results. rb_mod_name() only returns a permanent name */
+	arg->class_entries[id].name = rb_mod_name(grouped);
+	st_insert(arg->class_table, (st_data_t)grouped, id);
+    }
 
-    {
-	VALUE newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"));
-	VALUE freeobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("freeobj_hook"));
-	rb_tracepoint_disable(newobj_hook);
-	rb_tracepoint_disable(freeobj_hook);
+    /* keys of class_table are pinned in count_only mode. do not pin singleton classes (and their attached objects) */
+    if (klass != grouped && FL_TEST(klass, FL_SINGLETON)) return (size_t)id;
+    st_insert(arg->class_table, (st_data_t)klass, id);
 
-	clear_traceobj_arg();
+  hit:
+    arg->last_klass = klass;
+    arg->last_class_id = (size_t)id;
+    return (size_t)id;
+}
 
-	arg->running = 0;
-    }
+/*
+ * resolve class name once. anonymous classes are not cached because they can be named later.
+ * freed anonymous classes have no name.
+ */
+static VALUE
+class_name(struct traceobj_arg *arg, size_t id)
+{
+    struct class_entry *entry = &arg->class_entries[id];
+
+    if (id == 0) return Qnil;
+    if (NIL_P(entry->name)) {
+	VALUE name;
+	if (!RTEST(entry->klass)) return Qnil;
+	name = rb_mod_name(entry->klass);
+	if (NIL_P(name)) return rb_inspect(entry->klass);
+	entry->name = rb_str_new_frozen(name);
+    }
+    return entry->name;
+}
+
+/*
+ * Classes are not marked by the tracer (except in count_only mode, which
+ * has no FREEOBJ hook), so freed classes are removed from class_table
+ * here. A new class can reuse the address.
+ */
+static void
+forget_class(struct traceobj_arg *arg, VALUE klass)
+{
+    st_data_t key = (st_data_t)klass, id;
+
+    if (st_delete(arg->class_table, &key, &id) || lookup_moved_class(arg, klass, &id, TRUE)) {
+	if (arg->class_entries[id].klass == klass) {
+	    arg->class_entries[id].klass = Qfalse;
+	}
+    }
+    if (klass == arg->last_klass) arg->last_klass = Qundef;
+}
+
+/* return a dense id of the current thread */
+static size_t
+current_thread_id(struct traceobj_arg *arg)
+{
+    VALUE thread = rb_thread_current();
+    st_data_t id;
+
+    if (thread == arg->last_thread) return arg->last_thread_id;
+
+    if (!st_lookup(arg->thread_table, (st_data_t)thread, &id)) {
+	if (arg->thread_entries_num == arg->thread_entries_capa) {
+	    arg->thread_entries_capa *= 2;
+	    REALLOC_N(arg->thread_entries, struct thread_entry, arg->thread_entries_capa);
+	}
+	id = (st_data_t)arg->thread_entries_num++;
+	arg->thread_entries[id].thread = thread;
+	arg->thread_entries[id].label = Qnil;
+	arg->thread_entries[id].allocated_count = 0;
+	arg->thread_entries[id].fiber_id = 0;
+	st_insert(arg->thread_table, (st_data_t)thread, id);
+    }
+
+    arg->last_thread = thread;
+    arg->last_thread_id = (size_t)id;
+    return (size_t)id;
+}
+
+/*
+ * Return a dense id of the method (or the top-level/class body) of the
+ * nearest Ruby-level frame. C frames are skipped so that the method
+ * matches path and line. rb_profile_frames() doesn't allocate and
+ * returns method entries for blocks, so blocks count as their method.
+ */
+static size_t
+current_method_id(struct traceobj_arg *arg)
+{
+    VALUE frames[8];
+    int lines[8];
+    int i, n = rb_profile_frames(0, 8, frames, lines);
+    st_data_t id;
+
+    for (i=0; i<n && lines[i] == 0; i++);
+    if (i == n) return 0;
+    if (frames[i] == arg->last_frame) return arg->last_method_id;
+
+    if (!st_lookup(arg->method_table, (st_data_t)frames[i], &id)) {
+	if (arg->method_entries_num == arg->method_entries_capa) {
+	    arg->method_entries_capa *= 2;
+	    REALLOC_N(arg->method_entries, struct method_entry, arg->method_entries_capa);
+	}
+	id = (st_data_t)arg->method_entries_num++;
+	arg->method_entries[id].frame = frames[i];
+	arg->method_entries[id].label = Qnil;
+	st_insert(arg->method_table, (st_data_t)frames[i], id);
+    }
+
+    arg->last_frame = frames[i];
+    arg->last_method_id = (size_t)id;
+    return (size_t)id;
+}
+
+/*
+ * Fiber ids are kept in a hidden instance variable of fibers (its name
+ * has no "@"), and the id of the current fiber is kept in the thread
+ * entry, so that NEWOBJ hooks don't look up the current fiber.
+ */
+static void
+fiber_switch_i(VALUE tpval, void *data)
+{
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    VALUE fiber = rb_fiber_current();
+    VALUE id = rb_attr_get(fiber, id_fiber_id);
+
+    if (NIL_P(id)) {
+	rb_ivar_set(fiber, id_fiber_id, id = SIZET2NUM(++arg->fiber_num));
+    }
+    arg->thread_entries[current_thread_id(arg)].fiber_id = NUM2SIZET(id);
+}
+
+/* system malloc is used because candidates are compacted during GC */
+static void
+add_promotion_candidate(struct traceobj_arg *arg, VALUE obj)
+{
+    if (arg->promotion_candidates_num == arg->promotion_candidates_capa) {
+	size_t capa = arg->promotion_candidates_capa ? arg->promotion_candidates_capa * 2 : 1024;
+	VALUE *buff = realloc(arg->promotion_candidates, sizeof(VALUE) * capa);
+
+	if (buff == NULL) return; /* not checked. still counted in died_old_count */
+	arg->promotion_candidates = buff;
+	arg->promotion_candidates_capa = capa;
+    }
+    arg->promotion_candidates[arg->promotion_candidates_num++] = obj;
+}
+
+static void check_memory_budget(struct traceobj_arg *arg);
+
+/*
+ * Body of NEWOBJ hooks. keys and site are constants in the variants
+ * specialized for common configurations (see hook_variants), so that
+ * unused information is not collected. site is non-zero if path and
+ * line are needed. extras is zero in the variants, which are used only
+ * without thread counts, memory budget, alarms, GC records and promotion
+ * tracking (fixed while running), so that they are not checked.
+ */
+static inline void
+newobj_body(VALUE tpval, struct traceobj_arg *arg, const int keys, const int site, const int extras)
+{
+    struct allocation_info *info;
+    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
+    VALUE obj = rb_tracearg_object(tparg);
+    VALUE path = Qnil, line = INT2FIX(0), klass = Qnil;
+    size_t thread_id = 0;
+
+    if ((keys & KEY_THREAD_MASK) || (extras && arg->thread_count)) {
+	thread_id = current_thread_id(arg);
+	arg->thread_entries[thread_id].allocated_count++;
+    }
+
+    if (extras && arg->memory_budget && (++arg->budget_check & BUDGET_CHECK_INTERVAL) == 0) {
+	check_memory_budget(arg);
+    }
+    /* can be changed while running */
+    if (arg->sampling_rate > 1) {
+	if (++arg->sampling_count < arg->sampling_rate) {
+	    arg->allocated_count_table[BUILTIN_TYPE(obj)]++;
+	    arg->sampled_out_count++;
+	    return;
+	}
+	arg->sampling_count = 0;
+    }
+    if (extras && arg->budget_exceeded) {
+	arg->allocated_count_table[BUILTIN_TYPE(obj)]++;
+	arg->dropped_count++;
+	return;
+    }
+
+    if (site) {
+	path = rb_tracearg_path(tparg);
+	line = rb_tracearg_lineno(tparg);
+    }
+    if (keys & KEY_CLASS_MASK) {
+	switch(BUILTIN_TYPE(obj)) {
+	  case T_NODE:
+	  case T_IMEMO:
+	    break;
+	  default:
+	    klass = RBASIC_CLASS(obj);
+	}
+    }
+    const char *path_cstr = RTEST(path) ? cached_unique_str(arg->str_table, RSTRING_PTR(path), RSTRING_LEN(path)) : NULL;
+
+    if (extras && site && arg->alarm && arg->alarm->site_threshold) {
+	alarm_count_site(arg->alarm, arg->str_table, path_cstr, NUM2INT(line));
+    }
+
+#ifdef HAVE_RB_GC_LOCATION
+    if (arg->moved) flush_moved_objects(arg);
+#endif
+
+    if (st_lookup(arg->object_table, (st_data_t)obj, (st_data_t *)&info)) {
+	if (info->living) {
+	    /* do nothing. there is possibility to keep living if FREEOBJ events while suppressing tracing */
+	}
+	/* reuse info */
+	delete_unique_str(arg->str_table, info->path);
+    }
+    else {
+	info = create_allocation_info();
+    }
+
+    info->next = NULL;
+    info->flags = RBASIC(obj)->flags;
+    info->living = 1;
+    info->memsize = 0;
+    info->class_id = (keys & KEY_CLASS_MASK) ? class_id(arg, klass) : 0;
+    info->thread_id = (unsigned int)thread_id;
+    info->fiber_id = (keys & KEY_FIBER) ? (unsigned int)arg->thread_entries[thread_id].fiber_id : 0;
+    info->method_id = (keys & KEY_METHOD) ? (unsigned int)current_method_id(arg) : 0;
+    info->data_type = NULL;
+    info->generation = rb_gc_count();
+    info->promoted_generation = 0;
+
+    info->path = path_cstr;
+    info->line = NUM2INT(line);
+
+    st_insert(arg->object_table, (st_data_t)obj, (st_data_t)info);
+    if (extras && (arg->vals & VAL_PROMOTION)) add_promotion_candidate(arg, obj);
+
+    arg->allocated_count_table[BUILTIN_TYPE(obj)]++;
+    if (extras && arg->gc_records) arg->gc_records->allocated_count++;
+}
+
+static void
+newobj_i(VALUE tpval, void *data)
+{
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    newobj_body(tpval, arg, arg->keys, 1, 1);
+}
+
+static void
+newobj_path_line_i(VALUE tpval, void *data)
+{
+    newobj_body(tpval, (struct traceobj_arg *)data, KEY_PATH | KEY_LINE, 1, 0);
+}
+
+static void
+newobj_path_line_type_i(VALUE tpval, void *data)
+{
+    newobj_body(tpval, (struct traceobj_arg *)data, KEY_PATH | KEY_LINE | KEY_TYPE, 1, 0);
+}
+
+static void
+newobj_path_line_class_i(VALUE tpval, void *data)
+{
+    newobj_body(tpval, (struct traceobj_arg *)data, KEY_PATH | KEY_LINE | KEY_CLASS, 1, 0);
+}
+
+/* path and line are not collected */
+static void
+newobj_type_i(VALUE tpval, void *data)
+{
+    newobj_body(tpval, (struct traceobj_arg *)data, KEY_TYPE, 0, 0);
+}
+
+/*
+ * NEWOBJ hook of count-only mode. Only a counter of the site in
+ * aggregate_table is incremented, so that no per-object state is kept.
+ * Sampling, memory budget and alarms are not supported.
+ */
+static void
+newobj_count_i(VALUE tpval, void *data)
+{
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    struct count_cache *cache = arg->count_cache;
+    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
+    VALUE obj = rb_tracearg_object(tparg);
+    const int keys = arg->keys;
+    struct memcmp_key_data key_data;
+    struct aggregate_values *val_buff;
+    const char *path_cstr = NULL;
+    st_data_t val;
+    size_t thread_id = 0;
+    int i = 0, new_path = 0;
+
+    if ((keys & KEY_THREAD_MASK) || arg->thread_count) {
+	thread_id = current_thread_id(arg);
+	arg->thread_entries[thread_id].allocated_count++;
+    }
+    arg->allocated_count_table[BUILTIN_TYPE(obj)]++;
+
+    if (keys & KEY_PATH) {
+	VALUE path = rb_tracearg_path(tparg);
+
+	if (!RTEST(path)) {
+	    /* NULL */
+	}
+	else if (cache->path_cstr && RSTRING_LEN(path) == cache->path_len &&
+		 memcmp(RSTRING_PTR(path), cache->path_cstr, cache->path_len) == 0) {
+	    path_cstr = cache->path_cstr;
+	}
+	else {
+	    if (!st_get_key(arg->str_table, (st_data_t)RSTRING_PTR(path), (st_data_t *)&path_cstr)) {
+		/* owned by the new aggregate key */
+		path_cstr = make_unique_str(arg->str_table, RSTRING_PTR(path), RSTRING_LEN(path));
+		new_path = 1;
+	    }
+	    cache->path_cstr = path_cstr;
+	    cache->path_len = RSTRING_LEN(path);
+	}
+	key_data.data[i++] = (st_data_t)path_cstr;
+    }
+    if (keys & KEY_LINE) {
+	key_data.data[i++] = (st_data_t)NUM2INT(rb_tracearg_lineno(tparg));
+    }
+    if (keys & KEY_TYPE) {
+	key_data.data[i++] = (st_data_t)BUILTIN_TYPE(obj);
+    }
+    if (keys & KEY_CLASS_MASK) {
+	VALUE klass = Qnil;
+	if (!RB_TYPE_P(obj, T_NODE) && !RB_TYPE_P(obj, T_IMEMO)) klass = RBASIC_CLASS(obj);
+	if (keys & KEY_CLASS) key_data.data[i++] = (st_data_t)class_id(arg, klass);
+	if (keys & KEY_CLASS_NAME) key_data.data[i++] = (st_data_t)class_id(arg, klass);
+    }
+    if (keys & KEY_THREAD) {
+	key_data.data[i++] = (st_data_t)thread_id;
+    }
+    if (keys & KEY_FIBER) {
+	key_data.data[i++] = (st_data_t)arg->thread_entries[thread_id].fiber_id;
+    }
+    if (keys & KEY_METHOD) {
+	key_data.data[i++] = (st_data_t)current_method_id(arg);
+    }
+    key_data.n = i;
+
+    if (cache->val && memcmp(cache->key.data, key_data.data, i * sizeof(st_data_t)) == 0) {
+	cache->val->count++;
+	return;
+    }
+
+    if (!new_path && st_lookup(arg->aggregate_table, (st_data_t)&key_data, &val)) {
+	val_buff = (struct aggregate_values *)val;
+    }
+    else if (arg->exporting) {
+	/* write_json is walking aggregate_table */
+	if (new_path) {
+	    delete_unique_str(arg->str_table, path_cstr);
+	    cache->path_cstr = NULL;
+	}
+	arg->dropped_count++;
+	return;
+    }
+    else {
+	struct memcmp_key_data *key_buff = ALLOC(struct memcmp_key_data);
+	*key_buff = key_data;
+	val_buff = ALLOC(struct aggregate_values);
+	MEMZERO(val_buff, struct aggregate_values, 1);
+	if ((keys & KEY_PATH) && !new_path) keep_unique_str(arg->str_table, path_cstr);
+	st_insert(arg->aggregate_table, (st_data_t)key_buff, (st_data_t)val_buff);
+    }
+
+    val_buff->count++;
+    cache->key = key_data;
+    cache->val = val_buff;
+}
+
+/* file, line, type, klass, class name, thread, fiber, method, data type */
+#define MAX_KEY_SIZE 9
+
+static int
+flags_promoted_p(VALUE flags)
+{
+#ifdef FL_PROMOTED
+    return (flags & FL_PROMOTED) ? 1 : 0;
+#elif defined(FL_PROMOTED0) && defined(FL_PROMOTED1)
+    return (flags & FL_PROMOTED0 && flags & FL_PROMOTED1) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+static size_t
+obj_slot_size(VALUE obj)
+{
+#ifdef HAVE_RB_GC_OBJ_SLOT_SIZE
+    return rb_gc_obj_slot_size(obj);
+#else
+    return sizeof(VALUE) * 5; /* sizeof(RVALUE) */
+#endif
+}
+
+static int
+size_bucket(size_t size)
+{
+    int i = 0;
+    while (size > 1 && i < SIZE_BUCKETS - 1) {
+	size >>= 1;
+	i++;
+    }
+    return i;
+}
+
+static void
+add_size_distribution(struct aggregate_values *val, size_t memsize, size_t slot_size)
+{
+    struct size_distribution *dist = val->dist;
+    int i;
+
+    if (dist == NULL) {
+	dist = val->dist = ALLOC(struct size_distribution);
+	MEMZERO(dist, struct size_distribution, 1);
+    }
+
+    dist->buckets[size_bucket(memsize)]++;
+    if (memsize > slot_size) dist->non_embedded_count++;
+
+    for (i=0; i<SLOT_SIZE_CLASSES; i++) {
+	if (dist->slots[i].slot_size == slot_size || dist->slots[i].count == 0) {
+	    dist->slots[i].slot_size = slot_size;
+	    dist->slots[i].count++;
+	    break;
+	}
+    }
+}
+
+static void
+merge_size_distribution(struct size_distribution *dst, const struct size_distribution *src)
+{
+    int i, j;
+
+    for (i=0; i<SIZE_BUCKETS; i++) {
+	dst->buckets[i] += src->buckets[i];
+    }
+    for (i=0; i<SLOT_SIZE_CLASSES && src->slots[i].count; i++) {
+	for (j=0; j<SLOT_SIZE_CLASSES; j++) {
+	    if (dst->slots[j].slot_size == src->slots[i].slot_size || dst->slots[j].count == 0) {
+		dst->slots[j].slot_size = src->slots[i].slot_size;
+		dst->slots[j].count += src->slots[i].count;
+		break;
+	    }
+	}
+    }
+    dst->non_embedded_count += src->non_embedded_count;
+}
+
+/*
+ * Hash of the content of strings and small frozen arrays, or 0.
+ * Elements of arrays are compared by identity. Shared strings and arrays
+ * are skipped because they don't own their content (and the shared root
+ * can be already freed at FREEOBJ). With +freeing+ (at FREEOBJ, in GC),
+ * long strings are skipped so that GC pauses don't grow with their
+ * length.
+ */
+static st_index_t
+content_hash(VALUE obj, int freeing)
+{
+    st_index_t h;
+
+    if (FL_TEST_RAW(obj, ELTS_SHARED)) return 0;
+
+    switch (BUILTIN_TYPE(obj)) {
+      case T_STRING:
+	if (freeing && RSTRING_LEN(obj) > CONTENT_FREED_STRING_MAX) return 0;
+	h = rb_memhash(RSTRING_PTR(obj), RSTRING_LEN(obj)) ^ T_STRING;
+	break;
+      case T_ARRAY:
+	if (!OBJ_FROZEN_RAW(obj) || RARRAY_LEN(obj) > CONTENT_ARRAY_MAX_LEN) return 0;
+	h = rb_memhash(RARRAY_CONST_PTR(obj), RARRAY_LEN(obj) * sizeof(VALUE)) ^ T_ARRAY;
+	break;
+      default:
+	return 0;
+    }
+    return h ? h : 1;
+}
+
+/* count the content. the first object of each content is not a duplicate */
+static void
+add_content(struct aggregate_values *val, st_index_t hash, size_t memsize)
+{
+    struct content_stats *contents = val->contents;
+
+    if (contents == NULL) {
+	contents = val->contents = ALLOC(struct content_stats);
+	MEMZERO(contents, struct content_stats, 1);
+	contents->hashes = st_init_numtable();
+    }
+
+    contents->count++;
+    if (st_lookup(contents->hashes, (st_data_t)hash, NULL)) {
+	contents->duplicate_memsize += memsize;
+    }
+    else {
+	contents->distinct_count++;
+	if (contents->hashes->num_entries < CONTENT_HASHES_MAX) {
+	    st_insert(contents->hashes, (st_data_t)hash, (st_data_t)memsize);
+	    content_hashes_num++;
+	}
+    }
+}
+
+struct merge_content_data {
+    struct content_stats *dst;
+    int update;                 /* add hashes into dst->hashes */
+};
+
+static int
+merge_content_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct merge_content_data *md = (struct merge_content_data *)data;
+    struct content_stats *dst = md->dst;
+
+    if (dst->hashes && st_lookup(dst->hashes, key, NULL)) {
+	/* the first object of src is a duplicate of dst */
+	dst->distinct_count--;
+	dst->duplicate_memsize += (size_t)val;
+    }
+    else if (md->update && dst->hashes && dst->hashes->num_entries < CONTENT_HASHES_MAX) {
+	st_insert(dst->hashes, key, val);
+	content_hashes_num++;
+    }
+    return ST_CONTINUE;
+}
+
+/* with update == 0, dst->hashes are not modified (only counters are merged) */
+static void
+merge_content_stats(struct content_stats *dst, const struct content_stats *src, int update)
+{
+    struct merge_content_data md;
+
+    dst->count += src->count;
+    dst->distinct_count += src->distinct_count;
+    dst->duplicate_memsize += src->duplicate_memsize;
+
+    md.dst = dst;
+    md.update = update;
+    st_foreach(src->hashes, merge_content_i, (st_data_t)&md);
+}
+
+/* type of typed data objects, or NULL */
+static const rb_data_type_t *
+data_type_of(VALUE obj)
+{
+    if (BUILTIN_TYPE(obj) == T_DATA && RTYPEDDATA_P(obj)) {
+	return RTYPEDDATA_TYPE(obj);
+    }
+    return NULL;
+}
+
+/* obj is a living object, or 0 for a freed object. keys is a constant in specialized variants */
+static inline void
+aggregate_info_body(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj, const int keys)
+{
+    st_data_t key, val;
+    struct memcmp_key_data key_data;
+    struct aggregate_values *val_buff;
+    size_t age = (int)(gc_count - info->generation);
+    int i = 0;
+
+    if (keys & KEY_PATH) {
+	key_data.data[i++] = (st_data_t)info->path;
+    }
+    if (keys & KEY_LINE) {
+	key_data.data[i++] = (st_data_t)info->line;
+    }
+    if (keys & KEY_TYPE) {
+	key_data.data[i++] = (st_data_t)(info->flags & T_MASK);
+    }
+    if (keys & KEY_CLASS) {
+	key_data.data[i++] = (st_data_t)info->class_id;
+    }
+    if (keys & KEY_CLASS_NAME) {
+	key_data.data[i++] = (st_data_t)info->class_id;
+    }
+    if (keys & KEY_THREAD) {
+	key_data.data[i++] = (st_data_t)info->thread_id;
+    }
+    if (keys & KEY_FIBER) {
+	key_data.data[i++] = (st_data_t)info->fiber_id;
+    }
+    if (keys & KEY_METHOD) {
+	key_data.data[i++] = (st_data_t)info->method_id;
+    }
+    if (keys & KEY_DATA_TYPE) {
+	/* type pointers are static, so they are used as keys as is */
+	if (obj) info->data_type = data_type_of(obj);
+	key_data.data[i++] = (st_data_t)info->data_type;
+    }
+    key_data.n = i;
+    key = (st_data_t)&key_data;
+
+    if (st_lookup(arg->aggregate_table, key, &val) == 0) {
+	struct memcmp_key_data *key_buff = ruby_xmalloc(sizeof(struct memcmp_key_data));
+	key_buff->n = key_data.n;
+
+	for (i=0; i<key_data.n; i++) {
+	    key_buff->data[i] = key_data.data[i];
+	}
+	key = (st_data_t)key_buff;
+
+	val_buff = ALLOC(struct aggregate_values);
+	MEMZERO(val_buff, struct aggregate_values, 1);
+	val_buff->min_age = val_buff->max_age = age;
+
+	if (keys & KEY_PATH) keep_unique_str(arg->str_table, info->path);
+
+	st_insert(arg->aggregate_table, (st_data_t)key_buff, (st_data_t)val_buff);
+    }
+    else {
+	val_buff = (struct aggregate_values *)val;
+    }
+
+    val_buff->count += 1;
+    if (flags_promoted_p(info->flags)) val_buff->old_count += 1;
+    val_buff->total_age += age;
+    if (val_buff->min_age > age) val_buff->min_age = age;
+    if (val_buff->max_age < age) val_buff->max_age = age;
+    if (obj && data_type_of(obj)) {
+	/* native memory of living typed data objects (dsize), with or without the data_type key */
+	val_buff->memsize += rb_obj_memsize_of(obj);
+    }
+    else {
+	val_buff->memsize += info->memsize;
+    }
+
+    if (info->promoted_generation) {
+	val_buff->promoted_count += 1;
+	val_buff->total_promotion_age += info->promoted_generation - info->generation;
+    }
+    /* also counts promotions not observed by check_promotion (unknown age) */
+    if (!info->living && flags_promoted_p(info->flags)) val_buff->died_old_count += 1;
+
+    if ((arg->vals & VAL_RETAINED) && obj) {
+	val_buff->retained_count += 1;
+	val_buff->retained_memsize += rb_obj_memsize_of(obj);
+    }
+
+    if (arg->vals & VAL_SIZE_DISTRIBUTION) {
+	if (obj) {
+	    add_size_distribution(val_buff, rb_obj_memsize_of(obj), obj_slot_size(obj));
+	}
+	else {
+	    add_size_distribution(val_buff, info->memsize, info->slot_size);
+	}
+    }
+    if (arg->vals & VAL_DUPLICATE) {
+	st_index_t hash = obj ? content_hash(obj, FALSE) : info->content_hash;
+	if (hash) add_content(val_buff, hash, obj ? rb_obj_memsize_of(obj) : info->memsize);
+    }
+}
+
+static void
+aggregate_info_generic(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj)
+{
+    aggregate_info_body(arg, info, gc_count, obj, arg->keys);
+}
+
+static void
+aggregate_info_path_line(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj)
+{
+    aggregate_info_body(arg, info, gc_count, obj, KEY_PATH | KEY_LINE);
+}
+
+static void
+aggregate_info_path_line_type(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj)
+{
+    aggregate_info_body(arg, info, gc_count, obj, KEY_PATH | KEY_LINE | KEY_TYPE);
+}
+
+static void
+aggregate_info_path_line_class(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj)
+{
+    aggregate_info_body(arg, info, gc_count, obj, KEY_PATH | KEY_LINE | KEY_CLASS);
+}
+
+static void
+aggregate_info_type(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj)
+{
+    aggregate_info_body(arg, info, gc_count, obj, KEY_TYPE);
+}
+
+static void
+aggregate_each_info(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj)
+{
+    arg->aggregate_info(arg, info, gc_count, obj);
+}
+
+static const struct hook_variant {
+    int keys;
+    void (*newobj)(VALUE tpval, void *data);
+    void (*aggregate)(struct traceobj_arg *arg, struct allocation_info *info, size_t gc_count, VALUE obj);
+} hook_variants[] = {
+    {KEY_PATH | KEY_LINE, newobj_path_line_i, aggregate_info_path_line},
+    {KEY_PATH | KEY_LINE | KEY_TYPE, newobj_path_line_type_i, aggregate_info_path_line_type},
+    {KEY_PATH | KEY_LINE | KEY_CLASS, newobj_path_line_class_i, aggregate_info_path_line_class},
+    {KEY_TYPE, newobj_type_i, aggregate_info_type},
+};
+
+/*
+ * choose hooks specialized for the configuration, or generic ones.
+ * RUBY_ALLOCATION_TRACER_GENERIC_HOOKS forces generic ones to compare
+ * them (see benchmark/hook_variants.rb).
+ */
+static void
+select_hook_variant(struct traceobj_arg *arg)
+{
+    size_t i;
+
+    arg->newobj_func = newobj_i;
+    arg->aggregate_info = aggregate_info_generic;
+
+    if (arg->count_only) {
+	arg->newobj_func = newobj_count_i;
+	return;
+    }
+
+    /* variants don't check them (see newobj_body) */
+    if (getenv("RUBY_ALLOCATION_TRACER_GENERIC_HOOKS") ||
+	arg->thread_count || arg->memory_budget || arg->alarm || arg->gc_records || (arg->vals & VAL_PROMOTION)) {
+	return;
+    }
+
+    for (i=0; i<sizeof(hook_variants)/sizeof(hook_variants[0]); i++) {
+	if (hook_variants[i].keys == arg->keys) {
+	    arg->newobj_func = hook_variants[i].newobj;
+	    arg->aggregate_info = hook_variants[i].aggregate;
+	    break;
+	}
+    }
+}
+
+static void
+aggregate_freed_info(void *data)
+{
+    size_t gc_count = rb_gc_count();
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    struct allocation_info *info = arg->freed_allocation_info;
+
+    /* tables are walked by write_json. aggregated after that */
+    if (arg->exporting) return;
+
+    arg->freed_allocation_info = NULL;
+
+    if (arg->running) {
+	while (info) {
+	    struct allocation_info *next_info = info->next;
+	    aggregate_each_info(arg, info, gc_count, 0);
+	    free_allocation_info(arg, info);
+	    info = next_info;
+	}
+    }
+}
+
+#define ST_ENTRY_SIZE (sizeof(st_data_t) * 4) /* entry and bin */
+
+static int
+path_bytes_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    *(size_t *)data += strlen((const char *)key) + 1;
+    return ST_CONTINUE;
+}
+
+/* paths are walked only when the number of paths is changed. it doesn't allocate */
+static size_t
+path_bytes(struct traceobj_arg *arg)
+{
+    if (arg->str_bytes_num != arg->str_table->num_entries) {
+	arg->str_bytes = 0;
+	st_foreach(arg->str_table, path_bytes_i, (st_data_t)&arg->str_bytes);
+	arg->str_bytes_num = arg->str_table->num_entries;
+    }
+    return arg->str_bytes;
+}
+
+static size_t
+aggregate_table_memsize(struct traceobj_arg *arg, st_table *table)
+{
+    size_t size = table->num_entries * (ST_ENTRY_SIZE + sizeof(struct memcmp_key_data) + sizeof(struct aggregate_values));
+    if (arg->vals & VAL_SIZE_DISTRIBUTION) size += table->num_entries * sizeof(struct size_distribution);
+    if (arg->vals & VAL_DUPLICATE) size += table->num_entries * sizeof(struct content_stats);
+    return size;
+}
+
+/*
+ * Approximate size of tracer data.
+ * Capacity of st tables is not counted because it is reused after deletion.
+ * Tables inherited from the parent process are not counted because they
+ * can't be evicted (see after_fork).
+ */
+static size_t
+tracer_memsize(struct traceobj_arg *arg)
+{
+    size_t size = 0;
+
+    size += arg->object_table->num_entries * (ST_ENTRY_SIZE + sizeof(struct allocation_info));
+    size += aggregate_table_memsize(arg, arg->aggregate_table);
+    size += aggregate_table_memsize(arg, arg->evicted_table);
+    size += arg->str_table->num_entries * ST_ENTRY_SIZE + path_bytes(arg);
+    size += content_hashes_num * ST_ENTRY_SIZE;
+
+    size += (arg->class_table->num_entries + arg->thread_table->num_entries + arg->method_table->num_entries) * ST_ENTRY_SIZE;
+    size += arg->class_entries_capa * sizeof(struct class_entry);
+    size += arg->thread_entries_capa * sizeof(struct thread_entry);
+    size += arg->method_entries_capa * sizeof(struct method_entry);
+
+    if (arg->gc_records) size += sizeof(struct gc_records) + sizeof(struct gc_record) * (arg->gc_records->size - 1);
+    if (arg->alarm) size += sizeof(struct alarm);
+    size += arg->promotion_candidates_capa * sizeof(VALUE);
+    size += arg->boot_objects_num * sizeof(struct boot_object);
+    size += arg->moved_objects_capa * sizeof(struct moved_object);
+    size += arg->moved_classes_capa * sizeof(struct moved_class);
+    size += (arg->parent_gone.capa + arg->parent_moved.capa) * sizeof(VALUE);
+    return size;
+}
+
+struct evict_data {
+    struct traceobj_arg *arg;
+    size_t gc_count;
+    size_t min_age;
+    size_t num;
+    size_t ages[BUDGET_AGE_BUCKETS];
+};
+
+static size_t
+evict_age(struct evict_data *ed, struct allocation_info *info)
+{
+    size_t age = ed->gc_count - info->generation;
+    return age < BUDGET_AGE_BUCKETS ? age : BUDGET_AGE_BUCKETS - 1;
+}
+
+static int
+count_age_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct evict_data *ed = (struct evict_data *)data;
+    ed->ages[evict_age(ed, (struct allocation_info *)val)]++;
+    return ST_CONTINUE;
+}
+
+static int
+evict_object_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct evict_data *ed = (struct evict_data *)data;
+    struct allocation_info *info = (struct allocation_info *)val;
+
+    if (ed->num == 0) return ST_STOP;
+
+    if (evict_age(ed, info) >= ed->min_age) {
+	aggregate_each_info(ed->arg, info, ed->gc_count, (VALUE)key);
+	free_allocation_info(ed->arg, info);
+	ed->arg->evicted_count++;
+	ed->num--;
+	return ST_DELETE;
+    }
+    return ST_CONTINUE;
+}
+
+/*
+ * evict the oldest live objects into aggregate-only counters. they are
+ * reported as living objects with the age at eviction (see make_live_table).
+ */
+static void
+evict_objects(struct traceobj_arg *arg, size_t num)
+{
+    struct evict_data ed;
+    size_t evictable = 0;
+    int i;
+
+    MEMZERO(&ed, struct evict_data, 1);
+    ed.arg = arg;
+    ed.gc_count = rb_gc_count();
+
+    st_foreach(arg->object_table, count_age_i, (st_data_t)&ed);
+    for (i=BUDGET_AGE_BUCKETS-1; i>0; i--) {
+	evictable += ed.ages[i];
+	if (evictable >= num) break;
+    }
+    ed.min_age = i;
+    ed.num = num;
+
+    /* aggregate into evicted_table to keep stats of dead objects correct */
+    {
+	st_table *aggregate_table = arg->aggregate_table;
+	arg->aggregate_table = arg->evicted_table;
+	st_foreach(arg->object_table, evict_object_i, (st_data_t)&ed);
+	arg->aggregate_table = aggregate_table;
+    }
+}
+
+static void
+enforce_memory_budget(void *data)
+{
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    size_t memsize, target, per_object;
+
+    if (!arg->running || arg->exporting) return;
+#ifdef HAVE_RB_GC_LOCATION
+    if (arg->moved) flush_moved_objects(arg);
+#endif
+
+    memsize = tracer_memsize(arg);
+    target = arg->memory_budget / 2;
+
+    if (memsize > target) {
+	per_object = ST_ENTRY_SIZE + sizeof(struct allocation_info);
+	evict_objects(arg, (memsize - target) / per_object + 1);
+	memsize = tracer_memsize(arg);
+    }
+
+    /* aggregated data itself exceeds the budget */
+    arg->budget_exceeded = memsize > arg->memory_budget;
+}
+
+/*
+ * Called in the allocation hook periodically.
+ * Lower the sampling rate when the budget is approached,
+ * and evict objects when the budget is exceeded.
+ */
+static void
+check_memory_budget(struct traceobj_arg *arg)
+{
+    size_t memsize = tracer_memsize(arg);
+
+    if (memsize > arg->memory_budget / 4 * 3) {
+	/* lower the rate once each time the budget is approached.
+	 * the budget can be exceeded without observing the approach between checks */
+	if (!arg->budget_approached && arg->sampling_rate < BUDGET_MAX_SAMPLING_RATE) {
+	    arg->sampling_rate = arg->sampling_rate > 1 ? arg->sampling_rate * 2 : 2;
+	}
+	arg->budget_approached = 1;
+
+	if (memsize > arg->memory_budget) {
+	    trigger_job(JOB_BUDGET);
+	}
+    }
+    else {
+	arg->budget_approached = 0;
+	arg->budget_exceeded = 0;
+    }
+}
+
+static void
+move_to_freed_list(struct traceobj_arg *arg, VALUE obj, struct allocation_info *info)
+{
+    if (arg->freed_allocation_info == NULL) {
+	trigger_job(JOB_AGGREGATE_FREED);
+    }
+
+    info->next = arg->freed_allocation_info;
+    arg->freed_allocation_info = info;
+    st_delete(arg->object_table, (st_data_t *)&obj, (st_data_t *)&info);
+}
+
+static void
+add_lifetime_table(size_t **lines, int type, struct allocation_info *info)
+{
+    size_t age = rb_gc_count() - info->generation;
+    size_t *line = lines[type];
+    size_t len, i;
+
+    if (line == NULL) {
+	len = age + 1;
+	line = lines[type] = calloc(1 + len, sizeof(size_t));
+	assert(line != NULL);
+	line[0] = len;
+    }
+    else {
+	len = line[0];
+
+	if (len < age + 1) {
+	    size_t old_len = len;
+	    len = age + 1;
+	    line = lines[type] = realloc(line, sizeof(size_t) * (1 + len));
+
+	    assert(line != NULL);
+
+	    for (i=old_len; i<len; i++) {
+		line[i+1] = 0;
+	    }
+
+	    line[0] = len;
+	}
+    }
+
+    line[1 + age]++;
+}
+
+static void
+freeobj_i(VALUE tpval, void *data)
+{
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
+    VALUE obj = rb_tracearg_object(tparg);
+    struct allocation_info *info;
+
+    if (arg->boot_objects_num > 0) {
+	struct boot_object key, *bo;
+	key.obj = obj;
+	bo = bsearch(&key, arg->boot_objects, arg->boot_objects_num, sizeof(struct boot_object), boot_object_cmp);
+	if (bo) bo->flags |= BOOT_FREED;
+    }
+
+    if (st_lookup(arg->object_table, (st_data_t)obj, (st_data_t *)&info) ||
+	lookup_moved_object(arg, obj, &info, TRUE)) {
+
+	info->flags = RBASIC(obj)->flags;
+	info->memsize = rb_obj_memsize_of(obj);
+	info->living = 0;
+	if (arg->keys & KEY_DATA_TYPE) info->data_type = data_type_of(obj);
+	if (arg->vals & VAL_SIZE_DISTRIBUTION) info->slot_size = (unsigned int)obj_slot_size(obj);
+	if (arg->vals & VAL_DUPLICATE) info->content_hash = content_hash(obj, TRUE);
+
+	if (arg->gc_records && arg->gc_records->sweeping) {
+	    gc_records_add_freed_site(arg->gc_records, arg->str_table, info->path, info->line, info->memsize);
+	}
+
+	move_to_freed_list(arg, obj, info);
+
+	if (arg->lifetime_table) {
+	    add_lifetime_table(arg->lifetime_table, BUILTIN_TYPE(obj), info);
+	}
+    }
+    else if (arg->parent_object_table && parent_object_p(arg, obj)) {
+	/* parent-era object. remember the address instead of touching shared pages,
+	 * so that an untraced object reusing it is not counted again */
+	if (!addr_set_delete(&arg->parent_moved, obj)) addr_set_add(&arg->parent_gone, obj);
+	arg->parent_freed_count++;
+    }
+
+    if (BUILTIN_TYPE(obj) == T_CLASS) forget_class(arg, obj);
+
+    arg->freed_count_table[BUILTIN_TYPE(obj)]++;
+}
+
+/*
+ * Objects are promoted after surviving a few GCs (RVALUE_OLD_AGE is 3)
+ * and write barrier unprotected objects are never promoted. So only
+ * objects allocated in the last PROMOTION_WINDOW GCs are checked,
+ * instead of walking object_table. Objects are dropped from the
+ * candidates when they are promoted, freed or too old.
+ */
+#define PROMOTION_WINDOW 4
+
+static void
+check_promotion(struct traceobj_arg *arg, size_t gc_count)
+{
+    size_t i, num = 0;
+
+    for (i=0; i<arg->promotion_candidates_num; i++) {
+	VALUE obj = arg->promotion_candidates[i];
+	struct allocation_info *info;
+
+	if (!st_lookup(arg->object_table, (st_data_t)obj, (st_data_t *)&info) &&
+	    !lookup_moved_object(arg, obj, &info, FALSE)) {
+	    continue; /* freed or evicted */
+	}
+	if (info->promoted_generation) continue;
+
+	if (BUILTIN_TYPE(obj) == (info->flags & T_MASK) && flags_promoted_p(RBASIC(obj)->flags)) {
+	    info->promoted_generation = gc_count;
+	}
+	else if (gc_count - info->generation < PROMOTION_WINDOW) {
+	    arg->promotion_candidates[num++] = obj;
+	}
+    }
+    arg->promotion_candidates_num = num;
+}
+
+static void
+gc_event_i(VALUE tpval, void *data)
+{
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
+
+    struct gc_records *records = arg->gc_records;
+
+    switch (rb_tracearg_event_flag(tparg)) {
+      case RUBY_INTERNAL_EVENT_GC_START:
+	if (arg->alarm && alarm_finish_epoch(arg->alarm, arg->str_table, arg->allocated_count_table, rb_gc_count())) {
+	    trigger_job(JOB_ALARM);
+	}
+	if (records) {
+	    MEMZERO(&records->current, struct gc_record, 1);
+	    records->current.allocated_count = records->allocated_count;
+	    records->allocated_count = 0;
+	    records->start_time = current_time();
+	}
+	break;
+      case RUBY_INTERNAL_EVENT_GC_END_MARK:
+	/* objects are promoted only while marking, so checking here is enough */
+	if (arg->vals & VAL_PROMOTION) {
+	    check_promotion(arg, rb_gc_count());
+	}
+	if (records) {
+	    records->end_mark_time = current_time();
+	    records->current.gc_count = rb_gc_count();
+	    records->current.major = rb_gc_latest_gc_info(sym_major_by) != Qnil;
+	    records->current.mark_wall_time = records->end_mark_time - records->start_time;
+	    records->sweeping = 1;
+	}
+	break;
+      case RUBY_INTERNAL_EVENT_GC_END_SWEEP:
+	if (records && records->sweeping) {
+	    records->current.sweep_wall_time = current_time() - records->end_mark_time;
+	    records->sweeping = 0;
+	    gc_records_finish_cycle(records, arg->str_table);
+	}
+	break;
+    }
+}
+
+static int
+gc_hook_required_p(struct traceobj_arg *arg)
+{
+    return ((arg->vals & VAL_PROMOTION) || arg->gc_records || arg->alarm) ? 1 : 0;
+}
+
+static void
+check_not_exporting(struct traceobj_arg *arg)
+{
+    if (arg->exporting) {
+	rb_raise(rb_eRuntimeError, "can't be called during write_json");
+    }
+}
+
+static void
+check_tracer_running(void)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (!arg->running) {
+	rb_raise(rb_eRuntimeError, "not started yet");
+    }
+}
+
+static void
+enable_newobj_hook(void)
+{
+    VALUE newobj_hook;
+
+    check_tracer_running();
+
+    if (!rb_ivar_defined(rb_mAllocationTracer, rb_intern("newobj_hook"))) {
+	rb_raise(rb_eRuntimeError, "not started.");
+    }
+    newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"));
+    if (rb_tracepoint_enabled_p(newobj_hook)) {
+	rb_raise(rb_eRuntimeError, "newobj hooks is already enabled.");
+    }
+
+    rb_tracepoint_enable(newobj_hook);
+}
+
+static VALUE
+enable_newobj_hook_v(VALUE unused)
+{
+    enable_newobj_hook();
+    return Qnil;
+}
+
+static void disable_newobj_hook(void);
+
+/* call func with the NEWOBJ hook disabled. the hook is enabled even if func raises (e.g. in thread_label) */
+static VALUE
+without_newobj_hook(VALUE (*func)(VALUE), VALUE data)
+{
+    disable_newobj_hook();
+    return rb_ensure(func, data, enable_newobj_hook_v, Qnil);
+}
+
+static void
+disable_newobj_hook(void)
+{
+    VALUE newobj_hook;
+
+    check_tracer_running();
+
+    if ((!rb_ivar_defined(rb_mAllocationTracer, rb_intern("newobj_hook"))) || ((newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"))) == Qnil)) {
+	rb_raise(rb_eRuntimeError, "not started.");
+    }
+    if (rb_tracepoint_enabled_p(newobj_hook) == Qfalse) {
+	rb_raise(rb_eRuntimeError, "newobj hooks is already disabled.");
+    }
+
+    rb_tracepoint_disable(newobj_hook);
+}
+
+static void (*newobj_hook_func)(VALUE tpval, void *data); /* function of the current newobj_hook */
+
+static void
+start_alloc_hooks(VALUE mod)
+{
+    VALUE newobj_hook, freeobj_hook, gc_hook;
+    struct traceobj_arg *arg = get_traceobj_arg();
+
+    if (!rb_ivar_defined(rb_mAllocationTracer, rb_intern("newobj_hook"))) {
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("newobj_hook"), newobj_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, arg->newobj_func, arg));
+	newobj_hook_func = arg->newobj_func;
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("freeobj_hook"), freeobj_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_FREEOBJ, freeobj_i, arg));
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("gc_hook"), gc_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_START | RUBY_INTERNAL_EVENT_GC_END_MARK | RUBY_INTERNAL_EVENT_GC_END_SWEEP, gc_event_i, arg));
+    }
+    else {
+	newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"));
+	freeobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("freeobj_hook"));
+	gc_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("gc_hook"));
+    }
+    if (newobj_hook_func != arg->newobj_func) {
+	/* the variant is changed by the configuration */
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("newobj_hook"), newobj_hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, arg->newobj_func, arg));
+	newobj_hook_func = arg->newobj_func;
+    }
+
+    rb_tracepoint_enable(newobj_hook);
+    if (!arg->count_only) {
+	rb_tracepoint_enable(freeobj_hook);
+	if (gc_hook_required_p(arg)) rb_tracepoint_enable(gc_hook);
+    }
+
+    if (arg->keys & KEY_FIBER) {
+	VALUE fiber_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("fiber_hook"));
+	if (NIL_P(fiber_hook)) {
+	    rb_ivar_set(rb_mAllocationTracer, rb_intern("fiber_hook"), fiber_hook = rb_tracepoint_new(0, RUBY_EVENT_FIBER_SWITCH, fiber_switch_i, arg));
+	}
+	rb_tracepoint_enable(fiber_hook);
+    }
+
+    if (arg->alarm) {
+	rb_funcall(rb_mAllocationTracer, rb_intern("alarm_timer"), 1, DBL2NUM(arg->alarm->interval));
+    }
+}
+
+static VALUE
+stop_alloc_hooks(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    check_tracer_running();
+    check_not_exporting(arg);
+
+    {
+	VALUE newobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("newobj_hook"));
+	VALUE freeobj_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("freeobj_hook"));
+	VALUE gc_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("gc_hook"));
+	VALUE fiber_hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("fiber_hook"));
+	rb_tracepoint_disable(newobj_hook);
+	if (rb_tracepoint_enabled_p(freeobj_hook)) rb_tracepoint_disable(freeobj_hook);
+	if (rb_tracepoint_enabled_p(gc_hook)) rb_tracepoint_disable(gc_hook);
+	if (RTEST(fiber_hook) && rb_tracepoint_enabled_p(fiber_hook)) rb_tracepoint_disable(fiber_hook);
+
+	clear_traceobj_arg();
+
+	arg->running = 0;
+	arg->stop_at = 0;
+    }
+
+    if (arg->alarm) rb_funcall(rb_mAllocationTracer, rb_intern("alarm_timer_stop"), 0);
+    return Qnil;
+}
+
+static VALUE
+type_sym(int type)
+{
+    static VALUE syms[T_MASK] = {0};
+
+    if (syms[0] == 0) {
+	int i;
+	for (i=0; i<T_MASK; i++) {
+	    switch (i) {
+#define TYPE_NAME(t) case (t): syms[i] = ID2SYM(rb_intern(#t)); break;
+		TYPE_NAME(T_NONE);
+		TYPE_NAME(T_OBJECT);
+		TYPE_NAME(T_CLASS);
+		TYPE_NAME(T_MODULE);
+		TYPE_NAME(T_FLOAT);
+		TYPE_NAME(T_STRING);
+		TYPE_NAME(T_REGEXP);
+		TYPE_NAME(T_ARRAY);
+		TYPE_NAME(T_HASH);
+		TYPE_NAME(T_STRUCT);
+		TYPE_NAME(T_BIGNUM);
+		TYPE_NAME(T_FILE);
+		TYPE_NAME(T_MATCH);
+		TYPE_NAME(T_COMPLEX);
+		TYPE_NAME(T_RATIONAL);
+		TYPE_NAME(T_NIL);
+		TYPE_NAME(T_TRUE);
+		TYPE_NAME(T_FALSE);
+		TYPE_NAME(T_SYMBOL);
+		TYPE_NAME(T_FIXNUM);
+		TYPE_NAME(T_UNDEF);
+#ifdef T_IMEMO /* introduced from Rub 2.3 */
+		TYPE_NAME(T_IMEMO);
+#endif
+		TYPE_NAME(T_NODE);
+		TYPE_NAME(T_ICLASS);
+		TYPE_NAME(T_ZOMBIE);
+		TYPE_NAME(T_DATA);
+	      default:
+		syms[i] = ID2SYM(rb_intern("unknown"));
+		break;
+#undef TYPE_NAME
+	    }
+	}
+    }
+
+    return syms[type];
+}
+
+struct arg_and_result {
+    int update;
+    struct traceobj_arg *arg;
+    st_table *dead_table;
+    st_table *skip_table;       /* rows in this table are skipped */
+    VALUE result;
+    /* called for each row instead of storing it into result */
+    void (*row)(struct arg_and_result *aar, VALUE k, VALUE v);
+    void *data;
+};
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static void
+merge_aggregate_values(struct aggregate_values *dst, const struct aggregate_values *src)
+{
+    dst->count += src->count;
+    dst->old_count += src->old_count;
+    dst->total_age += src->total_age;
+    dst->min_age = MIN(dst->min_age, src->min_age);
+    dst->max_age = MAX(dst->max_age, src->max_age);
+    dst->memsize += src->memsize;
+
+    dst->promoted_count += src->promoted_count;
+    dst->total_promotion_age += src->total_promotion_age;
+    dst->died_old_count += src->died_old_count;
+
+    dst->retained_count += src->retained_count;
+    dst->retained_memsize += src->retained_memsize;
+
+    if (src->dist) {
+	if (dst->dist == NULL) {
+	    dst->dist = ALLOC(struct size_distribution);
+	    MEMZERO(dst->dist, struct size_distribution, 1);
+	}
+	merge_size_distribution(dst->dist, src->dist);
+    }
+    if (src->contents) {
+	if (dst->contents == NULL) {
+	    dst->contents = ALLOC(struct content_stats);
+	    MEMZERO(dst->contents, struct content_stats, 1);
+	    dst->contents->hashes = st_init_numtable();
+	}
+	merge_content_stats(dst->contents, src->contents, 1);
+    }
+}
+
+static VALUE
+aggregate_values_to_ary(struct traceobj_arg *arg, const struct aggregate_values *val)
+{
+    VALUE v = rb_ary_new3(6,
+			  SIZET2NUM(val->count), SIZET2NUM(val->old_count),
+			  SIZET2NUM(val->total_age), SIZET2NUM(val->min_age),
+			  SIZET2NUM(val->max_age), SIZET2NUM(val->memsize));
+
+    if (arg->vals & VAL_PROMOTED_COUNT) rb_ary_push(v, SIZET2NUM(val->promoted_count));
+    if (arg->vals & VAL_TOTAL_PROMOTION_AGE) rb_ary_push(v, SIZET2NUM(val->total_promotion_age));
+    if (arg->vals & VAL_DIED_OLD_COUNT) rb_ary_push(v, SIZET2NUM(val->died_old_count));
+
+    if (arg->vals & VAL_SIZE_DISTRIBUTION) {
+	const struct size_distribution *dist = val->dist;
+	int i, len = 0;
+
+	if (arg->vals & VAL_SIZE_HISTOGRAM) {
+	    VALUE hist = rb_ary_new();
+	    if (dist) {
+		for (i=0; i<SIZE_BUCKETS; i++) if (dist->buckets[i]) len = i+1;
+		for (i=0; i<len; i++) rb_ary_push(hist, SIZET2NUM(dist->buckets[i]));
+	    }
+	    rb_ary_push(v, hist);
+	}
+	if (arg->vals & VAL_SLOT_SIZES) {
+	    VALUE slots = rb_hash_new();
+	    for (i=0; dist && i<SLOT_SIZE_CLASSES && dist->slots[i].count; i++) {
+		rb_hash_aset(slots, SIZET2NUM(dist->slots[i].slot_size), SIZET2NUM(dist->slots[i].count));
+	    }
+	    rb_ary_push(v, slots);
+	}
+	if (arg->vals & VAL_NON_EMBEDDED_COUNT) rb_ary_push(v, SIZET2NUM(dist ? dist->non_embedded_count : 0));
+    }
+    if (arg->vals & VAL_DUPLICATE) {
+	const struct content_stats *contents = val->contents;
+	if (arg->vals & VAL_CONTENT_COUNT) rb_ary_push(v, SIZET2NUM(contents ? contents->count : 0));
+	if (arg->vals & VAL_DISTINCT_CONTENT_COUNT) rb_ary_push(v, SIZET2NUM(contents ? contents->distinct_count : 0));
+	if (arg->vals & VAL_DUPLICATE_MEMSIZE) rb_ary_push(v, SIZET2NUM(contents ? contents->duplicate_memsize : 0));
+    }
+    if (arg->vals & VAL_RETAINED_COUNT) rb_ary_push(v, SIZET2NUM(val->retained_count));
+    if (arg->vals & VAL_RETAINED_MEMSIZE) rb_ary_push(v, SIZET2NUM(val->retained_memsize));
+
+    return v;
+}
+
+static int
+aggregate_result_i(st_data_t key, st_data_t val, void *data)
+{
+    struct arg_and_result *aar = (struct arg_and_result *)data;
+    struct traceobj_arg *arg = aar->arg;
+    VALUE result = aar->result;
+    struct aggregate_values *val_buff = (struct aggregate_values *)val;
+    struct aggregate_values merged;
+    struct size_distribution merged_dist;
+    struct content_stats merged_contents;
+    struct aggregate_values dead;
+    struct memcmp_key_data *key_buff = (struct memcmp_key_data *)key;
+    st_data_t dead_val;
+    VALUE v, k;
+    int i = 0;
+
+    if (aar->skip_table && st_lookup(aar->skip_table, key, NULL)) return ST_CONTINUE;
+
+    k = rb_ary_new();
+    if (arg->keys & KEY_PATH) {
+	const char *path = (const char *)key_buff->data[i++];
+	if (path) {
+	    rb_ary_push(k, rb_str_new2(path));
+	}
+	else {
+	    rb_ary_push(k, Qnil);
+	}
+    }
+    if (arg->keys & KEY_LINE) {
+	rb_ary_push(k, INT2FIX((int)key_buff->data[i++]));
+    }
+    if (arg->keys & KEY_TYPE) {
+	int sym_index = key_buff->data[i++];
+	rb_ary_push(k, type_sym(sym_index));
+    }
+    if (arg->keys & KEY_CLASS) {
+	/* freed classes are forgotten (see forget_class) */
+	VALUE klass = arg->class_entries[key_buff->data[i++]].klass;
+	rb_ary_push(k, RTEST(klass) ? klass : Qnil);
+    }
+    if (arg->keys & KEY_CLASS_NAME) {
+	rb_ary_push(k, class_name(arg, (size_t)key_buff->data[i++]));
+    }
+    if (arg->keys & KEY_THREAD) {
+	rb_ary_push(k, arg->thread_entries[key_buff->data[i++]].label);
+    }
+    if (arg->keys & KEY_FIBER) {
+	size_t fiber_id = (size_t)key_buff->data[i++];
+	rb_ary_push(k, fiber_id ? SIZET2NUM(fiber_id) : Qnil);
+    }
+    if (arg->keys & KEY_METHOD) {
+	rb_ary_push(k, arg->method_entries[key_buff->data[i++]].label);
+    }
+    if (arg->keys & KEY_DATA_TYPE) {
+	const rb_data_type_t *data_type = (const rb_data_type_t *)key_buff->data[i++];
+	rb_ary_push(k, data_type ? rb_str_new_cstr(data_type->wrap_struct_name) : Qnil);
+    }
+
+    if (aar->update && st_lookup(aar->dead_table, key, &dead_val)) {
+	merged = *val_buff;
+	if (merged.dist) {
+	    /* do not touch the live table */
+	    merged_dist = *merged.dist;
+	    merged.dist = &merged_dist;
+	}
+	else if (((struct aggregate_values *)dead_val)->dist) {
+	    MEMZERO(&merged_dist, struct size_distribution, 1);
+	    merged.dist = &merged_dist;
+	}
+	dead = *(struct aggregate_values *)dead_val;
+	dead.contents = NULL;
+	merge_aggregate_values(&merged, &dead);
+	if (((struct aggregate_values *)dead_val)->contents) {
+	    if (merged.contents) {
+		merged_contents = *merged.contents;
+	    }
+	    else {
+		MEMZERO(&merged_contents, struct content_stats, 1);
+	    }
+	    merged.contents = &merged_contents;
+	    merge_content_stats(&merged_contents, ((struct aggregate_values *)dead_val)->contents, 0);
+	}
+	val_buff = &merged;
+    }
+
+    v = aggregate_values_to_ary(arg, val_buff);
+    if (aar->row) {
+	aar->row(aar, k, v);
+    }
+    else {
+	rb_hash_aset(result, k, v);
+    }
+
+    return ST_CONTINUE;
+}
+
+static int
+aggregate_live_object_i(st_data_t key, st_data_t val, void *data)
+{
+    VALUE obj = (VALUE)key;
+    struct allocation_info *info = (struct allocation_info *)val;
+    size_t gc_count = rb_gc_count();
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+
+    if (BUILTIN_TYPE(obj) == (info->flags & T_MASK)) {
+	info->flags = RBASIC(obj)->flags;
+	if ((arg->keys & KEY_CLASS_MASK) && !RB_TYPE_P(obj, T_NODE) && !RB_TYPE_P(obj, T_IMEMO)) {
+	    info->class_id = class_id(arg, RBASIC_CLASS(obj));
+	}
+    }
+
+    aggregate_each_info(arg, info, gc_count, obj);
+
+    return ST_CONTINUE;
+}
+
+static int
+lifetime_table_for_live_objects_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct allocation_info *info = (struct allocation_info *)val;
+    VALUE h = (VALUE)data;
+    int type = info->flags & T_MASK;
+    VALUE sym = type_sym(type);
+    size_t age = rb_gc_count() - info->generation;
+    VALUE line;
+    size_t count, i;
+
+    if ((line = rb_hash_aref(h, sym)) == Qnil) {
+	line = rb_ary_new();
+	rb_hash_aset(h, sym, line);
+    }
+
+    for (i=RARRAY_LEN(line); i<age+1; i++) {
+	rb_ary_push(line, INT2FIX(0));
+    }
+
+    count = NUM2SIZET(RARRAY_AREF(line, age));
+    RARRAY_ASET(line, age, SIZET2NUM(count + 1));
+
+    return ST_CONTINUE;
+}
+
+static VALUE
+gc_records_to_ary(struct gc_records *records)
+{
+    VALUE ary = rb_ary_new();
+    size_t i, n = records->num < records->size ? records->num : records->size;
+
+    for (i=records->num - n; i<records->num; i++) {
+	struct gc_record *record = &records->records[i % records->size];
+	VALUE h = rb_hash_new();
+	VALUE sites = rb_ary_new();
+	int j;
+
+	for (j=0; j<record->site_num; j++) {
+	    struct gc_site *site = &record->sites[j];
+	    rb_ary_push(sites, rb_ary_new3(4,
+					   site->path ? rb_str_new2(site->path) : Qnil,
+					   INT2FIX((int)site->line),
+					   SIZET2NUM(site->count),
+					   SIZET2NUM(site->memsize)));
+	}
+
+	rb_hash_aset(h, ID2SYM(rb_intern("gc_count")), SIZET2NUM(record->gc_count));
+	rb_hash_aset(h, ID2SYM(rb_intern("major")), record->major ? Qtrue : Qfalse);
+	rb_hash_aset(h, ID2SYM(rb_intern("mark_wall_time")), DBL2NUM(record->mark_wall_time));
+	rb_hash_aset(h, ID2SYM(rb_intern("sweep_wall_time")), DBL2NUM(record->sweep_wall_time));
+	rb_hash_aset(h, ID2SYM(rb_intern("allocated_count")), SIZET2NUM(record->allocated_count));
+	rb_hash_aset(h, ID2SYM(rb_intern("freed_count")), SIZET2NUM(record->freed_count));
+	rb_hash_aset(h, ID2SYM(rb_intern("freed_memsize")), SIZET2NUM(record->freed_memsize));
+	rb_hash_aset(h, ID2SYM(rb_intern("sites")), sites);
+	rb_ary_push(ary, h);
+    }
+
+    return ary;
+}
+
+static VALUE
+thread_label(struct traceobj_arg *arg, size_t id)
+{
+    return rb_funcall(rb_mAllocationTracer, rb_intern("thread_label"), 1, arg->thread_entries[id].thread);
+}
+
+/*
+ * Resolve labels of threads (see ObjectSpace::AllocationTracer.thread_label).
+ * Return canonical thread ids if some threads have the same label, or NULL.
+ */
+static size_t *
+resolve_thread_labels(struct traceobj_arg *arg)
+{
+    size_t i, j, k, *canon = NULL;
+
+    for (i=0; i<arg->thread_entries_num; i++) {
+	arg->thread_entries[i].label = thread_label(arg, i);
+    }
+    for (i=1; i<arg->thread_entries_num; i++) {
+	for (j=0; j<i; j++) {
+	    if (rb_eql(arg->thread_entries[i].label, arg->thread_entries[j].label)) break;
+	}
+	if (j < i) {
+	    if (canon == NULL) {
+		canon = ALLOC_N(size_t, arg->thread_entries_num);
+		for (k=0; k<arg->thread_entries_num; k++) canon[k] = k;
+	    }
+	    canon[i] = j;
+	}
+    }
+    return canon;
+}
+
+struct regroup_data {
+    st_table *table;
+    int pos;
+    const size_t *canon;
+};
+
+/* canonical ids of keys for regroup(). NULL if nothing to merge */
+struct canon_ids {
+    size_t *thread;
+    size_t *method;
+    size_t *klass;
+    size_t *class_name;
+};
+
+/*
+ * Classes are not pinned, so entries of freed classes are merged into
+ * the id 0 (nil). With by_name, classes which have the same name
+ * (e.g. reloaded classes) are merged too.
+ * Return canonical class ids or NULL.
+ */
+static size_t *
+resolve_class_labels(struct traceobj_arg *arg, int by_name)
+{
+    VALUE first_ids = by_name ? rb_hash_new() : Qnil;
+    size_t i, j, dst, *canon = NULL;
+
+    for (i=1; i<arg->class_entries_num; i++) {
+	dst = i;
+	if (by_name) {
+	    VALUE name = class_name(arg, i), first_id;
+
+	    if (NIL_P(name)) {
+		dst = 0;
+	    }
+	    else if (NIL_P(first_id = rb_hash_lookup(first_ids, name))) {
+		rb_hash_aset(first_ids, name, SIZET2NUM(i));
+	    }
+	    else {
+		dst = NUM2SIZET(first_id);
+	    }
+	}
+	else if (!RTEST(arg->class_entries[i].klass)) {
+	    dst = 0;
+	}
+
+	if (dst != i) {
+	    if (canon == NULL) {
+		canon = ALLOC_N(size_t, arg->class_entries_num);
+		for (j=0; j<arg->class_entries_num; j++) canon[j] = j;
+	    }
+	    canon[i] = dst;
+	}
+    }
+    return canon;
+}
+
+/*
+ * Resolve labels of methods like "Foo#bar". Method entries of a method
+ * can be copied for each receiver class (e.g. methods of modules), so
+ * return canonical method ids if some entries have the same label, or NULL.
+ */
+static size_t *
+resolve_method_labels(struct traceobj_arg *arg)
+{
+    VALUE first_ids = rb_hash_new();
+    size_t i, j, *canon = NULL;
+
+    for (i=1; i<arg->method_entries_num; i++) {
+	struct method_entry *entry = &arg->method_entries[i];
+	VALUE first_id;
+
+	if (NIL_P(entry->label)) {
+	    VALUE label = rb_profile_frame_full_label(entry->frame);
+	    if (NIL_P(label)) continue;
+	    entry->label = rb_str_new_frozen(label);
+	}
+
+	if (NIL_P(first_id = rb_hash_lookup(first_ids, entry->label))) {
+	    rb_hash_aset(first_ids, entry->label, SIZET2NUM(i));
+	}
+	else {
+	    if (canon == NULL) {
+		canon = ALLOC_N(size_t, arg->method_entries_num);
+		for (j=0; j<arg->method_entries_num; j++) canon[j] = j;
+	    }
+	    canon[i] = NUM2SIZET(first_id);
+	}
+    }
+    return canon;
+}
+
+static int
+regroup_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct regroup_data *rd = (struct regroup_data *)data;
+    struct memcmp_key_data *key_buff = (struct memcmp_key_data *)key;
+    st_data_t dst;
+
+    key_buff->data[rd->pos] = rd->canon[key_buff->data[rd->pos]];
+
+    if (st_lookup(rd->table, key, &dst)) {
+	merge_aggregate_values((struct aggregate_values *)dst, (struct aggregate_values *)val);
+	free_aggregate_i(key, val, 0);
+    }
+    else {
+	st_insert(rd->table, key, val);
+    }
+    return ST_CONTINUE;
+}
+
+/* merge entries of threads (methods or classes) which have the same label. target is a key of canon */
+static st_table *
+regroup(struct traceobj_arg *arg, st_table *table, int target, const size_t *canon)
+{
+    struct regroup_data rd;
+    int key;
+
+    rd.table = st_init_table(&memcmp_hash_type);
+    rd.canon = canon;
+    rd.pos = 0;
+    for (key=1; key<target; key<<=1) {
+	if (arg->keys & key) rd.pos++;
+    }
+
+    st_foreach(table, regroup_i, (st_data_t)&rd);
+    st_free_table(table);
+    return rd.table;
+}
+
+static st_table *
+regroup_all(struct traceobj_arg *arg, st_table *table, const struct canon_ids *canon)
+{
+    if (canon->thread) table = regroup(arg, table, KEY_THREAD, canon->thread);
+    if (canon->method) table = regroup(arg, table, KEY_METHOD, canon->method);
+    if (canon->klass) table = regroup(arg, table, KEY_CLASS, canon->klass);
+    if (canon->class_name) table = regroup(arg, table, KEY_CLASS_NAME, canon->class_name);
+    return table;
+}
+
+/*
+ * Aggregate freed objects and merge entries with the same label.
+ * Canonical ids for regroup() are returned.
+ * Call before touching tables because resolving labels can raise.
+ */
+static void
+prepare_aggregate_table(struct traceobj_arg *arg, struct canon_ids *canon)
+{
+    MEMZERO(canon, struct canon_ids, 1);
+    if (arg->keys & KEY_THREAD) canon->thread = resolve_thread_labels(arg);
+    if (arg->keys & KEY_METHOD) canon->method = resolve_method_labels(arg);
+    if (arg->keys & KEY_CLASS) canon->klass = resolve_class_labels(arg, FALSE);
+    if (arg->keys & KEY_CLASS_NAME) canon->class_name = resolve_class_labels(arg, TRUE);
+
+    while (arg->freed_allocation_info) {
+	aggregate_freed_info(arg);
+    }
+#ifdef HAVE_RB_GC_LOCATION
+    if (arg->moved) flush_moved_objects(arg);
+#endif
+    arg->count_cache->val = NULL; /* regroup frees values */
+    arg->aggregate_table = regroup_all(arg, arg->aggregate_table, canon);
+}
+
+/* copy entries of evicted_table. paths are referred by evicted_table */
+static int
+merge_evicted_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    st_table *live_table = (st_table *)data;
+    st_data_t dst;
+
+    if (!st_lookup(live_table, key, &dst)) {
+	struct memcmp_key_data *key_buff = ALLOC(struct memcmp_key_data);
+	struct aggregate_values *val_buff = ALLOC(struct aggregate_values);
+
+	*key_buff = *(struct memcmp_key_data *)key;
+	MEMZERO(val_buff, struct aggregate_values, 1);
+	val_buff->min_age = ((struct aggregate_values *)val)->min_age;
+	st_insert(live_table, (st_data_t)key_buff, (st_data_t)val_buff);
+	dst = (st_data_t)val_buff;
+    }
+    merge_aggregate_values((struct aggregate_values *)dst, (struct aggregate_values *)val);
+    return ST_CONTINUE;
+}
+
+/* make an aggregate table of living objects and evicted objects. free with free_live_table() */
+static st_table *
+make_live_table(struct traceobj_arg *arg, struct canon_ids *canon)
+{
+    st_table *dead_object_aggregate_table = arg->aggregate_table, *live_table;
+
+    arg->aggregate_table = st_init_table(&memcmp_hash_type);
+    st_foreach(arg->object_table, aggregate_live_object_i, (st_data_t)arg);
+    live_table = arg->aggregate_table;
+    arg->aggregate_table = dead_object_aggregate_table;
+    st_foreach(arg->evicted_table, merge_evicted_i, (st_data_t)live_table);
+
+    live_table = regroup_all(arg, live_table, canon);
+    if (canon->thread) ruby_xfree(canon->thread);
+    if (canon->method) ruby_xfree(canon->method);
+    if (canon->klass) ruby_xfree(canon->klass);
+    if (canon->class_name) ruby_xfree(canon->class_name);
+    return live_table;
+}
+
+static void
+free_live_table(st_table *live_table)
+{
+    st_foreach(live_table, free_aggregate_i, 0);
+    st_free_table(live_table);
+}
+
+static VALUE
+aggregate_result(struct traceobj_arg *arg)
+{
+    struct arg_and_result aar;
+    struct canon_ids canon;
+    st_table *live_table;
+
+    MEMZERO(&aar, struct arg_and_result, 1);
+    aar.result = rb_hash_new();
+    aar.arg = arg;
+
+    prepare_aggregate_table(arg, &canon);
+
+    /* collect from recent-freed objects */
+    aar.update = 0;
+    st_foreach(arg->aggregate_table, aggregate_result_i, (st_data_t)&aar);
+
+    /* live objects. merged with dead objects of the same key */
+    live_table = make_live_table(arg, &canon);
+    aar.update = 1;
+    aar.dead_table = arg->aggregate_table;
+    st_foreach(live_table, aggregate_result_i, (st_data_t)&aar);
+    free_live_table(live_table);
+
+    /* lifetime table */
+    if (arg->lifetime_table) {
+	VALUE h = rb_hash_new();
+	int i;
+
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("lifetime_table"), h);
+
+	for (i=0; i<T_MASK; i++) {
+	    size_t *line = arg->lifetime_table[i];
+
+	    if (line) {
+		size_t len = line[0], j;
+		VALUE ary = rb_ary_new();
+		VALUE sym = type_sym(i);
+
+		rb_hash_aset(h, sym, ary);
+
+		for (j=0; j<len; j++) {
+		    rb_ary_push(ary, SIZET2NUM(line[j+1]));
+		}
+	    }
+	}
+
+	st_foreach(arg->object_table, lifetime_table_for_live_objects_i, (st_data_t)h);
+    }
+
+    /* gc records */
+    if (arg->gc_records) {
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("gc_records"), gc_records_to_ary(arg->gc_records));
+    }
+
+    return aar.result;
+}
+
+static VALUE
+aggregate_result_v(VALUE arg)
+{
+    return aggregate_result((struct traceobj_arg *)arg);
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.result  -> hash
+ *
+ *  Returns the current allocated results
+ *
+ *  If you need to know the results of allocation tracing
+ *  without pausing or stopping tracing you can use this method.
+ *
+ *  Example:
+ *
+ *    require 'allocation_tracer'
+ *
+ *    ObjectSpace::AllocationTracer.trace do
+ *      3.times do |i|
+ *        a = "#{i}"
+ *        puts ObjectSpace::AllocationTracer.result
+ *      end
+ *    end
+ *
+ *    # => {["scratch.rb", 5]=>[2, 0, 0, 0, 0, 0]}
+ *    # => {["scratch.rb", 5]=>[4, 0, 0, 0, 0, 0], ["scratch.rb", 6]=>[16, 0, 0, 0, 0, 0]}
+ *    # => {["scratch.rb", 5]=>[6, 0, 0, 0, 0, 0], ["scratch.rb", 6]=>[38, 0, 0, 0, 0, 0]}
+ *
+ */
+static VALUE
+allocation_tracer_result(VALUE self)
+{
+    struct traceobj_arg *arg = get_traceobj_arg();
+
+    check_not_exporting(arg);
+    return without_newobj_hook(aggregate_result_v, (VALUE)arg);
+}
+
+struct sort_entry {
+    double value;
+    VALUE key;
+    VALUE val;
+};
+
+struct sort_data {
+    struct sort_entry *entries;
+    long num;
+    long column, divisor;       /* divisor is -1 if not given */
+};
+
+static double
+sort_value(VALUE val, long i)
+{
+    if (i >= RARRAY_LEN(val) || !RB_INTEGER_TYPE_P(RARRAY_AREF(val, i))) return 0;
+    return NUM2DBL(RARRAY_AREF(val, i));
+}
+
+static int
+sort_result_i(VALUE key, VALUE val, VALUE data)
+{
+    struct sort_data *sd = (struct sort_data *)data;
+    struct sort_entry *entry = &sd->entries[sd->num++];
+
+    Check_Type(val, T_ARRAY);
+    entry->key = key;
+    entry->val = val;
+    entry->value = sort_value(val, sd->column);
+    if (sd->divisor >= 0) {
+	double d = sort_value(val, sd->divisor);
+	entry->value = d > 0 ? entry->value / d : 0;
+    }
+    return ST_CONTINUE;
+}
+
+static int
+sort_entry_cmp(const void *a, const void *b)
+{
+    double x = ((const struct sort_entry *)a)->value, y = ((const struct sort_entry *)b)->value;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.sort_result(result, column, offset, limit)   -> array
+ *
+ * Sorts rows of +result+ (see ObjectSpace::AllocationTracer.result) in
+ * descending order of a value column and returns +limit+ rows from
+ * +offset+ as [key, values] pairs. +column+ is an index of values, or a
+ * pair of indexes [column, divisor] to sort by a ratio such as average age.
+ *
+ * Example:
+ *
+ *     # top 10 sites by count
+ *     ObjectSpace::AllocationTracer.sort_result(result, 0, 0, 10)
+ *     # top 10 sites by average age (total_age / count)
+ *     ObjectSpace::AllocationTracer.sort_result(result, [2, 0], 0, 10)
+ */
+static VALUE
+allocation_tracer_sort_result(VALUE self, VALUE result, VALUE column, VALUE voffset, VALUE vlimit)
+{
+    struct sort_data sd;
+    long offset = NUM2LONG(voffset), limit = NUM2LONG(vlimit), i;
+    VALUE ary, tmp;
+
+    Check_Type(result, T_HASH);
+    if (RB_TYPE_P(column, T_ARRAY)) {
+	if (RARRAY_LEN(column) != 2) rb_raise(rb_eArgError, "column should be an index or [column, divisor]");
+	sd.column = NUM2LONG(RARRAY_AREF(column, 0));
+	sd.divisor = NUM2LONG(RARRAY_AREF(column, 1));
+    }
+    else {
+	sd.column = NUM2LONG(column);
+	sd.divisor = -1;
+    }
+    if (offset < 0 || limit < 0) rb_raise(rb_eArgError, "negative offset or limit");
+
+    /* a temporary buffer pins keys and values */
+    sd.entries = ALLOCV_N(struct sort_entry, tmp, RHASH_SIZE(result));
+    sd.num = 0;
+    rb_hash_foreach(result, sort_result_i, (VALUE)&sd);
+    qsort(sd.entries, sd.num, sizeof(struct sort_entry), sort_entry_cmp);
+
+    ary = rb_ary_new();
+    for (i=offset; i<sd.num && i<offset+limit; i++) {
+	rb_ary_push(ary, rb_assoc_new(sd.entries[i].key, sd.entries[i].val));
+    }
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(result);
+    return ary;
+}
+
+#define JSON_BUFFER_SIZE 8192
+
+struct json_writer {
+    VALUE io;
+    VALUE names;                /* names of columns */
+    int ndjson;
+    int first;
+    size_t len;
+    char buf[JSON_BUFFER_SIZE];
+};
+
+static void
+json_flush(struct json_writer *jw)
+{
+    if (jw->len > 0) {
+	size_t len = jw->len;
+	jw->len = 0;
+	rb_io_write(jw->io, rb_str_new(jw->buf, len));
+    }
+}
+
+static void
+json_write(struct json_writer *jw, const char *str, size_t len)
+{
+    if (jw->len + len > JSON_BUFFER_SIZE) {
+	json_flush(jw);
+	if (len > JSON_BUFFER_SIZE) {
+	    rb_io_write(jw->io, rb_str_new(str, len));
+	    return;
+	}
+    }
+    memcpy(jw->buf + jw->len, str, len);
+    jw->len += len;
+}
+
+#define json_puts(jw, str) json_write((jw), (str), strlen(str))
+
+/* return the length of a valid UTF-8 character at s, or 0 */
+static long
+utf8_char_len(const unsigned char *s, long len)
+{
+    long n, i;
+    unsigned int cp;
+
+    if (s[0] < 0xc2) return 0; /* continuation bytes and overlong 2 bytes forms */
+    else if (s[0] < 0xe0) { n = 2; cp = s[0] & 0x1f; }
+    else if (s[0] < 0xf0) { n = 3; cp = s[0] & 0x0f; }
+    else if (s[0] < 0xf5) { n = 4; cp = s[0] & 0x07; }
+    else return 0;
+
+    if (len < n) return 0;
+    for (i=1; i<n; i++) {
+	if ((s[i] & 0xc0) != 0x80) return 0;
+	cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    if ((n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10ffff)) ||
+	(cp >= 0xd800 && cp <= 0xdfff)) {
+	return 0; /* overlong forms, surrogates and out of range */
+    }
+    return n;
+}
+
+static void
+json_write_str(struct json_writer *jw, const char *str, long len)
+{
+    long i, start = 0, n;
+    char esc[8];
+
+    json_write(jw, "\"", 1);
+    for (i=0; i<len; i++) {
+	unsigned char c = (unsigned char)str[i];
+	if (c >= 0x80) {
+	    if ((n = utf8_char_len((const unsigned char *)str + i, len - i)) > 0) {
+		i += n - 1;
+		continue;
+	    }
+	    /* not UTF-8 (paths are bytes). written as U+0080..U+00FF */
+	    json_write(jw, str + start, i - start);
+	    snprintf(esc, sizeof(esc), "\\u%04x", c);
+	    json_write(jw, esc, 6);
+	    start = i + 1;
+	}
+	else if (c < 0x20 || c == '"' || c == '\\') {
+	    json_write(jw, str + start, i - start);
+	    switch (c) {
+	      case '"':  json_write(jw, "\\\"", 2); break;
+	      case '\\': json_write(jw, "\\\\", 2); break;
+	      case '\n': json_write(jw, "\\n", 2); break;
+	      case '\t': json_write(jw, "\\t", 2); break;
+	      default:
+		snprintf(esc, sizeof(esc), "\\u%04x", c);
+		json_write(jw, esc, 6);
+	    }
+	    start = i + 1;
+	}
+    }
+    json_write(jw, str + start, len - start);
+    json_write(jw, "\"", 1);
+}
+
+static void json_write_value(struct json_writer *jw, VALUE v);
+static VALUE allocation_tracer_header(VALUE self);
+static VALUE allocation_tracer_allocated_count_table(VALUE self);
+static VALUE allocation_tracer_freed_count_table(VALUE self);
+
+static int
+json_write_pair_i(VALUE key, VALUE val, VALUE data)
+{
+    struct json_writer *jw = (struct json_writer *)data;
+    VALUE name = rb_obj_as_string(key);
+
+    if (!jw->first) json_write(jw, ",", 1);
+    jw->first = 0;
+    json_write_str(jw, RSTRING_PTR(name), RSTRING_LEN(name));
+    json_write(jw, ":", 1);
+    json_write_value(jw, val);
+    return ST_CONTINUE;
+}
+
+static void
+json_write_value(struct json_writer *jw, VALUE v)
+{
+    char num[32];
+    long i;
+
+    switch (TYPE(v)) {
+      case T_NIL:
+	json_puts(jw, "null");
+	break;
+      case T_TRUE:
+	json_puts(jw, "true");
+	break;
+      case T_FALSE:
+	json_puts(jw, "false");
+	break;
+      case T_FIXNUM:
+	snprintf(num, sizeof(num), "%ld", FIX2LONG(v));
+	json_puts(jw, num);
+	break;
+      case T_FLOAT:
+	if (!isfinite(RFLOAT_VALUE(v))) {
+	    /* JSON has no Infinity and NaN */
+	    json_puts(jw, "null");
+	    break;
+	}
+	snprintf(num, sizeof(num), "%.17g", RFLOAT_VALUE(v));
+	json_puts(jw, num);
+	break;
+      case T_BIGNUM:
+	v = rb_big2str(v, 10);
+	json_write(jw, RSTRING_PTR(v), RSTRING_LEN(v));
+	break;
+      case T_SYMBOL:
+	v = rb_sym2str(v);
+	json_write_str(jw, RSTRING_PTR(v), RSTRING_LEN(v));
+	break;
+      case T_ARRAY:
+	json_write(jw, "[", 1);
+	for (i=0; i<RARRAY_LEN(v); i++) {
+	    if (i > 0) json_write(jw, ",", 1);
+	    json_write_value(jw, RARRAY_AREF(v, i));
+	}
+	json_write(jw, "]", 1);
+	break;
+      case T_HASH:
+	json_write(jw, "{", 1);
+	jw->first = 1;
+	rb_hash_foreach(v, json_write_pair_i, (VALUE)jw);
+	json_write(jw, "}", 1);
+	break;
+      case T_CLASS:
+      case T_MODULE:
+	if (!NIL_P(rb_mod_name(v))) v = rb_mod_name(v);
+	/* fall through */
+      default:
+	v = rb_obj_as_string(v);
+	json_write_str(jw, RSTRING_PTR(v), RSTRING_LEN(v));
+    }
+}
+
+static void
+json_row(struct arg_and_result *aar, VALUE k, VALUE v)
+{
+    struct json_writer *jw = (struct json_writer *)aar->data;
+    long i, n = RARRAY_LEN(k);
+
+    if (jw->ndjson) {
+	json_write(jw, "{", 1);
+    }
+    else {
+	json_puts(jw, jw->first ? "\n{" : ",\n{");
+    }
+    jw->first = 0;
+
+    for (i=0; i<n + RARRAY_LEN(v); i++) {
+	VALUE name = rb_sym2str(RARRAY_AREF(jw->names, i));
+	if (i > 0) json_write(jw, ",", 1);
+	json_write_str(jw, RSTRING_PTR(name), RSTRING_LEN(name));
+	json_write(jw, ":", 1);
+	json_write_value(jw, i < n ? RARRAY_AREF(k, i) : RARRAY_AREF(v, i - n));
+    }
+    json_puts(jw, jw->ndjson ? "}\n" : "}");
+}
+
+struct write_json_data {
+    struct arg_and_result aar;
+    struct json_writer *jw;
+    st_table *live_table;
+};
+
+static VALUE
+write_json_i(VALUE data)
+{
+    struct write_json_data *wd = (struct write_json_data *)data;
+    struct traceobj_arg *arg = wd->aar.arg;
+    struct json_writer *jw = wd->jw;
+    VALUE counts = rb_hash_new();
+
+    if (!jw->ndjson) {
+	json_puts(jw, "{\"header\":");
+	json_write_value(jw, jw->names);
+	json_puts(jw, ",\"sites\":[");
+    }
+    jw->first = 1;
+
+    /* live objects (merged with dead objects), and then only dead objects */
+    wd->aar.update = 1;
+    wd->aar.dead_table = arg->aggregate_table;
+    st_foreach(wd->live_table, aggregate_result_i, (st_data_t)&wd->aar);
+    wd->aar.update = 0;
+    wd->aar.skip_table = wd->live_table;
+    st_foreach(arg->aggregate_table, aggregate_result_i, (st_data_t)&wd->aar);
+
+    rb_hash_aset(counts, ID2SYM(rb_intern("allocated_count_table")), allocation_tracer_allocated_count_table(rb_mAllocationTracer));
+    rb_hash_aset(counts, ID2SYM(rb_intern("freed_count_table")), allocation_tracer_freed_count_table(rb_mAllocationTracer));
+    if (jw->ndjson) {
+	json_write_value(jw, counts);
+	json_write(jw, "\n", 1);
+    }
+    else {
+	jw->first = 0;          /* continues the object */
+	json_puts(jw, "\n]");
+	rb_hash_foreach(counts, json_write_pair_i, (VALUE)jw);
+	json_puts(jw, "}\n");
+    }
+    json_flush(jw);
+    return Qnil;
+}
+
+static VALUE
+write_json_ensure(VALUE data)
+{
+    struct write_json_data *wd = (struct write_json_data *)data;
+    struct traceobj_arg *arg = wd->aar.arg;
+
+    free_live_table(wd->live_table);
+    ruby_xfree(wd->jw);
+    arg->exporting = 0;
+    if (arg->freed_allocation_info) {
+	aggregate_freed_info(arg);
+    }
+    return Qnil;
+}
+
+static VALUE
+write_json_prepare(VALUE data)
+{
+    struct write_json_data *wd = (struct write_json_data *)data;
+    struct canon_ids canon;
+
+    prepare_aggregate_table(wd->aar.arg, &canon);
+    wd->live_table = make_live_table(wd->aar.arg, &canon);
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.write_json(io, format: :ndjson)   -> NilClass
+ *
+ * Writes the current result (see ObjectSpace::AllocationTracer.result)
+ * as JSON into +io+ without making the result Hash.
+ *
+ * With format: :ndjson, each site is written as a line of an object
+ * with the header names (ObjectSpace::AllocationTracer.header), and the
+ * last line has allocated_count_table and freed_count_table.
+ * With format: :json, one object
+ * {"header": [...], "sites": [...], "allocated_count_table": {...}, "freed_count_table": {...}}
+ * is written.
+ *
+ * Strings are written as UTF-8. Bytes which are not valid UTF-8 are
+ * written as U+0080..U+00FF. Infinite and NaN floats are written as null.
+ *
+ * Output is written with IO#write through a fixed-size buffer, but
+ * memory is not constant: sites of living objects are aggregated into
+ * a table before writing, so it takes O(sites) memory like result.
+ * Tracing is not paused while writing, but result, stop and clear
+ * can't be called.
+ */
+static VALUE
+allocation_tracer_write_json(int argc, VALUE *argv, VALUE self)
+{
+    struct traceobj_arg *arg = get_traceobj_arg();
+    struct write_json_data wd;
+    VALUE io, opts, format = Qundef;
+    ID keyword = rb_intern("format");
+    VALUE names = allocation_tracer_header(self);
+
+    rb_scan_args(argc, argv, "1:", &io, &opts);
+    rb_get_kwargs(opts, &keyword, 0, 1, &format);
+    if (format != Qundef && format != ID2SYM(rb_intern("ndjson")) && format != ID2SYM(rb_intern("json"))) {
+	rb_raise(rb_eArgError, "unknown format: %"PRIsVALUE, rb_inspect(format));
+    }
+    check_not_exporting(arg);
+
+    MEMZERO(&wd.aar, struct arg_and_result, 1);
+    wd.aar.arg = arg;
+    wd.aar.row = json_row;
+    wd.jw = ALLOC(struct json_writer);
+    wd.jw->io = io;
+    wd.jw->names = names;
+    wd.jw->ndjson = format != ID2SYM(rb_intern("json"));
+    wd.jw->len = 0;
+    wd.aar.data = wd.jw;
+
+    without_newobj_hook(write_json_prepare, (VALUE)&wd);
+
+    /* do not modify tables while writing. IO#write can run Ruby code and postponed jobs */
+    arg->exporting = 1;
+    rb_ensure(write_json_i, (VALUE)&wd, write_json_ensure, (VALUE)&wd);
+    RB_GC_GUARD(io);
+    RB_GC_GUARD(names);
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.clear  -> NilClass
+ *
+ *  Clears the current allocated results
+ *
+ *  If you need to clear the results of allocation tracing
+ *  without stopping tracing you can use this method.
+ *
+ */
+static VALUE
+allocation_tracer_clear(VALUE self)
+{
+    struct traceobj_arg *arg = get_traceobj_arg();
+
+    check_not_exporting(arg);
+    clear_traceobj_arg();
+    arg->start_time = current_time();
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.elapsed_time   -> float or nil
+ *
+ * Returns seconds since tracing was started or cleared (nil if not running).
+ * Counts like thread_allocated_count_table are counted in this period.
+ */
+static VALUE
+allocation_tracer_elapsed_time(VALUE self)
+{
+    struct traceobj_arg *arg = get_traceobj_arg();
+
+    return arg->running ? DBL2NUM(current_time() - arg->start_time) : Qnil;
+}
+
+/*! Used in allocation_tracer_trace
+*   to ensure that a result is returned.
+*/
+static VALUE
+allocation_tracer_trace_i(VALUE self)
+{
+    rb_yield(Qnil);
+    return allocation_tracer_result(self);
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.trace { |a, b| block } -> array
+ *     ObjectSpace::AllocationTracer.start                  -> NilClass
+ *
+ *  Traces object allocations inside of the block
+ *
+ *  Objects created inside of the block will be tracked by the tracer.
+ *  If the method is called without a block, the tracer will start
+ *  and continue until ObjectSpace::AllocationTracer.stop is called.
+ *
+ *  Output can be customized with ObjectSpace::AllocationTracer.setup.
+ *
+ *  Example:
+ *
+ *     pp ObjectSpace::AllocationTracer.trace{
+ *       50_000.times{|i|
+ *         i.to_s
+ *         i.to_s
+ *         i.to_s
+ *       }
+ *     }
+ *
+ *     # => {["test.rb", 6]=>[50000, 0, 47440, 0, 1, 0],
+ *           ["test.rb", 7]=>[50000, 4, 47452, 0, 6, 0],
+ *           ["test.rb", 8]=>[50000, 7, 47456, 0, 6, 0]}
+ *
+ */
+static VALUE
+allocation_tracer_trace(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't run recursivly");
+    }
+    else {
+	arg->running = 1;
+	arg->start_time = current_time();
+	arg->sampling_rate = arg->base_sampling_rate;
+	arg->sampled_out_count = arg->evicted_count = arg->dropped_count = 0;
+	if (arg->alarm) alarm_reset(arg->alarm, arg->allocated_count_table);
+	if (arg->keys == 0) arg->keys = KEY_PATH | KEY_LINE;
+	select_hook_variant(arg);
+	start_alloc_hooks(rb_mAllocationTracer);
+
+	if (rb_block_given_p()) {
+	    return rb_ensure(allocation_tracer_trace_i, self, stop_alloc_hooks, Qnil);
+	}
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.stop                  -> array
+ *
+ *  Stops allocation tracing if currently running
+ *
+ *  When allocation tracing is started via ObjectSpace::AllocationTracer.start
+ *  it will continue until this method is called.
+ *
+ *  Example:
+ *    pp ObjectSpace::AllocationTracer.stop
+ *
+ *    # => {["test.rb", 6]=>[50000, 0, 47440, 0, 1, 0],
+ *          ["test.rb", 7]=>[50000, 4, 47452, 0, 6, 0],
+ *          ["test.rb", 8]=>[50000, 7, 47456, 0, 6, 0]}
+ *
+ */
+static VALUE
+allocation_tracer_stop(VALUE self)
+{
+    VALUE result = without_newobj_hook(aggregate_result_v, (VALUE)get_traceobj_arg());
+
+    stop_alloc_hooks(self);
+    return result;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.pause                  -> NilClass
+ *
+ *  Pauses allocation tracing
+ *
+ *  Use in conjunction with ObjectSpace::AllocationTracer.start and
+ *  ObjectSpace::AllocationTracer.stop.
+ *
+ */
+static VALUE
+allocation_tracer_pause(VALUE self)
+{
+    disable_newobj_hook();
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.resume                  -> NilClass
+ *
+ *  Resumes allocation tracing if previously paused
+ *
+ *  See ObjectSpace::AllocationTracer.pause to pause allocation tracing.
+ *
+ */
+static VALUE
+allocation_tracer_resume(VALUE self)
+{
+    enable_newobj_hook();
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.setup([symbol])       -> NilClass
+ *     ObjectSpace::AllocationTracer.setup([symbol], mode: :count_only) -> NilClass
+ *
+ *  Change the format that results will be returned.
+ *
+ *  Takes an array of symbols containing the order you would like the output
+ *  to be returned. Valid options:
+ *
+ *    - :path
+ *    - :line
+ *    - :type
+ *    - :class
+ *    - :class_name (cached name of the class. cheaper than calling Class#name on each key)
+ *    - :thread (label of the thread. see ObjectSpace::AllocationTracer.thread_name_setup)
+ *    - :fiber (id of the fiber given at the first switch to the fiber, or nil)
+ *    - :method (label of the method like "Foo#bar" of the nearest Ruby-level frame)
+ *    - :data_type (wrap_struct_name of typed data objects like "Nokogiri::XML::Document", or nil)
+ *
+ *  Example:
+ *
+ *     ObjectSpace::AllocationTracer.setup(%i{path line type})
+ *
+ *     result = ObjectSpace::AllocationTracer.trace do
+ *       50_000.times{|i|
+ *         a = [i.to_s]
+ *         b = {i.to_s => nil}
+ *         c = (i.to_s .. i.to_s)
+ *       }
+ *     end
+ *
+ *     pp result
+ *
+ *     # => {["test.rb", 8, :T_STRING]=>[50000, 15, 49165, 0, 16, 0],
+ *           ["test.rb", 8, :T_ARRAY]=>[50000, 12, 49134, 0, 16, 0],
+ *           ["test.rb", 9, :T_STRING]=>[100000, 27, 98263, 0, 16, 0],
+ *           ["test.rb", 9, :T_HASH]=>[50000, 16, 49147, 0, 16, 8998848],
+ *           ["test.rb", 10, :T_STRING]=>[100000, 36, 98322, 0, 16, 0],
+ *           ["test.rb", 10, :T_STRUCT]=>[50000, 16, 49147, 0, 16, 0]}
+ *
+ *  With mode: :count_only, only allocations are counted per key.
+ *  Objects are not tracked and the FREEOBJ hook is not enabled, so
+ *  that the memory usage only depends on the number of keys. Values
+ *  other than count (ages, memsize, ...) are 0, and sampling, memory
+ *  budget, alarms, lifetime table and GC records are not supported.
+ *  :data_type key can't be used. mode: :full (default) restores the
+ *  normal mode.
+ *
+ */
+static VALUE
+allocation_tracer_setup(int argc, VALUE *argv, VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    VALUE keys = Qnil, opts, mode = Qundef;
+    ID keyword = rb_intern("mode");
+    int key_flags, count_only;
+
+    argc = rb_scan_args(argc, argv, "01:", &keys, &opts);
+    rb_get_kwargs(opts, &keyword, 0, 1, &mode);
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    /* validate all before changing the configuration */
+    if (mode == Qundef || mode == ID2SYM(rb_intern("full"))) {
+	count_only = 0;
+    }
+    else if (mode == ID2SYM(rb_intern("count_only"))) {
+	count_only = 1;
+    }
+    else {
+	rb_raise(rb_eArgError, "unknown mode: %"PRIsVALUE, rb_inspect(mode));
+    }
+
+    if (argc >= 1) {
+	int i;
+	VALUE ary = rb_check_array_type(keys);
+
+	key_flags = 0;
+
+	for (i=0; i<(int)RARRAY_LEN(ary); i++) {
+	    if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("path"))) key_flags |= KEY_PATH;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("line"))) key_flags |= KEY_LINE;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("type"))) key_flags |= KEY_TYPE;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("class"))) key_flags |= KEY_CLASS;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("class_name"))) key_flags |= KEY_CLASS_NAME;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("thread"))) key_flags |= KEY_THREAD;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("fiber"))) key_flags |= KEY_FIBER;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("method"))) key_flags |= KEY_METHOD;
+	    else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("data_type"))) key_flags |= KEY_DATA_TYPE;
+	    else {
+		rb_raise(rb_eArgError, "not supported key type");
+	    }
+	}
+    }
+    else {
+	key_flags = KEY_PATH | KEY_LINE;
+    }
+    if (count_only && (key_flags & KEY_DATA_TYPE)) {
+	/* the type of data objects is not filled at NEWOBJ */
+	rb_raise(rb_eArgError, "data_type key is not supported with mode: :count_only");
+    }
+
+    arg->count_only = count_only;
+    arg->keys = key_flags;
+    select_hook_variant(arg);
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.header   -> array
+ *
+ *  Return headers
+ *
+ *  Example:
+ *
+ *     puts ObjectSpace::AllocationTracer.header
+ *     => [:path, :line, :count, :old_count, :total_age, :min_age, :max_age, :total_memsize]
+ *
+ */
+VALUE
+allocation_tracer_header(VALUE self)
+{
+    VALUE ary = rb_ary_new();
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->keys & KEY_PATH) rb_ary_push(ary, ID2SYM(rb_intern("path")));
+    if (arg->keys & KEY_LINE) rb_ary_push(ary, ID2SYM(rb_intern("line")));
+    if (arg->keys & KEY_TYPE) rb_ary_push(ary, ID2SYM(rb_intern("type")));
+    if (arg->keys & KEY_CLASS) rb_ary_push(ary, ID2SYM(rb_intern("class")));
+    if (arg->keys & KEY_CLASS_NAME) rb_ary_push(ary, ID2SYM(rb_intern("class_name")));
+    if (arg->keys & KEY_THREAD) rb_ary_push(ary, ID2SYM(rb_intern("thread")));
+    if (arg->keys & KEY_FIBER) rb_ary_push(ary, ID2SYM(rb_intern("fiber")));
+    if (arg->keys & KEY_METHOD) rb_ary_push(ary, ID2SYM(rb_intern("method")));
+    if (arg->keys & KEY_DATA_TYPE) rb_ary_push(ary, ID2SYM(rb_intern("data_type")));
+
+    if (arg->vals & VAL_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("count")));
+    if (arg->vals & VAL_OLDCOUNT) rb_ary_push(ary, ID2SYM(rb_intern("old_count")));
+    if (arg->vals & VAL_TOTAL_AGE) rb_ary_push(ary, ID2SYM(rb_intern("total_age")));
+    if (arg->vals & VAL_MIN_AGE) rb_ary_push(ary, ID2SYM(rb_intern("min_age")));
+    if (arg->vals & VAL_MAX_AGE) rb_ary_push(ary, ID2SYM(rb_intern("max_age")));
+    if (arg->vals & VAL_MEMSIZE) rb_ary_push(ary, ID2SYM(rb_intern("total_memsize")));
+    if (arg->vals & VAL_PROMOTED_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("promoted_count")));
+    if (arg->vals & VAL_TOTAL_PROMOTION_AGE) rb_ary_push(ary, ID2SYM(rb_intern("total_promotion_age")));
+    if (arg->vals & VAL_DIED_OLD_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("died_old_count")));
+    if (arg->vals & VAL_SIZE_HISTOGRAM) rb_ary_push(ary, ID2SYM(rb_intern("size_histogram")));
+    if (arg->vals & VAL_SLOT_SIZES) rb_ary_push(ary, ID2SYM(rb_intern("slot_sizes")));
+    if (arg->vals & VAL_NON_EMBEDDED_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("non_embedded_count")));
+    if (arg->vals & VAL_CONTENT_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("content_count")));
+    if (arg->vals & VAL_DISTINCT_CONTENT_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("distinct_content_count")));
+    if (arg->vals & VAL_DUPLICATE_MEMSIZE) rb_ary_push(ary, ID2SYM(rb_intern("duplicate_memsize")));
+    if (arg->vals & VAL_RETAINED_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("retained_count")));
+    if (arg->vals & VAL_RETAINED_MEMSIZE) rb_ary_push(ary, ID2SYM(rb_intern("retained_memsize")));
+    return ary;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.thread_count_setup(true)   -> NilClass
+ *     ObjectSpace::AllocationTracer.thread_count_setup(false)  -> NilClass
+ *
+ * Counts allocations per thread for thread_allocated_count_table
+ * without :thread key. Allocating threads are kept alive until tracing
+ * is stopped. It is also enabled by :thread and :fiber keys.
+ */
+static VALUE
+allocation_tracer_thread_count_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+    arg->thread_count = RTEST(set);
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.lifetime_table_setup(true)   -> NilClass
+ *
+ * Enables tracing for the generation of objects
+ *
+ * See ObjectSpace::AllocationTracer.lifetime_table for an example.
+ */
+static VALUE
+allocation_tracer_lifetime_table_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    if (RTEST(set)) {
+	if (arg->lifetime_table == NULL) {
+	    arg->lifetime_table = (size_t **)calloc(T_MASK, sizeof(size_t *));
+	}
+    }
+    else {
+	delete_lifetime_table(arg);
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.class_grouping_setup(singleton: :real, anonymous: :each)   -> NilClass
+ *
+ * Configures how classes are grouped for :class and :class_name keys.
+ *
+ * singleton: :real (default) counts objects which have a singleton class
+ * as instances of their real class. :each keeps each singleton class
+ * (and its attached object) as a separate key.
+ *
+ * anonymous: :each (default) keeps each anonymous class as a separate key.
+ * :superclass counts instances of anonymous classes (such as Struct.new
+ * or Class.new(Base)) as instances of the nearest named superclass.
+ *
+ * Rules are applied once when a class is first seen.
+ */
+static VALUE
+allocation_tracer_class_grouping_setup(int argc, VALUE *argv, VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    VALUE opts, v;
+    int grouping = 0;
+
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    if (!NIL_P(opts)) {
+	v = rb_hash_aref(opts, ID2SYM(rb_intern("singleton")));
+	if (v == ID2SYM(rb_intern("each"))) grouping |= CLASS_GROUP_SINGLETON;
+	else if (!NIL_P(v) && v != ID2SYM(rb_intern("real"))) rb_raise(rb_eArgError, "not supported singleton grouping");
+
+	v = rb_hash_aref(opts, ID2SYM(rb_intern("anonymous")));
+	if (v == ID2SYM(rb_intern("superclass"))) grouping |= CLASS_GROUP_ANON_SUPERCLASS;
+	else if (!NIL_P(v) && v != ID2SYM(rb_intern("each"))) rb_raise(rb_eArgError, "not supported anonymous grouping");
+    }
+
+    arg->class_grouping = grouping;
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.promotion_tracking_setup(true)   -> NilClass
+ *
+ * Enables tracking of object promotion (young -> old) per allocation site.
+ *
+ * Promotion of young objects is checked at the end of each marking
+ * phase, so three values are appended to each result: promoted_count
+ * (how many objects were seen promoted), total_promotion_age (sum of
+ * ages at promotion time) and died_old_count (how many objects were
+ * old when freed). Objects which were promoted before tracing started
+ * or after the check window have unknown promotion age, so they are
+ * only counted in died_old_count.
+ * Sites with high died_old_count make major GC expensive.
+ *
+ * Example:
+ *
+ *     ObjectSpace::AllocationTracer.promotion_tracking_setup true
+ *     ObjectSpace::AllocationTracer.header
+ *     # => [:path, :line, :count, :old_count, :total_age, :min_age, :max_age, :total_memsize,
+ *           :promoted_count, :total_promotion_age, :died_old_count]
+ */
+static VALUE
+allocation_tracer_promotion_tracking_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    if (RTEST(set)) {
+	arg->vals |= VAL_PROMOTION;
+    }
+    else {
+	arg->vals &= ~VAL_PROMOTION;
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.size_distribution_setup(true)   -> NilClass
+ *
+ * Enables per-site distribution of object sizes.
+ *
+ * Sizes (rb_obj_memsize_of) are recorded at free time for freed objects
+ * and at result time for living objects. Three values are appended to
+ * each result:
+ *
+ * * size_histogram - counts of power-of-two buckets. The i-th element
+ *   counts objects of 2**i ... 2**(i+1)-1 bytes.
+ * * slot_sizes - {heap slot size => count}. Ruby 3.2+ allocates objects
+ *   in variable width slots.
+ * * non_embedded_count - number of objects larger than their slot,
+ *   that is, objects which are not embedded.
+ *
+ * Example:
+ *
+ *     ObjectSpace::AllocationTracer.size_distribution_setup true
+ *     ObjectSpace::AllocationTracer.setup(%i(line type))
+ *     pp ObjectSpace::AllocationTracer.trace{ 'a' * 10; 'a' * 1000 }
+ *     # => {[3, :T_STRING]=>[4, 0, 0, 0, 0, 0, [0, 0, 0, 0, 0, 3, 0, 0, 0, 0, 1], {40=>4}, 1]}
+ */
+static VALUE
+allocation_tracer_size_distribution_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    if (RTEST(set)) {
+	arg->vals |= VAL_SIZE_DISTRIBUTION;
+    }
+    else {
+	arg->vals &= ~VAL_SIZE_DISTRIBUTION;
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.duplicate_detection_setup(true)   -> NilClass
+ *
+ * Enables detection of duplicated contents of strings and small frozen
+ * arrays (up to 16 elements, compared by identity of elements).
+ *
+ * Contents are hashed at free time for freed objects and at result
+ * time for living objects. Three values are appended to each result:
+ *
+ * * content_count - number of hashed objects.
+ * * distinct_content_count - number of distinct contents. Only 256
+ *   contents are remembered per site and more contents are counted
+ *   as distinct.
+ * * duplicate_memsize - total memsize of objects which have the same
+ *   content as another object of the site.
+ *
+ * Sites with large duplicate_memsize and small distinct_content_count
+ * can use frozen (or deduplicated by String#-@) objects. Shared
+ * strings and arrays are not counted because they don't own contents.
+ *
+ * Example:
+ *
+ *     ObjectSpace::AllocationTracer.duplicate_detection_setup true
+ *     ObjectSpace::AllocationTracer.setup(%i(line))
+ *     pp ObjectSpace::AllocationTracer.trace{ 100.times{|i| 'content-type'; i.to_s } }
+ *     # => {[3]=>[201, 0, 0, 0, 0, 0, 200, 101, 3960], ...}
+ */
+static VALUE
+allocation_tracer_duplicate_detection_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    if (RTEST(set)) {
+	arg->vals |= VAL_DUPLICATE;
+    }
+    else {
+	arg->vals &= ~VAL_DUPLICATE;
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.retained_setup(true)   -> NilClass
+ *
+ * Appends retained_count and retained_memsize to each result: the
+ * number and total memsize (rb_obj_memsize_of) of objects of the site
+ * which are living when the result is made. total_memsize only counts
+ * freed objects.
+ *
+ * Site files (see ObjectSpace::AllocationTracer.save) use them to
+ * compare retained bytes.
+ */
+static VALUE
+allocation_tracer_retained_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    if (RTEST(set)) {
+	arg->vals |= VAL_RETAINED;
+    }
+    else {
+	arg->vals &= ~VAL_RETAINED;
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.gc_records_setup(size)   -> NilClass
+ *     ObjectSpace::AllocationTracer.gc_records_setup(false)  -> NilClass
+ *
+ * Enables per-GC records kept in a ring buffer of +size+ entries.
+ *
+ * Each record shows which allocation sites the objects swept in that
+ * GC cycle came from, with mark and sweep durations.
+ * See ObjectSpace::AllocationTracer.gc_records.
+ */
+static VALUE
+allocation_tracer_gc_records_setup(VALUE self, VALUE size)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    if (arg->gc_records) {
+	gc_records_clear(arg->gc_records, arg->str_table);
+	ruby_xfree(arg->gc_records);
+	arg->gc_records = NULL;
+    }
+
+    if (RTEST(size)) {
+	long n = NUM2LONG(size);
+
+	if (n < 0) {
+	    rb_raise(rb_eArgError, "negative size");
+	}
+	else if (n > 0) {
+	    size_t bytes = sizeof(struct gc_records) + sizeof(struct gc_record) * (n - 1);
+	    arg->gc_records = (struct gc_records *)ruby_xmalloc(bytes);
+	    memset(arg->gc_records, 0, bytes);
+	    arg->gc_records->size = n;
+	}
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.gc_records   -> array
+ *
+ * Returns per-GC records, oldest first.
+ *
+ * While tracing, it returns current records. Otherwise it returns records
+ * captured by the last ObjectSpace::AllocationTracer.result (or stop).
+ *
+ * Each record is a hash with :gc_count, :major, :mark_wall_time,
+ * :sweep_wall_time (in seconds), :allocated_count (traced allocations since the previous GC),
+ * :freed_count, :freed_memsize and :sites. :sites contains top
+ * [path, line, freed_count, freed_memsize] entries ordered by freed memsize.
+ *
+ * mark_wall_time and sweep_wall_time are wall clock spans from the start
+ * of marking to the end of marking and from there to the end of
+ * sweeping. They are not GC time: they include mutator time for
+ * incremental marking and lazy sweeping. Use GC.stat(:time) for GC time.
+ *
+ * Example:
+ *
+ *     ObjectSpace::AllocationTracer.gc_records_setup 16
+ *     ObjectSpace::AllocationTracer.trace do
+ *       ...
+ *     end
+ *     ObjectSpace::AllocationTracer.gc_records.select{|r| r[:major]}
+ *     # => [{:gc_count=>12, :major=>true, :mark_wall_time=>0.0401, :sweep_wall_time=>0.0021,
+ *            :allocated_count=>120312, :freed_count=>98012, :freed_memsize=>5512345,
+ *            :sites=>[["app.rb", 10, 50000, 4000000], ...]}]
+ */
+static VALUE
+allocation_tracer_gc_records(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running && arg->gc_records) {
+	return gc_records_to_ary(arg->gc_records);
+    }
+    else {
+	return rb_ivar_get(rb_mAllocationTracer, rb_intern("gc_records"));
+    }
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/* shared memory segment to collect reports of worker processes */
+
+struct cluster_slot {
+    volatile pid_t pid;
+    volatile unsigned long seq; /* odd while writing */
+    size_t len;
+};
+
+struct cluster_segment {
+    long slots;
+    size_t slot_size;
+};
+
+static struct cluster_segment *cluster_segment;
+static long cluster_slot = -1;
+
+#define CLUSTER_SLOT(seg, i) \
+    ((struct cluster_slot *)((char *)((seg) + 1) + (sizeof(struct cluster_slot) + (seg)->slot_size) * (i)))
+#define CLUSTER_SLOT_DATA(slot) ((char *)((slot) + 1))
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.cluster_setup(slots, slot_size)   -> NilClass
+ *
+ * Creates a shared memory segment with +slots+ slots of +slot_size+ bytes.
+ *
+ * Call it in the parent process before forking workers. Each worker
+ * writes its report with ObjectSpace::AllocationTracer.cluster_publish
+ * and any process can read all of reports with
+ * ObjectSpace::AllocationTracer.cluster_reports.
+ */
+static VALUE
+allocation_tracer_cluster_setup(VALUE self, VALUE vslots, VALUE vslot_size)
+{
+    long slots = NUM2LONG(vslots);
+    size_t slot_size = NUM2SIZET(vslot_size);
+    size_t total;
+    void *ptr;
+
+    if (cluster_segment) {
+	rb_raise(rb_eRuntimeError, "cluster segment is already created");
+    }
+    if (slots <= 0 || slot_size == 0) {
+	rb_raise(rb_eArgError, "invalid size");
+    }
+
+    slot_size = (slot_size + sizeof(VALUE) - 1) & ~(sizeof(VALUE) - 1);
+    total = sizeof(struct cluster_segment) + (sizeof(struct cluster_slot) + slot_size) * slots;
+    ptr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+	rb_sys_fail("mmap");
+    }
+
+    /* mmap returns zero-filled pages */
+    cluster_segment = (struct cluster_segment *)ptr;
+    cluster_segment->slots = slots;
+    cluster_segment->slot_size = slot_size;
+
+    return Qnil;
+}
+
+static long
+cluster_claim_slot(void)
+{
+    long i;
+    int reuse;
+    pid_t self_pid = getpid();
+
+    /* use empty slots first, and then slots of dead processes */
+    for (reuse=0; reuse<2; reuse++) {
+	for (i=0; i<cluster_segment->slots; i++) {
+	    struct cluster_slot *slot = CLUSTER_SLOT(cluster_segment, i);
+	    pid_t pid = slot->pid;
+
+	    if (pid == self_pid) return i;
+	    if ((reuse ? (pid != 0 && kill(pid, 0) == -1 && errno == ESRCH) : pid == 0) &&
+		__sync_bool_compare_and_swap(&slot->pid, pid, self_pid)) {
+		return i;
+	    }
+	}
+    }
+    return -1;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.cluster_publish(str)   -> NilClass
+ *
+ * Writes +str+ into the slot of this process in the shared memory segment.
+ * A slot is claimed at the first call. Slots of dead processes are reused.
+ */
+static VALUE
+allocation_tracer_cluster_publish(VALUE self, VALUE str)
+{
+    struct cluster_slot *slot;
+
+    StringValue(str);
+
+    if (!cluster_segment) {
+	rb_raise(rb_eRuntimeError, "cluster segment is not created");
+    }
+    if ((size_t)RSTRING_LEN(str) > cluster_segment->slot_size) {
+	rb_raise(rb_eArgError, "too large report (%ld bytes)", RSTRING_LEN(str));
+    }
+    if (cluster_slot < 0 && (cluster_slot = cluster_claim_slot()) < 0) {
+	rb_raise(rb_eRuntimeError, "no available cluster slot");
+    }
+
+    slot = CLUSTER_SLOT(cluster_segment, cluster_slot);
+    slot->seq++;
+    __sync_synchronize();
+    memcpy(CLUSTER_SLOT_DATA(slot), RSTRING_PTR(str), RSTRING_LEN(str));
+    slot->len = RSTRING_LEN(str);
+    __sync_synchronize();
+    slot->seq++;
 
     return Qnil;
 }
 
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.cluster_reports   -> array
+ *
+ * Returns [pid, str] pairs written by ObjectSpace::AllocationTracer.cluster_publish.
+ *
+ * str is nil if a consistent report can not be read in about a second,
+ * because the process keeps writing or died while writing it.
+ */
+#define CLUSTER_READ_RETRY 1000
+
 static VALUE
-type_sym(int type)
+allocation_tracer_cluster_reports(VALUE self)
 {
-    static VALUE syms[T_MASK] = {0};
+    VALUE ary = rb_ary_new();
+    long i;
 
-    if (syms[0] == 0) {
-	int i;
-	for (i=0; i<T_MASK; i++) {
-	    switch (i) {
-#define TYPE_NAME(t) case (t): syms[i] = ID2SYM(rb_intern(#t)); break;
-		TYPE_NAME(T_NONE);
-		TYPE_NAME(T_OBJECT);
-		TYPE_NAME(T_CLASS);
-		TYPE_NAME(T_MODULE);
-		TYPE_NAME(T_FLOAT);
-		TYPE_NAME(T_STRING);
-		TYPE_NAME(T_REGEXP);
-		TYPE_NAME(T_ARRAY);
-		TYPE_NAME(T_HASH);
-		TYPE_NAME(T_STRUCT);
-		TYPE_NAME(T_BIGNUM);
-		TYPE_NAME(T_FILE);
-		TYPE_NAME(T_MATCH);
-		TYPE_NAME(T_COMPLEX);
-		TYPE_NAME(T_RATIONAL);
-		TYPE_NAME(T_NIL);
-		TYPE_NAME(T_TRUE);
-		TYPE_NAME(T_FALSE);
-		TYPE_NAME(T_SYMBOL);
-		TYPE_NAME(T_FIXNUM);
-		TYPE_NAME(T_UNDEF);
-#ifdef T_IMEMO /* introduced from Rub 2.3 */
-		TYPE_NAME(T_IMEMO);
-#endif
-		TYPE_NAME(T_NODE);
-		TYPE_NAME(T_ICLASS);
-		TYPE_NAME(T_ZOMBIE);
-		TYPE_NAME(T_DATA);
-	      default:
-		syms[i] = ID2SYM(rb_intern("unknown"));
-		break;
-#undef TYPE_NAME
+    if (!cluster_segment) return ary;
+
+    for (i=0; i<cluster_segment->slots; i++) {
+	struct cluster_slot *slot = CLUSTER_SLOT(cluster_segment, i);
+	pid_t pid = slot->pid;
+	VALUE str = Qnil;
+	int retry;
+
+	if (pid == 0 || slot->seq == 0) continue; /* not published yet */
+
+	for (retry=0; retry<CLUSTER_READ_RETRY; retry++) {
+	    unsigned long seq = slot->seq;
+
+	    if ((seq & 1) == 0) {
+		__sync_synchronize();
+		str = rb_str_new(CLUSTER_SLOT_DATA(slot), slot->len);
+		__sync_synchronize();
+		if (seq == slot->seq) break;
+		str = Qnil;
+	    }
+	    /* being written. wait for the writer */
+	    {
+		struct timeval tv = {0, 1000};
+		rb_thread_wait_for(tv);
 	    }
 	}
+	rb_ary_push(ary, rb_assoc_new(INT2NUM(pid), str));
+    }
+
+    return ary;
+}
+#endif
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.fork_setup(true)   -> NilClass
+ *
+ * Enables fork-aware mode.
+ *
+ * In fork-aware mode, a forked child process traces objects allocated in
+ * the child process only. It does not write the object table inherited
+ * from the parent process (so that copy-on-write pages are kept shared)
+ * until tracing is stopped (see ObjectSpace::AllocationTracer.after_fork).
+ *
+ * ObjectSpace::AllocationTracer.after_fork is called automatically
+ * by Process._fork hook on Ruby 3.1 and later. On older versions, call
+ * it in a child process by yourself (e.g. in after_fork hooks of servers).
+ */
+static VALUE
+allocation_tracer_fork_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    arg->fork_aware = RTEST(set) ? 1 : 0;
+    return Qnil;
+}
+
+static void
+gc_records_reset(struct gc_records *records)
+{
+    size_t i;
+    for (i=0; i<records->size; i++) records->records[i].site_num = 0;
+    MEMZERO(records->site_table, struct gc_site, GC_SITE_TABLE_SIZE);
+    records->site_table_num = 0;
+    records->num = 0;
+    records->sweeping = 0;
+    records->allocated_count = 0;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.after_fork   -> NilClass
+ *
+ * Should be called in a child process just after fork.
+ *
+ * With fork-aware mode, the child process starts with empty tables and
+ * results in the child process only include objects allocated in the
+ * child process. The object table inherited from the parent process (and
+ * its paths) is kept read only until tracing is stopped, so that its
+ * pages stay shared; it is only used to count parent-era objects freed
+ * in the child process (see fork_info). Other tables of the parent
+ * process are freed.
+ */
+static VALUE
+allocation_tracer_after_fork(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    struct allocation_info *info;
+
+#ifdef HAVE_SYS_MMAN_H
+    cluster_slot = -1;
+#endif
+
+    /* boot profile implies fork-aware mode without changing fork_setup */
+    if (!(arg->fork_aware || arg->boot_profile) || !arg->running) return Qnil;
+
+    /* tables of the grandparent process are not needed anymore */
+    if (!arg->boot_paths_owned) free_boot_objects(arg);
+    free_parent_tables(arg);
+
+#ifdef HAVE_RB_GC_LOCATION
+    if (arg->moved) flush_moved_objects(arg);
+#endif
+
+    /* keep the object table read only. the child process has its own tables */
+    path_cache_flush();
+    arg->parent_object_table = arg->object_table;
+    arg->parent_str_table = arg->str_table;
+    arg->object_table = st_init_numtable();
+    arg->str_table = st_init_strtable();
+    arg->boot_paths_owned = 0; /* in parent_str_table */
+
+    /* paths of them are in parent_str_table and freed with it */
+    while ((info = arg->freed_allocation_info) != NULL) {
+	arg->freed_allocation_info = info->next;
+	ruby_xfree(info);
+    }
+    st_foreach(arg->aggregate_table, free_aggregate_i, 0);
+    st_clear(arg->aggregate_table);
+    st_foreach(arg->evicted_table, free_aggregate_i, 0);
+    st_clear(arg->evicted_table);
+    /* the count-only cache refers to freed values and parent's paths */
+    arg->count_cache->path_cstr = NULL;
+    arg->count_cache->val = NULL;
+    arg->promotion_candidates_num = 0;
+
+    MEMZERO(arg->allocated_count_table, size_t, T_MASK);
+    MEMZERO(arg->freed_count_table, size_t, T_MASK);
+    if (arg->lifetime_table) {
+	delete_lifetime_table(arg);
+	arg->lifetime_table = (size_t **)calloc(T_MASK, sizeof(size_t *));
+    }
+    if (arg->gc_records) {
+	gc_records_reset(arg->gc_records);
+    }
+    if (arg->alarm) {
+	alarm_reset(arg->alarm, arg->allocated_count_table);
+    }
+
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.fork_info   -> hash
+ *
+ * Returns information about parent-era objects in a forked child process.
+ *
+ * * :parent_objects - number of traced objects inherited from the parent process.
+ * * :parent_freed_count - number of them freed in this process.
+ */
+static VALUE
+allocation_tracer_fork_info(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    VALUE h = rb_hash_new();
+
+    rb_hash_aset(h, ID2SYM(rb_intern("parent_objects")),
+		 SIZET2NUM(arg->parent_object_table ? arg->parent_object_table->num_entries : 0));
+    rb_hash_aset(h, ID2SYM(rb_intern("parent_freed_count")), SIZET2NUM(arg->parent_freed_count));
+    return h;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.boot_profile_setup(true)   -> NilClass
+ *
+ * Enables boot profile (and fork-aware mode).
+ *
+ * Living traced objects are recorded by
+ * ObjectSpace::AllocationTracer.boot_snapshot at fork, and
+ * ObjectSpace::AllocationTracer.boot_sites reports how many of them are
+ * still shared, freed or write barrier unprotected after that.
+ * See also ObjectSpace::AllocationTracer.boot_profile.
+ */
+static VALUE
+allocation_tracer_boot_profile_setup(VALUE self, VALUE set)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    }
+
+    arg->boot_profile = RTEST(set) ? 1 : 0;
+    return Qnil;
+}
+
+#ifdef HAVE_RB_OBJ_GC_FLAGS
+static ID id_wb_protected;
+#endif
+
+/* BOOT_OLD and BOOT_WB_PROTECTED of a living object */
+static unsigned int
+boot_object_flags(VALUE obj)
+{
+    unsigned int flags = 0;
+
+    if (flags_promoted_p(RBASIC(obj)->flags)) flags |= BOOT_OLD;
+#ifdef HAVE_RB_OBJ_GC_FLAGS
+    {
+	ID ids[16];
+	size_t i, n = rb_obj_gc_flags(obj, ids, 16);
+
+	for (i=0; i<n; i++) {
+	    if (ids[i] == id_wb_protected) flags |= BOOT_WB_PROTECTED;
+	}
+    }
+#endif
+    return flags;
+}
+
+struct boot_snapshot_data {
+    struct traceobj_arg *arg;
+    struct boot_object *objects;
+    size_t num, capa;
+};
+
+static int
+boot_snapshot_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct boot_snapshot_data *sd = (struct boot_snapshot_data *)data;
+    struct allocation_info *info = (struct allocation_info *)val;
+    VALUE obj = (VALUE)key;
+    struct boot_object *bo;
+
+    if (sd->num >= sd->capa) return ST_STOP;
+    if (BUILTIN_TYPE(obj) != (info->flags & T_MASK)) return ST_CONTINUE;
+
+    bo = &sd->objects[sd->num++];
+    bo->obj = obj;
+    bo->path = keep_unique_str(sd->arg->str_table, info->path);
+    bo->memsize = rb_obj_memsize_of(obj);
+    bo->flags = boot_object_flags(obj);
+    return ST_CONTINUE;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.boot_snapshot   -> Integer or nil
+ *
+ * Records living traced objects with their status (old and write
+ * barrier protected) as boot objects, and returns the number of them.
+ * Returns nil if boot profile is not enabled or tracing is not running.
+ *
+ * With boot profile, it is called automatically in the parent process
+ * just before fork by Process._fork hook on Ruby 3.1 and later. On
+ * older versions, call it in the before_fork hook of your server.
+ * The previous snapshot is discarded.
+ */
+static VALUE
+allocation_tracer_boot_snapshot(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    struct boot_snapshot_data sd;
+
+    if (!arg->boot_profile || !arg->running) return Qnil;
+    check_not_exporting(arg);
+#ifdef HAVE_RB_GC_LOCATION
+    if (arg->moved) flush_moved_objects(arg);
+#endif
+
+    free_boot_objects(arg);
+    if (arg->object_table->num_entries == 0) return INT2FIX(0);
+
+#ifdef HAVE_RB_OBJ_GC_FLAGS
+    if (!id_wb_protected) id_wb_protected = rb_intern("wb_protected");
+#endif
+
+    /* use system malloc like moved_objects. it can be large */
+    sd.arg = arg;
+    sd.num = 0;
+    sd.capa = arg->object_table->num_entries;
+    sd.objects = malloc(sizeof(struct boot_object) * sd.capa);
+    if (sd.objects == NULL) rb_memerror();
+
+    /* the table should not be changed while walking */
+    disable_newobj_hook();
+    st_foreach(arg->object_table, boot_snapshot_i, (st_data_t)&sd);
+    enable_newobj_hook();
+    qsort(sd.objects, sd.num, sizeof(struct boot_object), boot_object_cmp);
+
+    /* publish after sorting. freeobj_i and compaction refer them */
+    arg->boot_objects = sd.objects;
+    arg->boot_objects_num = sd.num;
+    arg->boot_paths_owned = 1;
+
+    return SIZET2NUM(arg->boot_objects_num);
+}
+
+struct boot_site {
+    size_t retained_count, retained_memsize;
+    size_t freed_count;
+    size_t wb_unprotected_count, wb_unprotected_memsize;
+};
+
+static int
+boot_site_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct boot_site *site = (struct boot_site *)val;
+    const char *path = (const char *)key;
+
+    rb_hash_aset((VALUE)data, path ? rb_str_new2(path) : Qnil,
+		 rb_ary_new3(5, SIZET2NUM(site->retained_count), SIZET2NUM(site->retained_memsize),
+			     SIZET2NUM(site->freed_count),
+			     SIZET2NUM(site->wb_unprotected_count), SIZET2NUM(site->wb_unprotected_memsize)));
+    ruby_xfree(site);
+    return ST_CONTINUE;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.boot_sites   -> hash
+ *
+ * Returns {path => [retained_count, retained_memsize, freed_count,
+ * wb_unprotected_count, wb_unprotected_memsize]} of boot objects (see
+ * ObjectSpace::AllocationTracer.boot_snapshot) in this process.
+ *
+ * * retained_count, retained_memsize - objects (and their memsize)
+ *   living at the snapshot.
+ * * freed_count - objects freed after the snapshot.
+ * * wb_unprotected_count, wb_unprotected_memsize - living objects which
+ *   lost old or write barrier protected status after the snapshot. Ruby
+ *   does that only when an object is unprotected from write barriers
+ *   (e.g. by C extensions), and they are marked by every minor GC.
+ *
+ * Ordinary writes (instance variables, strings, arrays and so on) are
+ * not detected.
+ */
+static VALUE
+allocation_tracer_boot_sites(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    st_table *sites = st_init_numtable();
+    VALUE h = rb_hash_new();
+    size_t i;
+
+    for (i=0; i<arg->boot_objects_num; i++) {
+	struct boot_object *bo = &arg->boot_objects[i];
+	struct boot_site *site;
+
+	if (!st_lookup(sites, (st_data_t)bo->path, (st_data_t *)&site)) {
+	    site = ALLOC(struct boot_site);
+	    MEMZERO(site, struct boot_site, 1);
+	    st_insert(sites, (st_data_t)bo->path, (st_data_t)site);
+	}
+	site->retained_count++;
+	site->retained_memsize += bo->memsize;
+
+	if (bo->flags & BOOT_FREED) {
+	    site->freed_count++;
+	}
+	else if ((bo->flags & ~boot_object_flags(bo->obj)) & (BOOT_OLD | BOOT_WB_PROTECTED)) {
+	    site->wb_unprotected_count++;
+	    site->wb_unprotected_memsize += bo->memsize;
+	}
+    }
+
+    st_foreach(sites, boot_site_i, (st_data_t)h);
+    st_free_table(sites);
+    return h;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.running?   -> true or false
+ *
+ * Returns true if tracing is started (including paused).
+ */
+static VALUE
+allocation_tracer_running_p(VALUE self)
+{
+    return get_traceobj_arg()->running ? Qtrue : Qfalse;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.sampling_setup(rate)   -> NilClass
+ *
+ * Traces only one of +rate+ allocations (1 traces all allocations).
+ * Counts in results are not scaled. allocated_count_table counts all
+ * allocations. Unlike other settings, it can be changed while running.
+ */
+static VALUE
+allocation_tracer_sampling_setup(VALUE self, VALUE rate)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    long n = NUM2LONG(rate);
+
+    if (n < 1) rb_raise(rb_eArgError, "sampling rate should be positive");
+    arg->sampling_rate = arg->base_sampling_rate = (size_t)n;
+    arg->sampling_count = 0;
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.memory_budget_setup(bytes)   -> NilClass
+ *     ObjectSpace::AllocationTracer.memory_budget_setup(nil)     -> NilClass
+ *
+ * Limits the memory used by the tracer to about +bytes+.
+ *
+ * When the limit is approached, the sampling rate is lowered
+ * (see ObjectSpace::AllocationTracer.sampling_setup). When the limit
+ * is exceeded, the oldest live objects are aggregated and are not traced
+ * anymore. They are still reported as living objects (with the age at
+ * eviction), not as freed ones. If aggregated data alone exceeds
+ * the limit, new allocations are not traced until it is under the limit.
+ *
+ * See ObjectSpace::AllocationTracer.memory_budget_info for dropped data.
+ */
+static VALUE
+allocation_tracer_memory_budget_setup(VALUE self, VALUE bytes)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
     }
 
-    return syms[type];
+    arg->memory_budget = RTEST(bytes) ? NUM2SIZET(bytes) : 0;
+    return Qnil;
+}
+
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.memory_budget_info   -> hash
+ *
+ * Returns the memory usage of the tracer and how much data was dropped.
+ *
+ * * :budget - the limit set by memory_budget_setup (nil if no limit).
+ * * :memsize - approximate memory usage of the tracer.
+ * * :sampling_rate - current sampling rate.
+ * * :sampled_out_count - allocations not traced because of sampling.
+ * * :evicted_count - live objects aggregated before their death.
+ * * :dropped_count - allocations not traced because the limit was exceeded.
+ */
+static VALUE
+allocation_tracer_memory_budget_info(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    VALUE h = rb_hash_new();
+
+    rb_hash_aset(h, ID2SYM(rb_intern("budget")), arg->memory_budget ? SIZET2NUM(arg->memory_budget) : Qnil);
+    rb_hash_aset(h, ID2SYM(rb_intern("memsize")), SIZET2NUM(tracer_memsize(arg)));
+    rb_hash_aset(h, ID2SYM(rb_intern("sampling_rate")), SIZET2NUM(arg->sampling_rate > 1 ? arg->sampling_rate : 1));
+    rb_hash_aset(h, ID2SYM(rb_intern("sampled_out_count")), SIZET2NUM(arg->sampled_out_count));
+    rb_hash_aset(h, ID2SYM(rb_intern("evicted_count")), SIZET2NUM(arg->evicted_count));
+    rb_hash_aset(h, ID2SYM(rb_intern("dropped_count")), SIZET2NUM(arg->dropped_count));
+    return h;
 }
 
-struct arg_and_result {
-    int update;
-    struct traceobj_arg *arg;
-    VALUE result;
-};
+static VALUE
+alarm_call(VALUE ary)
+{
+    return rb_funcall(RARRAY_AREF(ary, 0), rb_intern("call"), 1, RARRAY_AREF(ary, 1));
+}
 
-static int
-aggregate_result_i(st_data_t key, st_data_t val, void *data)
+/* build alarm events and call the callback outside of the allocation hook */
+static void
+alarm_job(void *data)
 {
-    struct arg_and_result *aar = (struct arg_and_result *)data;
-    struct traceobj_arg *arg = aar->arg;
-    VALUE result = aar->result;
-    size_t *val_buff = (size_t *)val;
-    struct memcmp_key_data *key_buff = (struct memcmp_key_data *)key;
-    VALUE v, oldv, k = rb_ary_new();
-    int i = 0;
+    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    struct alarm *alarm = arg->alarm;
+    VALUE events = rb_ary_new(), callback;
+    int i, state;
 
-    i = 0;
-    if (arg->keys & KEY_PATH) {
-	const char *path = (const char *)key_buff->data[i++];
-	if (path) {
-	    rb_ary_push(k, rb_str_new2(path));
+    if (alarm == NULL) return;
+
+    for (i=0; i<alarm->pending_num; i++) {
+	struct alarm_event *event = &alarm->pending[i];
+	VALUE h = rb_hash_new();
+
+	if (event->type < 0) {
+	    rb_hash_aset(h, ID2SYM(rb_intern("path")), event->path ? rb_str_new2(event->path) : Qnil);
+	    rb_hash_aset(h, ID2SYM(rb_intern("line")), INT2FIX((int)event->line));
+	    rb_hash_aset(h, ID2SYM(rb_intern("baseline")), DBL2NUM(event->baseline));
+	    delete_unique_str(arg->str_table, event->path);
 	}
 	else {
-	    rb_ary_push(k, Qnil);
+	    rb_hash_aset(h, ID2SYM(rb_intern("type")), type_sym(event->type));
 	}
+	rb_hash_aset(h, ID2SYM(rb_intern("count")), SIZET2NUM(event->count));
+	rb_hash_aset(h, ID2SYM(rb_intern("rate")), DBL2NUM(event->elapsed > 0 ? event->count / event->elapsed : 0));
+	rb_hash_aset(h, ID2SYM(rb_intern("gc_count")), SIZET2NUM(event->gc_count));
+	rb_ary_push(events, h);
     }
-    if (arg->keys & KEY_LINE) {
-	rb_ary_push(k, INT2FIX((int)key_buff->data[i++]));
-    }
-    if (arg->keys & KEY_TYPE) {
-	int sym_index = key_buff->data[i++];
-	rb_ary_push(k, type_sym(sym_index));
-    }
-    if (arg->keys & KEY_CLASS) {
-	VALUE klass = key_buff->data[i++];
-	if (RTEST(klass) && BUILTIN_TYPE(klass) == T_CLASS) {
-	    klass = rb_class_real(klass);
-	    rb_ary_push(k, klass);
-	    /* TODO: actually, it is dangerous code because klass can be sweeped */
-	    /*       So that class specifier is hidden feature                   */
-	}
-	else {
-	    rb_ary_push(k, Qnil);
+    alarm->pending_num = 0;
+
+    callback = rb_ivar_get(rb_mAllocationTracer, rb_intern("alarm_callback"));
+    for (i=0; i<RARRAY_LEN(events); i++) {
+	rb_protect(alarm_call, rb_assoc_new(callback, RARRAY_AREF(events, i)), &state);
+	if (state) {
+	    VALUE err = rb_errinfo();
+	    rb_set_errinfo(Qnil);
+	    rb_warn("allocation_tracer: alarm callback failed: %"PRIsVALUE, rb_obj_as_string(err));
 	}
     }
+}
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
+static int
+alarm_type_threshold_i(VALUE type, VALUE threshold, VALUE data)
+{
+    size_t *type_thresholds = (size_t *)data;
+    int i;
 
-    if (aar->update && (oldv = rb_hash_aref(result, k)) != Qnil) {
-	v = rb_ary_new3(6,
-			INT2FIX(val_buff[0] + (size_t)FIX2INT(RARRAY_AREF(oldv, 0))), /* count */
-			INT2FIX(val_buff[1] + (size_t)FIX2INT(RARRAY_AREF(oldv, 1))), /* old count */
-			INT2FIX(val_buff[2] + (size_t)FIX2INT(RARRAY_AREF(oldv, 2))), /* total_age */
-			INT2FIX(MIN(val_buff[3], (size_t)FIX2INT(RARRAY_AREF(oldv, 3)))), /* min age */
-			INT2FIX(MAX(val_buff[4], (size_t)FIX2INT(RARRAY_AREF(oldv, 4)))), /* max age */
-			INT2FIX(val_buff[5] + (size_t)FIX2INT(RARRAY_AREF(oldv, 5)))); /* memsize_of */
-    }
-    else {
-	v = rb_ary_new3(6,
-			INT2FIX(val_buff[0]), INT2FIX(val_buff[1]),
-			INT2FIX(val_buff[2]), INT2FIX(val_buff[3]),
-			INT2FIX(val_buff[4]), INT2FIX(val_buff[5]));
+    for (i=0; i<T_MASK; i++) {
+	if (type_sym(i) == type) {
+	    type_thresholds[i] = NUM2SIZET(threshold);
+	    return ST_CONTINUE;
+	}
     }
-
-    rb_hash_aset(result, k, v);
-
-    return ST_CONTINUE;
+    rb_raise(rb_eArgError, "unknown type: %"PRIsVALUE, rb_inspect(type));
 }
 
-static int
-aggregate_live_object_i(st_data_t key, st_data_t val, void *data)
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.alarm_setup(site: count, factor: f, types: {type => count}, interval: sec) { |alarm| ... }   -> NilClass
+ *     ObjectSpace::AllocationTracer.alarm_setup(nil)   -> NilClass
+ *
+ * Calls the block when allocations of a site or a type exceed thresholds.
+ *
+ * Allocations are counted per epoch in the allocation hook and
+ * evaluated when the epoch ends. An epoch ends when GC starts, or after
+ * +interval+ seconds (10 by default) by a timer thread (see
+ * ObjectSpace::AllocationTracer.alarm_tick). The timer thread runs only
+ * while tracing is running. Sites which are idle in an
+ * epoch are forgotten unless their baseline matters. A site alarm trips
+ * when a site allocates +site+ objects or more in an epoch and, if
+ * +factor+ is given, +factor+ times more than its moving average
+ * (baseline). A type alarm trips when +count+ objects of the type are
+ * allocated in an epoch.
+ *
+ * The block is called through a postponed job with a Hash:
+ * {:path, :line, :baseline} for site alarms or {:type} for type alarms,
+ * and {:count, :rate (per second), :gc_count}.
+ *
+ * Example:
+ *
+ *     ObjectSpace::AllocationTracer.alarm_setup(site: 100_000, factor: 10, types: {T_STRING: 1_000_000}){|alarm|
+ *       logger.warn "allocation storm: #{alarm}"
+ *     }
+ */
+static VALUE
+allocation_tracer_alarm_setup(int argc, VALUE *argv, VALUE self)
 {
-    VALUE obj = (VALUE)key;
-    struct allocation_info *info = (struct allocation_info *)val;
-    size_t gc_count = rb_gc_count();
-    struct traceobj_arg *arg = (struct traceobj_arg *)data;
+    struct traceobj_arg * arg = get_traceobj_arg();
+    VALUE set, opts, block, v;
+    struct alarm *alarm;
+    size_t site_threshold = 0, type_thresholds[T_MASK];
+    double factor = 0, interval = 10;
 
-    if (BUILTIN_TYPE(obj) == (info->flags & T_MASK)) {
-	VALUE klass = RBASIC_CLASS(obj);
-	info->flags = RBASIC(obj)->flags;
-	info->klass = (RTEST(klass) && !RB_TYPE_P(obj, T_NODE)) ? rb_class_real(klass) : Qnil;
+    rb_scan_args(argc, argv, "01:&", &set, &opts, &block);
+
+    if (arg->running) {
+	rb_raise(rb_eRuntimeError, "can't change configuration during running");
     }
 
-    aggregate_each_info(arg, info, gc_count);
+    if (argc > 0 && !RTEST(set) && NIL_P(opts)) {
+	if (arg->alarm) {
+	    free(arg->alarm);
+	    arg->alarm = NULL;
+	}
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("alarm_callback"), Qnil);
+	rb_funcall(self, rb_intern("alarm_timer_stop"), 0);
+	return Qnil;
+    }
+    if (NIL_P(block)) rb_raise(rb_eArgError, "no block given");
+
+    MEMZERO(type_thresholds, size_t, T_MASK);
+    if (!NIL_P(opts)) {
+	if (!NIL_P(v = rb_hash_aref(opts, ID2SYM(rb_intern("site"))))) site_threshold = NUM2SIZET(v);
+	if (!NIL_P(v = rb_hash_aref(opts, ID2SYM(rb_intern("factor"))))) factor = NUM2DBL(v);
+	if (!NIL_P(v = rb_hash_aref(opts, ID2SYM(rb_intern("interval"))))) interval = NUM2DBL(v);
+	if (!NIL_P(v = rb_hash_aref(opts, ID2SYM(rb_intern("types"))))) {
+	    rb_hash_foreach(rb_convert_type(v, T_HASH, "Hash", "to_hash"), alarm_type_threshold_i, (VALUE)type_thresholds);
+	}
+    }
 
-    return ST_CONTINUE;
+    alarm = calloc(1, sizeof(struct alarm));
+    if (alarm == NULL) rb_memerror();
+    alarm->site_threshold = site_threshold;
+    alarm->factor = factor;
+    alarm->interval = interval;
+    MEMCPY(alarm->type_thresholds, type_thresholds, size_t, T_MASK);
+
+    free(arg->alarm);
+    arg->alarm = alarm;
+    alarm_reset(alarm, arg->allocated_count_table);
+    rb_ivar_set(rb_mAllocationTracer, rb_intern("alarm_callback"), block);
+    return Qnil;
 }
 
-static int
-lifetime_table_for_live_objects_i(st_data_t key, st_data_t val, st_data_t data)
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.alarm_tick   -> NilClass
+ *
+ * Ends the current alarm epoch if it is longer than the interval given to
+ * ObjectSpace::AllocationTracer.alarm_setup, so that alarms are evaluated
+ * in processes which rarely run GC. Called by the timer thread.
+ */
+static VALUE
+allocation_tracer_alarm_tick(VALUE self)
 {
-    struct allocation_info *info = (struct allocation_info *)val;
-    VALUE h = (VALUE)data;
-    int type = info->flags & T_MASK;
-    VALUE sym = type_sym(type);
-    size_t age = rb_gc_count() - info->generation;
-    VALUE line;
-    size_t count, i;
+    struct traceobj_arg * arg = get_traceobj_arg();
+    struct alarm *alarm = arg->alarm;
 
-    if ((line = rb_hash_aref(h, sym)) == Qnil) {
-	line = rb_ary_new();
-	rb_hash_aset(h, sym, line);
+    if (arg->running && alarm && current_time() - alarm->epoch_start >= alarm->interval) {
+	if (alarm_finish_epoch(alarm, arg->str_table, arg->allocated_count_table, rb_gc_count())) {
+	    trigger_job(JOB_ALARM);
+	}
     }
+    return Qnil;
+}
 
-    for (i=RARRAY_LEN(line); i<age+1; i++) {
-	rb_ary_push(line, INT2FIX(0));
+static VALUE
+control_call(VALUE mid)
+{
+    return rb_funcall(rb_mAllocationTracer, (ID)mid, 0);
+}
+
+/* run control commands outside of signal handlers and tracepoint hooks */
+static void
+control_invoke(ID mid)
+{
+    int state;
+
+    rb_protect(control_call, (VALUE)mid, &state);
+    if (state) {
+	VALUE err = rb_errinfo();
+	rb_set_errinfo(Qnil);
+	rb_warn("allocation_tracer: control command failed: %"PRIsVALUE, rb_obj_as_string(err));
     }
+}
 
-    count = NUM2SIZET(RARRAY_AREF(line, age));
-    RARRAY_ASET(line, age, SIZET2NUM(count + 1));
+static void
+control_execute_job(void *data)
+{
+    control_invoke(rb_intern("control_execute"));
+}
 
-    return ST_CONTINUE;
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.control_request   -> NilClass
+ *
+ * Requests ObjectSpace::AllocationTracer.control_execute at the next
+ * safe point. It can be called from any thread.
+ */
+static VALUE
+allocation_tracer_control_request(VALUE self)
+{
+    trigger_job(JOB_CONTROL);
+    return Qnil;
 }
 
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.control_deadline(sec)   -> NilClass
+ *     ObjectSpace::AllocationTracer.control_deadline(nil)   -> NilClass
+ *
+ * Sets the deadline of tracing to +sec+ seconds later. The deadline is
+ * cleared when tracing is stopped. The allocation hook doesn't check
+ * it; see ObjectSpace::AllocationTracer.control_deadline_passed?.
+ */
 static VALUE
-aggregate_result(struct traceobj_arg *arg)
+allocation_tracer_control_deadline(VALUE self, VALUE sec)
 {
-    struct arg_and_result aar;
-    aar.result = rb_hash_new();
-    aar.arg = arg;
+    struct traceobj_arg * arg = get_traceobj_arg();
 
-    while (arg->freed_allocation_info) {
-	aggregate_freed_info(arg);
-    }
+    check_tracer_running();
+    arg->stop_at = NIL_P(sec) ? 0 : current_time() + NUM2DBL(sec);
+    return Qnil;
+}
 
-    /* collect from recent-freed objects */
-    aar.update = 0;
-    st_foreach(arg->aggregate_table, aggregate_result_i, (st_data_t)&aar);
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.control_deadline_passed?   -> true or false
+ *
+ * Returns true if the deadline set by
+ * ObjectSpace::AllocationTracer.control_deadline has passed and tracing
+ * is not stopped after that.
+ */
+static VALUE
+allocation_tracer_control_deadline_passed_p(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
 
-    {
-	st_table *dead_object_aggregate_table = arg->aggregate_table;
+    return arg->running && arg->stop_at > 0 && current_time() >= arg->stop_at ? Qtrue : Qfalse;
+}
 
-	/* make live object aggregate table */
-	arg->aggregate_table = st_init_table(&memcmp_hash_type);
-	st_foreach(arg->object_table, aggregate_live_object_i, (st_data_t)arg);
+/*
+ *
+ *  call-seq:
+ *     ObjectSpace::AllocationTracer.thread_allocated_count_table   -> hash
+ *
+ * Returns allocation counts per thread label (see
+ * ObjectSpace::AllocationTracer.thread_name_setup) since tracing started.
+ * Allocations skipped by sampling are also counted. Threads are counted
+ * only with :thread or :fiber key, or with
+ * ObjectSpace::AllocationTracer.thread_count_setup (empty otherwise).
+ */
+static VALUE
+allocation_tracer_thread_allocated_count_table(VALUE self)
+{
+    struct traceobj_arg * arg = get_traceobj_arg();
+    VALUE h = rb_hash_new();
+    size_t i;
 
-	/* aggregate table -> Ruby hash */
-	aar.update = 1;
-	st_foreach(arg->aggregate_table, aggregate_result_i, (st_data_t)&aar);
+    for (i=0; i<arg->thread_entries_num; i++) {
+	VALUE label = thread_label(arg, i);
+	VALUE count = rb_hash_lookup2(h, label, INT2FIX(0));
+	rb_hash_aset(h, label, rb_funcall(count, '+', 1, SIZET2NUM(arg->thread_entries[i].allocated_count)));
+    }
+    return h;
+}
 
-	/* remove live object aggregate table */
-	st_foreach(arg->aggregate_table, free_key_values_i, 0);
-	st_free_table(arg->aggregate_table);
+#ifdef HAVE_RB_OBJSPACE_REACHABLE_OBJECTS_FROM
+/* not in public headers, but exported */
+void rb_objspace_reachable_objects_from(VALUE obj, void (func)(VALUE, void *), void *data);
 
-	arg->aggregate_table = dead_object_aggregate_table;
-    }
+#define RETENTION_MAX_CHILDREN 256
 
-    /* lifetime table */
-    if (arg->lifetime_table) {
-	VALUE h = rb_hash_new();
-	int i;
+struct retention_site {
+    const char *path;
+    unsigned long line;
+    size_t count;
+};
 
-	rb_ivar_set(rb_mAllocationTracer, rb_intern("lifetime_table"), h);
+struct retention_scan {
+    struct traceobj_arg *arg;
+    size_t gc_count;
+    size_t min_age;
+    size_t max_objects;
+    size_t scanned_count;
+    double deadline;
+    int complete;
+
+    /*
+     * [path, line, referrer class index, referrer path, referrer line] -> count.
+     * Paths are kept in str_table. Ruby objects are made after the walk.
+     */
+    st_table *hints;
+    st_table *class_index;      /* referrer class -> index of classes (1 origin) */
+    VALUE classes;              /* keeps referrer classes alive while scanning */
+    VALUE site_hints;           /* [path, line] -> {[class name, path, line] of referrer -> count} */
+
+    /* sites of long-lived children of the current referrer */
+    int found_num;
+    struct retention_site found[RETENTION_MAX_CHILDREN];
+};
 
-	for (i=0; i<T_MASK; i++) {
-	    size_t *line = arg->lifetime_table[i];
+/* called while marking children. must not allocate objects here */
+static void
+retention_child_i(VALUE child, void *data)
+{
+    struct retention_scan *rs = (struct retention_scan *)data;
+    st_data_t val;
 
-	    if (line) {
-		size_t len = line[0], j;
-		VALUE ary = rb_ary_new();
-		VALUE sym = type_sym(i);
+    if (rs->found_num < RETENTION_MAX_CHILDREN && st_lookup(rs->arg->object_table, (st_data_t)child, &val)) {
+	struct allocation_info *info = (struct allocation_info *)val;
 
-		rb_hash_aset(h, sym, ary);
+	if (info->living && rs->gc_count - info->generation >= rs->min_age) {
+	    int i;
 
-		for (j=0; j<len; j++) {
-		    rb_ary_push(ary, SIZET2NUM(line[j+1]));
-		}
+	    for (i=0; i<rs->found_num; i++) {
+		if (rs->found[i].path == info->path && rs->found[i].line == info->line) break;
 	    }
+	    if (i == rs->found_num) {
+		rs->found[i].path = info->path;
+		rs->found[i].line = info->line;
+		rs->found[i].count = 0;
+		rs->found_num++;
+	    }
+	    rs->found[i].count++;
 	}
+    }
+}
 
-	st_foreach(arg->object_table, lifetime_table_for_live_objects_i, (st_data_t)h);
+static VALUE
+retention_site_key(const char *path, unsigned long line)
+{
+    return rb_ary_new3(2, path ? rb_str_new2(path) : Qnil, path ? ULONG2NUM(line) : Qnil);
+}
+
+/* the registry of the tracer (class_id) is not used not to keep referrer classes */
+static st_data_t
+retention_class_index(struct retention_scan *rs, VALUE klass)
+{
+    st_data_t index;
+
+    if (!RTEST(klass)) return 0;
+    klass = rb_class_real(klass);
+    if (!RTEST(klass)) return 0;
+    if (!st_lookup(rs->class_index, (st_data_t)klass, &index)) {
+	rb_ary_push(rs->classes, klass);
+	index = (st_data_t)RARRAY_LEN(rs->classes);
+	st_insert(rs->class_index, (st_data_t)klass, index);
     }
+    return index;
+}
 
-    return aar.result;
+static void
+retention_add_hint(struct retention_scan *rs, struct memcmp_key_data *key, size_t count)
+{
+    st_data_t val;
+
+    if (st_lookup(rs->hints, (st_data_t)key, &val)) {
+	st_insert(rs->hints, (st_data_t)key, (st_data_t)((size_t)val + count));
+    }
+    else {
+	struct memcmp_key_data *key_buff = ALLOC(struct memcmp_key_data);
+
+	*key_buff = *key;
+	keep_unique_str(rs->arg->str_table, (const char *)key->data[0]);
+	keep_unique_str(rs->arg->str_table, (const char *)key->data[3]);
+	st_insert(rs->hints, (st_data_t)key_buff, (st_data_t)count);
+    }
 }
 
-/*
- *
- *  call-seq:
- *     ObjectSpace::AllocationTracer.result  -> hash
- *
- *  Returns the current allocated results
- *
- *  If you need to know the results of allocation tracing
- *  without pausing or stopping tracing you can use this method.
- *
- *  Example:
- *
- *    require 'allocation_tracer'
- *
- *    ObjectSpace::AllocationTracer.trace do
- *      3.times do |i|
- *        a = "#{i}"
- *        puts ObjectSpace::AllocationTracer.result
- *      end
- *    end
- *
- *    # => {["scratch.rb", 5]=>[2, 0, 0, 0, 0, 0]}
- *    # => {["scratch.rb", 5]=>[4, 0, 0, 0, 0, 0], ["scratch.rb", 6]=>[16, 0, 0, 0, 0, 0]}
- *    # => {["scratch.rb", 5]=>[6, 0, 0, 0, 0, 0], ["scratch.rb", 6]=>[38, 0, 0, 0, 0, 0]}
- *
- */
+/* referrers and their children are living while scanning, so are their paths */
 static VALUE
-allocation_tracer_result(VALUE self)
+retention_scan_i(RB_BLOCK_CALL_FUNC_ARGLIST(obj, data))
+{
+    struct retention_scan *rs = (struct retention_scan *)data;
+    struct memcmp_key_data key;
+    st_data_t val;
+    int i;
+
+    if (rs->scanned_count >= rs->max_objects ||
+	((rs->scanned_count & 0xff) == 0 && current_time() > rs->deadline)) {
+	rs->complete = 0;
+	rb_iter_break();
+    }
+    rs->scanned_count++;
+
+    rs->found_num = 0;
+    rb_objspace_reachable_objects_from(obj, retention_child_i, rs);
+    if (rs->found_num == 0) return Qnil;
+
+    key.n = 5;
+    if (st_lookup(rs->arg->object_table, (st_data_t)obj, &val)) {
+	struct allocation_info *info = (struct allocation_info *)val;
+	key.data[3] = (st_data_t)info->path;
+	key.data[4] = info->path ? (st_data_t)info->line : 0;
+    }
+    else {
+	key.data[3] = key.data[4] = 0;
+    }
+    switch (BUILTIN_TYPE(obj)) {
+      case T_NODE:
+      case T_IMEMO:
+	key.data[2] = 0;
+	break;
+      default:
+	key.data[2] = retention_class_index(rs, RBASIC_CLASS(obj));
+    }
+
+    for (i=0; i<rs->found_num; i++) {
+	key.data[0] = (st_data_t)rs->found[i].path;
+	key.data[1] = rs->found[i].path ? (st_data_t)rs->found[i].line : 0;
+	retention_add_hint(rs, &key, rs->found[i].count);
+    }
+    return Qnil;
+}
+
+/* make {[path, line] => {[class name, path, line] of referrer => count}} */
+static int
+retention_hint_key_i(st_data_t key, st_data_t val, st_data_t data)
+{
+    struct retention_scan *rs = (struct retention_scan *)data;
+    struct memcmp_key_data *k = (struct memcmp_key_data *)key;
+    VALUE hints = rs->site_hints;
+    VALUE site = retention_site_key((const char *)k->data[0], k->data[1]);
+    VALUE referrer = retention_site_key((const char *)k->data[3], k->data[4]);
+    VALUE referrers = rb_hash_lookup(hints, site);
+    VALUE klass_name = Qnil;
+
+    if (k->data[2]) {
+	VALUE klass = RARRAY_AREF(rs->classes, k->data[2] - 1);
+	klass_name = rb_mod_name(klass);
+	if (NIL_P(klass_name)) klass_name = rb_inspect(klass);
+    }
+    rb_ary_unshift(referrer, klass_name);
+
+    if (NIL_P(referrers)) {
+	rb_hash_aset(hints, site, referrers = rb_hash_new());
+    }
+    rb_hash_aset(referrers, referrer, SIZET2NUM(NUM2SIZET(rb_hash_lookup2(referrers, referrer, INT2FIX(0))) + (size_t)val));
+    return ST_CONTINUE;
+}
+
+static int
+retention_free_key_i(st_data_t key, st_data_t val, st_data_t data)
 {
-    VALUE result;
-    struct traceobj_arg *arg = get_traceobj_arg();
+    struct retention_scan *rs = (struct retention_scan *)data;
+    struct memcmp_key_data *k = (struct memcmp_key_data *)key;
 
-    disable_newobj_hook();
-    result = aggregate_result(arg);
-    enable_newobj_hook();
-    return result;
+    delete_unique_str(rs->arg->str_table, (const char *)k->data[0]);
+    delete_unique_str(rs->arg->str_table, (const char *)k->data[3]);
+    ruby_xfree(k);
+    return ST_CONTINUE;
 }
 
-/*
- *
- *  call-seq:
- *     ObjectSpace::AllocationTracer.clear  -> NilClass
- *
- *  Clears the current allocated results
- *
- *  If you need to clear the results of allocation tracing
- *  without stopping tracing you can use this method.
- *
- */
 static VALUE
-allocation_tracer_clear(VALUE self)
+retention_scan(VALUE data)
 {
-    clear_traceobj_arg();
+    struct retention_scan *rs = (struct retention_scan *)data;
+
+    rb_block_call(rb_const_get(rb_cObject, rb_intern("ObjectSpace")), rb_intern("each_object"), 0, 0, retention_scan_i, data);
+    rs->site_hints = rb_hash_new();
+    st_foreach(rs->hints, retention_hint_key_i, data);
     return Qnil;
 }
 
-/*! Used in allocation_tracer_trace
-*   to ensure that a result is returned.
-*/
 static VALUE
-allocation_tracer_trace_i(VALUE self)
+retention_scan_end(VALUE data)
 {
-    rb_yield(Qnil);
-    return allocation_tracer_result(self);
+    struct retention_scan *rs = (struct retention_scan *)data;
+
+    st_foreach(rs->hints, retention_free_key_i, data);
+    st_free_table(rs->hints);
+    st_free_table(rs->class_index);
+    return Qnil;
 }
 
-/*
- *
- *  call-seq:
- *     ObjectSpace::AllocationTracer.trace { |a, b| block } -> array
- *     ObjectSpace::AllocationTracer.start                  -> NilClass
- *
- *  Traces object allocations inside of the block
- *
- *  Objects created inside of the block will be tracked by the tracer.
- *  If the method is called without a block, the tracer will start
- *  and continue until ObjectSpace::AllocationTracer.stop is called.
- *
- *  Output can be customized with ObjectSpace::AllocationTracer.setup.
- *
- *  Example:
- *
- *     pp ObjectSpace::AllocationTracer.trace{
- *       50_000.times{|i|
- *         i.to_s
- *         i.to_s
- *         i.to_s
- *       }
- *     }
- *
- *     # => {["test.rb", 6]=>[50000, 0, 47440, 0, 1, 0],
- *           ["test.rb", 7]=>[50000, 4, 47452, 0, 6, 0],
- *           ["test.rb", 8]=>[50000, 7, 47456, 0, 6, 0]}
- *
- */
-static VALUE
-allocation_tracer_trace(VALUE self)
+static int
+retention_dominant_i(VALUE referrer, VALUE count, VALUE data)
 {
-    struct traceobj_arg * arg = get_traceobj_arg();
+    VALUE *dominant = (VALUE *)data;
 
-    if (arg->running) {
-	rb_raise(rb_eRuntimeError, "can't run recursivly");
+    if (NIL_P(dominant[0]) || NUM2SIZET(count) > NUM2SIZET(dominant[1])) {
+	dominant[0] = referrer;
+	dominant[1] = count;
     }
-    else {
-	arg->running = 1;
-	if (arg->keys == 0) arg->keys = KEY_PATH | KEY_LINE;
-	start_alloc_hooks(rb_mAllocationTracer);
+    dominant[2] = SIZET2NUM(NUM2SIZET(dominant[2]) + NUM2SIZET(count));
+    return ST_CONTINUE;
+}
 
-	if (rb_block_given_p()) {
-	    return rb_ensure(allocation_tracer_trace_i, self, stop_alloc_hooks, Qnil);
-	}
-    }
+static int
+retention_hint_i(VALUE site, VALUE referrers, VALUE result)
+{
+    VALUE dominant[3] = {Qnil, INT2FIX(0), INT2FIX(0)};
+    VALUE h = rb_hash_new();
 
-    return Qnil;
+    rb_hash_foreach(referrers, retention_dominant_i, (VALUE)dominant);
+    rb_hash_aset(h, ID2SYM(rb_intern("count")), dominant[2]);
+    rb_hash_aset(h, ID2SYM(rb_intern("referrer_class")), RARRAY_AREF(dominant[0], 0));
+    rb_hash_aset(h, ID2SYM(rb_intern("referrer_path")), RARRAY_AREF(dominant[0], 1));
+    rb_hash_aset(h, ID2SYM(rb_intern("referrer_line")), RARRAY_AREF(dominant[0], 2));
+    rb_hash_aset(h, ID2SYM(rb_intern("referrer_count")), dominant[1]);
+    rb_hash_aset(result, site, h);
+    return ST_CONTINUE;
 }
 
 /*
  *
  *  call-seq:
- *     ObjectSpace::AllocationTracer.stop                  -> array
+ *     ObjectSpace::AllocationTracer.retention_hints(min_age: 3, max_objects: 1_000_000, timeout: 1.0)   -> hash
  *
- *  Stops allocation tracing if currently running
- *
- *  When allocation tracing is started via ObjectSpace::AllocationTracer.start
- *  it will continue until this method is called.
+ * Finds what keeps long-lived objects alive. Scans references of objects
+ * in the heap (ObjectSpace.each_object) to traced objects which survived
+ * +min_age+ GCs or more, and returns the dominant referrer of each
+ * allocation site:
  *
- *  Example:
- *    pp ObjectSpace::AllocationTracer.stop
+ *     {[path, line] => {count: n, referrer_class: name,
+ *                       referrer_path: path, referrer_line: line, referrer_count: m}}
  *
- *    # => {["test.rb", 6]=>[50000, 0, 47440, 0, 1, 0],
- *          ["test.rb", 7]=>[50000, 4, 47452, 0, 6, 0],
- *          ["test.rb", 8]=>[50000, 7, 47456, 0, 6, 0]}
+ * +count+ is the number of references found to the objects of the site,
+ * and +referrer_count+ is the number of them from the dominant referrer
+ * (same class and allocation site). The referrer site is nil if the
+ * referrer is not traced.
  *
+ * The scan stops after +max_objects+ objects or +timeout+ seconds, so
+ * results can be partial (see ObjectSpace::AllocationTracer.retention_scan_info).
  */
 static VALUE
-allocation_tracer_stop(VALUE self)
+allocation_tracer_retention_hints(int argc, VALUE *argv, VALUE self)
 {
-    VALUE result;
+    struct retention_scan rs;
+    VALUE opts, result, info;
+    ID keywords[3];
+    VALUE values[3];
+    double start_time = current_time();
+
+    check_tracer_running();
+    rb_scan_args(argc, argv, "0:", &opts);
+    keywords[0] = rb_intern("min_age");
+    keywords[1] = rb_intern("max_objects");
+    keywords[2] = rb_intern("timeout");
+    rb_get_kwargs(opts, keywords, 0, 3, values);
+
+    rs.arg = get_traceobj_arg();
+    rs.gc_count = rb_gc_count();
+    rs.min_age = values[0] == Qundef ? 3 : NUM2SIZET(values[0]);
+    rs.max_objects = values[1] == Qundef ? 1000000 : NUM2SIZET(values[1]);
+    rs.deadline = start_time + (values[2] == Qundef ? 1.0 : NUM2DBL(values[2]));
+    rs.scanned_count = 0;
+    rs.complete = 1;
+    rs.hints = st_init_table(&memcmp_hash_type);
+    rs.class_index = st_init_numtable();
+    rs.classes = rb_ary_new();
+    rs.site_hints = Qnil;
+
+    rb_ensure(retention_scan, (VALUE)&rs, retention_scan_end, (VALUE)&rs);
+
+    result = rb_hash_new();
+    rb_hash_foreach(rs.site_hints, retention_hint_i, result);
+
+    info = rb_hash_new();
+    rb_hash_aset(info, ID2SYM(rb_intern("scanned_count")), SIZET2NUM(rs.scanned_count));
+    rb_hash_aset(info, ID2SYM(rb_intern("complete")), rs.complete ? Qtrue : Qfalse);
+    rb_hash_aset(info, ID2SYM(rb_intern("time")), DBL2NUM(current_time() - start_time));
+    rb_ivar_set(rb_mAllocationTracer, rb_intern("retention_scan_info"), info);
 
-    disable_newobj_hook();
-    result = aggregate_result(get_traceobj_arg());
-    stop_alloc_hooks(self);
     return result;
 }
 
 /*
  *
  *  call-seq:
- *     ObjectSpace::AllocationTracer.pause                  -> NilClass
- *
- *  Pauses allocation tracing
- *
- *  Use in conjunction with ObjectSpace::AllocationTracer.start and
- *  ObjectSpace::AllocationTracer.stop.
+ *     ObjectSpace::AllocationTracer.retention_scan_info   -> hash or nil
  *
+ * Returns statistics of the last ObjectSpace::AllocationTracer.retention_hints:
+ * {scanned_count: objects, complete: false if a budget is exceeded, time: seconds}
  */
 static VALUE
-allocation_tracer_pause(VALUE self)
+allocation_tracer_retention_scan_info(VALUE self)
 {
-    disable_newobj_hook();
-    return Qnil;
+    return rb_ivar_get(rb_mAllocationTracer, rb_intern("retention_scan_info"));
 }
+#endif
 
 /*
+ * scoped counting. independent from start/stop.
  *
- *  call-seq:
- *     ObjectSpace::AllocationTracer.resume                  -> NilClass
- *
- *  Resumes allocation tracing if previously paused
- *
- *  See ObjectSpace::AllocationTracer.pause to pause allocation tracing.
- *
+ * Scopes are typed data objects referred from the C stack of the block
+ * caller. If the scope is left without running rb_ensure (the block is
+ * running in an abandoned fiber, for example), the scope object is
+ * collected with the fiber and unlinks itself.
  */
-static VALUE
-allocation_tracer_resume(VALUE self)
+struct count_scope {
+    struct count_scope *next;   /* outer (or other threads') scope */
+    int linked;
+    VALUE thread;
+    size_t counts[T_MASK];
+};
+
+static struct count_scope *count_scopes; /* innermost first */
+
+static void
+unlink_count_scope(struct count_scope *scope)
 {
-    enable_newobj_hook();
-    return Qnil;
+    struct count_scope **p;
+
+    for (p = &count_scopes; *p != scope; p = &(*p)->next);
+    *p = scope->next;
+    scope->linked = 0;
 }
 
-/*
- *
- *  call-seq:
- *     ObjectSpace::AllocationTracer.setup([symbol])       -> NilClass
- *
- *  Change the format that results will be returned.
- *
- *  Takes an array of symbols containing the order you would like the output
- *  to be returned. Valid options:
- *
- *    - :path
- *    - :line
- *    - :type
- *    - :class
- *
- *  Example:
- *
- *     ObjectSpace::AllocationTracer.setup(%i{path line type})
- *
- *     result = ObjectSpace::AllocationTracer.trace do
- *       50_000.times{|i|
- *         a = [i.to_s]
- *         b = {i.to_s => nil}
- *         c = (i.to_s .. i.to_s)
- *       }
- *     end
- *
- *     pp result
- *
- *     # => {["test.rb", 8, :T_STRING]=>[50000, 15, 49165, 0, 16, 0],
- *           ["test.rb", 8, :T_ARRAY]=>[50000, 12, 49134, 0, 16, 0],
- *           ["test.rb", 9, :T_STRING]=>[100000, 27, 98263, 0, 16, 0],
- *           ["test.rb", 9, :T_HASH]=>[50000, 16, 49147, 0, 16, 8998848],
- *           ["test.rb", 10, :T_STRING]=>[100000, 36, 98322, 0, 16, 0],
- *           ["test.rb", 10, :T_STRUCT]=>[50000, 16, 49147, 0, 16, 0]}
- *
- */
-static VALUE
-allocation_tracer_setup(int argc, VALUE *argv, VALUE self)
+static void
+count_scope_mark(void *ptr)
 {
-    struct traceobj_arg * arg = get_traceobj_arg();
+    struct count_scope *scope = (struct count_scope *)ptr;
+    rb_gc_mark(scope->thread);
+}
 
-    if (arg->running) {
-	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+/* called during GC. the hook is disabled later by JOB_SCOPE_HOOK */
+static void
+count_scope_free(void *ptr)
+{
+    struct count_scope *scope = (struct count_scope *)ptr;
+
+    if (scope->linked) {
+	unlink_count_scope(scope);
+	if (count_scopes == NULL) trigger_job(JOB_SCOPE_HOOK);
     }
-    else {
-	if (argc >= 1) {
-	    int i;
-	    VALUE ary = rb_check_array_type(argv[0]);
+    ruby_xfree(scope);
+}
 
-	    arg->keys = 0;
+static const rb_data_type_t count_scope_type = {
+    "allocation_tracer/count_scope",
+    {count_scope_mark, count_scope_free, NULL,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
 
-	    for (i=0; i<(int)RARRAY_LEN(ary); i++) {
-		if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("path"))) arg->keys |= KEY_PATH;
-		else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("line"))) arg->keys |= KEY_LINE;
-		else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("type"))) arg->keys |= KEY_TYPE;
-		else if (RARRAY_AREF(ary, i) == ID2SYM(rb_intern("class"))) arg->keys |= KEY_CLASS;
-		else {
-		    rb_raise(rb_eArgError, "not supported key type");
-		}
-	    }
-	}
+static void
+scope_hook_job(void *data)
+{
+    if (count_scopes == NULL) {
+	rb_tracepoint_disable(rb_ivar_get(rb_mAllocationTracer, rb_intern("scope_hook")));
     }
+}
 
-    if (argc == 0) {
-	arg->keys = KEY_PATH | KEY_LINE;
+static void
+scoped_newobj_i(VALUE tpval, void *data)
+{
+    VALUE obj = rb_tracearg_object(rb_tracearg_from_tracepoint(tpval));
+    VALUE thread;
+    struct count_scope *scope;
+
+    /* internal objects are not counted as newobj_i does */
+    switch (BUILTIN_TYPE(obj)) {
+      case T_NODE:
+      case T_IMEMO:
+	return;
+      default:
+	break;
+    }
+    if (RBASIC_CLASS(obj) == 0) return;
+
+    /* count only in the innermost scope. counts are added to the outer scope at the end */
+    thread = rb_thread_current();
+    for (scope = count_scopes; scope; scope = scope->next) {
+	if (scope->thread == thread) {
+	    scope->counts[BUILTIN_TYPE(obj)]++;
+	    return;
+	}
     }
-    return Qnil;
 }
 
-/*
- *
- *  call-seq:
- *     ObjectSpace::AllocationTracer.header   -> array
- *
- *  Return headers
- *
- *  Example:
- *
- *     puts ObjectSpace::AllocationTracer.header
- *     => [:path, :line, :count, :old_count, :total_age, :min_age, :max_age, :total_memsize]
- *
- */
-VALUE
-allocation_tracer_header(VALUE self)
+static VALUE
+scoped_count_end(VALUE data)
 {
-    VALUE ary = rb_ary_new();
-    struct traceobj_arg * arg = get_traceobj_arg();
+    struct count_scope *scope = (struct count_scope *)data, *outer;
+    int i;
 
-    if (arg->keys & KEY_PATH) rb_ary_push(ary, ID2SYM(rb_intern("path")));
-    if (arg->keys & KEY_LINE) rb_ary_push(ary, ID2SYM(rb_intern("line")));
-    if (arg->keys & KEY_TYPE) rb_ary_push(ary, ID2SYM(rb_intern("type")));
-    if (arg->keys & KEY_CLASS) rb_ary_push(ary, ID2SYM(rb_intern("class")));
+    unlink_count_scope(scope);
 
-    if (arg->vals & VAL_COUNT) rb_ary_push(ary, ID2SYM(rb_intern("count")));
-    if (arg->vals & VAL_OLDCOUNT) rb_ary_push(ary, ID2SYM(rb_intern("old_count")));
-    if (arg->vals & VAL_TOTAL_AGE) rb_ary_push(ary, ID2SYM(rb_intern("total_age")));
-    if (arg->vals & VAL_MIN_AGE) rb_ary_push(ary, ID2SYM(rb_intern("min_age")));
-    if (arg->vals & VAL_MAX_AGE) rb_ary_push(ary, ID2SYM(rb_intern("max_age")));
-    if (arg->vals & VAL_MEMSIZE) rb_ary_push(ary, ID2SYM(rb_intern("total_memsize")));
-    return ary;
+    for (outer = scope->next; outer; outer = outer->next) {
+	if (outer->thread == scope->thread) {
+	    for (i=0; i<T_MASK; i++) outer->counts[i] += scope->counts[i];
+	    break;
+	}
+    }
+
+    if (count_scopes == NULL) {
+	rb_tracepoint_disable(rb_ivar_get(rb_mAllocationTracer, rb_intern("scope_hook")));
+    }
+    return Qnil;
 }
 
 /*
  *
  *  call-seq:
- *     ObjectSpace::AllocationTracer.lifetime_table_setup(true)   -> NilClass
+ *     ObjectSpace::AllocationTracer.scoped_count_table { ... }   -> hash
  *
- * Enables tracing for the generation of objects
+ * Counts objects allocated by the current thread while running the
+ * block, and returns counts per type like
+ * ObjectSpace::AllocationTracer.allocated_count_table. Internal objects
+ * (T_IMEMO, T_NODE and hidden objects) are not counted.
  *
- * See ObjectSpace::AllocationTracer.lifetime_table for an example.
+ * It doesn't record anything other than counts, and can be used
+ * while tracing or nested.
+ *
+ * Example:
+ *
+ *     s = 'a'
+ *     ObjectSpace::AllocationTracer.scoped_count_table{ s + s }[:T_STRING] #=> 1
  */
 static VALUE
-allocation_tracer_lifetime_table_setup(VALUE self, VALUE set)
+allocation_tracer_scoped_count_table(VALUE self)
 {
-    struct traceobj_arg * arg = get_traceobj_arg();
+    struct count_scope *scope;
+    VALUE hook = rb_ivar_get(rb_mAllocationTracer, rb_intern("scope_hook"));
+    VALUE scope_obj, h;
+    int i;
 
-    if (arg->running) {
-	rb_raise(rb_eRuntimeError, "can't change configuration during running");
+    rb_need_block();
+    if (NIL_P(hook)) {
+	rb_ivar_set(rb_mAllocationTracer, rb_intern("scope_hook"), hook = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, scoped_newobj_i, 0));
     }
 
-    if (RTEST(set)) {
-	if (arg->lifetime_table == NULL) {
-	    arg->lifetime_table = (size_t **)calloc(T_MASK, sizeof(size_t **));
-	}
-    }
-    else {
-	delete_lifetime_table(arg);
-    }
+    scope_obj = TypedData_Make_Struct(0, struct count_scope, &count_scope_type, scope);
+    scope->thread = rb_thread_current();
+    scope->next = count_scopes;
+    scope->linked = 1;
+    /* the hook may be still enabled if a collected scope was the last one */
+    if (count_scopes == NULL && !RTEST(rb_tracepoint_enabled_p(hook))) rb_tracepoint_enable(hook);
+    count_scopes = scope;
 
-    return Qnil;
+    rb_ensure(rb_yield, Qnil, scoped_count_end, (VALUE)scope);
+
+    h = rb_hash_new();
+    for (i=0; i<T_MASK; i++) {
+	rb_hash_aset(h, type_sym(i), SIZET2NUM(scope->counts[i]));
+    }
+    RB_GC_GUARD(scope_obj);
+    return h;
 }
 
 /*
@@ -1151,6 +5930,23 @@ Init_allocation_tracer(void)
     VALUE rb_mObjSpace = rb_const_get(rb_cObject, rb_intern("ObjectSpace"));
     VALUE mod = rb_mAllocationTracer = rb_define_module_under(rb_mObjSpace, "AllocationTracer");
 
+    /* holder object marks class names and re-keys moved objects on compaction */
+    rb_gc_register_mark_object(TypedData_Wrap_Struct(0, &tracer_holder_type, &tmp_trace_arg));
+
+    define_job(JOB_AGGREGATE_FREED, aggregate_freed_info);
+#ifdef HAVE_RB_GC_LOCATION
+    define_job(JOB_FLUSH_MOVED, flush_moved_objects_job);
+#endif
+    define_job(JOB_CONTROL, control_execute_job);
+    define_job(JOB_ALARM, alarm_job);
+    define_job(JOB_SCOPE_HOOK, scope_hook_job);
+    define_job(JOB_BUDGET, enforce_memory_budget);
+
+    sym_major_by = ID2SYM(rb_intern("major_by"));
+    id_fiber_id = rb_intern("__allocation_tracer_fiber_id__");
+    /* gc_info_decode() interns its symbols at the first call, which is not allowed during GC */
+    rb_gc_latest_gc_info(sym_major_by);
+
     /* allocation tracer methods */
     rb_define_module_function(mod, "trace", allocation_tracer_trace, 0);
     rb_define_module_function(mod, "start", allocation_tracer_trace, 0);
@@ -1160,12 +5956,55 @@ Init_allocation_tracer(void)
 
     rb_define_module_function(mod, "result", allocation_tracer_result, 0);
     rb_define_module_function(mod, "clear", allocation_tracer_clear, 0);
+    rb_define_module_function(mod, "sort_result", allocation_tracer_sort_result, 4);
+    rb_define_module_function(mod, "write_json", allocation_tracer_write_json, -1);
     rb_define_module_function(mod, "setup", allocation_tracer_setup, -1);
     rb_define_module_function(mod, "header", allocation_tracer_header, 0);
 
     rb_define_module_function(mod, "lifetime_table_setup", allocation_tracer_lifetime_table_setup, 1);
     rb_define_module_function(mod, "lifetime_table", allocation_tracer_lifetime_table, 0);
 
+    rb_define_module_function(mod, "class_grouping_setup", allocation_tracer_class_grouping_setup, -1);
+
+    rb_define_module_function(mod, "promotion_tracking_setup", allocation_tracer_promotion_tracking_setup, 1);
+
+    rb_define_module_function(mod, "size_distribution_setup", allocation_tracer_size_distribution_setup, 1);
+    rb_define_module_function(mod, "duplicate_detection_setup", allocation_tracer_duplicate_detection_setup, 1);
+    rb_define_module_function(mod, "retained_setup", allocation_tracer_retained_setup, 1);
+
+    rb_define_module_function(mod, "gc_records_setup", allocation_tracer_gc_records_setup, 1);
+    rb_define_module_function(mod, "gc_records", allocation_tracer_gc_records, 0);
+
+    rb_define_module_function(mod, "fork_setup", allocation_tracer_fork_setup, 1);
+    rb_define_module_function(mod, "after_fork", allocation_tracer_after_fork, 0);
+    rb_define_module_function(mod, "fork_info", allocation_tracer_fork_info, 0);
+    rb_define_module_function(mod, "boot_profile_setup", allocation_tracer_boot_profile_setup, 1);
+    rb_define_module_function(mod, "boot_snapshot", allocation_tracer_boot_snapshot, 0);
+    rb_define_module_function(mod, "boot_sites", allocation_tracer_boot_sites, 0);
+#ifdef HAVE_SYS_MMAN_H
+    rb_define_module_function(mod, "cluster_setup", allocation_tracer_cluster_setup, 2);
+    rb_define_module_function(mod, "cluster_publish", allocation_tracer_cluster_publish, 1);
+    rb_define_module_function(mod, "cluster_reports", allocation_tracer_cluster_reports, 0);
+#endif
+
+    rb_define_module_function(mod, "running?", allocation_tracer_running_p, 0);
+    rb_define_module_function(mod, "sampling_setup", allocation_tracer_sampling_setup, 1);
+    rb_define_module_function(mod, "memory_budget_setup", allocation_tracer_memory_budget_setup, 1);
+    rb_define_module_function(mod, "memory_budget_info", allocation_tracer_memory_budget_info, 0);
+    rb_define_module_function(mod, "alarm_setup", allocation_tracer_alarm_setup, -1);
+    rb_define_module_function(mod, "alarm_tick", allocation_tracer_alarm_tick, 0);
+    rb_define_module_function(mod, "control_request", allocation_tracer_control_request, 0);
+    rb_define_module_function(mod, "control_deadline", allocation_tracer_control_deadline, 1);
+    rb_define_module_function(mod, "control_deadline_passed?", allocation_tracer_control_deadline_passed_p, 0);
+
+    rb_define_module_function(mod, "thread_allocated_count_table", allocation_tracer_thread_allocated_count_table, 0);
+    rb_define_module_function(mod, "thread_count_setup", allocation_tracer_thread_count_setup, 1);
+    rb_define_module_function(mod, "elapsed_time", allocation_tracer_elapsed_time, 0);
+#ifdef HAVE_RB_OBJSPACE_REACHABLE_OBJECTS_FROM
+    rb_define_module_function(mod, "retention_hints", allocation_tracer_retention_hints, -1);
+    rb_define_module_function(mod, "retention_scan_info", allocation_tracer_retention_scan_info, 0);
+#endif
+    rb_define_module_function(mod, "scoped_count_table", allocation_tracer_scoped_count_table, 0);
     rb_define_module_function(mod, "allocated_count_table", allocation_tracer_allocated_count_table, 0);
     rb_define_module_function(mod, "freed_count_table", allocation_tracer_freed_count_table, 0);
 }
@@ -1,2 +1,9 @@
 require 'mkmf'
+have_func('clock_gettime', 'time.h')
+have_func('rb_gc_location')
+have_func('rb_gc_obj_slot_size')
+have_func('rb_objspace_reachable_objects_from')
+have_func('rb_obj_gc_flags')
+have_func('rb_postponed_job_trigger', 'ruby/debug.h')
+have_header('sys/mman.h')
 create_makefile('allocation_tracer/allocation_tracer')
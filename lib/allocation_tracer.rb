@@ -30,6 +30,278 @@ module ObjectSpace::AllocationTracer
     end
   end
 
+  # Columns of a result key. Other columns of the header are values.
+  KEY_COLUMNS = %i(path line type class class_name thread fiber method data_type)
+
+  # Write the current result of this process into the cluster segment
+  # (see cluster_setup). Classes are written as names because they can't
+  # be marshaled if anonymous, and are looked up again by cluster_result.
+  def self.publish
+    cols = header
+    kcols = cols.take_while{|c| KEY_COLUMNS.include?(c)}
+    result = ObjectSpace::AllocationTracer.result.map{|k, v|
+      [k.map{|e| Module === e ? (e.name || e.inspect) : e}, v]
+    }
+    cluster_publish Marshal.dump([Process.pid, kcols, cols.drop(kcols.size), result])
+  end
+
+  # Merge results published by worker processes into a cluster-wide view.
+  # Reports which can't be read consistently (see cluster_reports) are
+  # skipped with a warning.
+  def self.cluster_result
+    merged = {}
+    vcols = nil
+    classes = Hash.new{|h, name|
+      h[name] = (c = Object.const_get(name) rescue nil).is_a?(Module) ? c : name
+    }
+    cluster_reports.each{|pid, data|
+      unless data
+        warn "allocation_tracer: the report of process #{pid} can't be read. skipped"
+        next
+      end
+      _, kcols, rvcols, result = Marshal.load(data)
+      vcols ||= rvcols
+      raise ArgumentError, "reports have different columns: #{vcols} and #{rvcols}" if vcols != rvcols
+      cidx = kcols.each_index.select{|i| kcols[i] == :class}
+
+      result.each{|k, v|
+        cidx.each{|i| k[i] = classes[k[i]] if k[i]}
+        if (mv = merged[k])
+          v.each_with_index{|e, i|
+            mv[i] = case vcols[i]
+                    when :min_age then [mv[i], e].min
+                    when :max_age then [mv[i], e].max
+                    when :size_histogram
+                      Array.new([mv[i].size, e.size].max){|j| mv[i].fetch(j, 0) + e.fetch(j, 0)}
+                    when :slot_sizes then mv[i].merge(e){|_, a, b| a + b}
+                    else mv[i] + e
+                    end
+          }
+        else
+          merged[k] = v.dup
+        end
+      }
+    }
+    merged
+  end
+
+  # Configure labels of threads used for the :thread key and
+  # thread_allocated_count_table. +mapping+ is a Hash of
+  # {pattern => label} matched against thread names, or a block
+  # which takes a thread and returns a label.
+  #
+  #   thread_name_setup(/\Apuma srv tp/ => 'web', /sidekiq/ => 'sidekiq')
+  #   thread_name_setup{|th| th[:role] || 'other'}
+  def self.thread_name_setup mapping = nil, &block
+    @thread_name_mapping = block || mapping
+  end
+
+  def self.thread_label thread
+    name = thread.name || (thread == Thread.main ? 'main' : "thread-#{thread.object_id}")
+
+    case mapping = @thread_name_mapping
+    when Proc
+      mapping.call(thread)
+    when Hash
+      mapping.each{|pattern, label| return label if pattern === name}
+      name
+    else
+      name
+    end
+  end
+
+  # Write a result as tab separated values with a header line. Rows are
+  # sorted by keys. Keys can be nil (e.g. paths of objects allocated
+  # without Ruby frames) and classes are not comparable, so lines are
+  # compared as numbers and others as strings.
+  def self.output_result result, out = STDOUT
+    out.puts header.join("\t")
+    result.sort_by{|k, v|
+      k.map{|e| e.nil? ? [0, ''] : [1, e.is_a?(Integer) ? e : e.to_s]}
+    }.each{|k, v|
+      out.puts (k+v).join("\t")
+    }
+  end
+
+  # Save a result into a site file to compare runs with
+  # `allocation_tracer diff' (see ObjectSpace::AllocationTracer::SiteFile).
+  def self.save path, result = self.result
+    require 'allocation_tracer/site_file'
+    SiteFile.write path, header, result
+  end
+
+  # Alarms are evaluated when GC starts. A timer thread also ends long
+  # epochs, so that alarms trip in processes which rarely run GC
+  # (see alarm_setup and alarm_tick). It is started when tracing starts
+  # with an alarm and stopped by alarm_timer_stop when tracing stops.
+  def self.alarm_timer interval
+    @alarm_tick_interval = [interval, 1].min
+    unless @alarm_timer && @alarm_timer.alive?
+      @alarm_timer = Thread.new{
+        loop{
+          sleep @alarm_tick_interval
+          break unless @alarm_timer
+          alarm_tick
+        }
+      }
+    end
+  end
+
+  def self.alarm_timer_stop
+    if timer = @alarm_timer
+      @alarm_timer = nil
+      # an alarm block may stop tracing on the timer thread
+      timer.kill unless timer == Thread.current
+    end
+  end
+
+  # Control channel to start/stop tracing in a running process.
+  #
+  # Commands in the control file +path+ are executed when +signal+ is
+  # received, or when the file is updated if +watch+ (polling interval in
+  # seconds) is given. No signal is trapped by default. The signal is
+  # trapped with Signal.trap and the previous handler is still called.
+  # Commands are executed at a safe point (postponed job).
+  # Without the control file, the signal toggles tracing.
+  #
+  #   start [SEC [PATH]]  start tracing. stop after SEC seconds and dump to PATH
+  #   stop [PATH]         stop tracing and dump the result to PATH
+  #   dump PATH           dump the current result to PATH
+  #   sampling N          trace one of N allocations
+  #
+  # "%p" in PATH is replaced with the process id. Results are saved as
+  # site files if PATH ends with ".atr".
+  def self.control_setup path, signal: nil, watch: nil
+    @control_path = path
+
+    if signal
+      prev = Signal.trap(signal.to_s.sub(/\ASIG/, '')){|signo|
+        control_request
+        prev.call(signo) if prev.respond_to?(:call)
+      }
+    end
+
+    if watch
+      @control_watcher ||= Thread.new{
+        mtime = File.mtime(path) rescue nil
+        loop{
+          sleep watch
+          m = File.mtime(path) rescue nil
+          control_request if m && m != mtime
+          mtime = m
+        }
+      }
+    end
+  end
+
+  def self.control_execute
+    unless @control_path && File.exist?(@control_path)
+      running? ? control_stop(@control_dump_path) : start
+      return
+    end
+
+    File.foreach(@control_path){|line|
+      cmd, *args = line.split
+      case cmd
+      when 'start'
+        next if running?
+        retained_setup true if args[1] && args[1].end_with?('.atr')
+        start
+        control_timer Float(args[0]) if args[0]
+        @control_dump_path = args[1]
+      when 'stop'
+        control_stop(args[0] || @control_dump_path) if running?
+      when 'dump'
+        control_dump(result, args[0]) if running?
+      when 'sampling'
+        sampling_setup Integer(args[0])
+      when nil, /\A#/
+        # skip
+      else
+        raise ArgumentError, "unknown control command: #{cmd}"
+      end
+    }
+  end
+
+  def self.control_expire
+    control_stop(@control_dump_path) if running?
+  end
+
+  # The allocation hook doesn't check the deadline. A timer thread
+  # expires tracing unless it is stopped (or restarted) in time.
+  def self.control_timer sec
+    control_deadline sec
+    Thread.new{
+      sleep sec
+      begin
+        control_expire if control_deadline_passed?
+      rescue => e
+        warn "allocation_tracer: control command failed: #{e}"
+      end
+    }
+  end
+
+  def self.control_stop path
+    result = stop
+    control_dump(result, path) if path
+  end
+
+  def self.control_dump result, path
+    path = path.gsub('%p', Process.pid.to_s)
+    if path.end_with?('.atr')
+      save path, result
+    else
+      File.open(path, 'w'){|out|
+        output_result result, out
+      }
+    end
+  end
+
+  # Start tracing for the boot profile of a preforking server. Paths
+  # are mapped to gems and application components by a ComponentMap
+  # built from Gem.loaded_specs here. Call it before requiring gems.
+  #
+  #   ObjectSpace::AllocationTracer.boot_start
+  #   Bundler.require
+  #   ... # fork workers
+  #   pp ObjectSpace::AllocationTracer.boot_profile
+  def self.boot_start app_root: Dir.pwd
+    require 'allocation_tracer/component_map'
+    @component_map = ComponentMap.new(app_root: app_root)
+    setup(%i(path line)) unless header.include?(:path)
+    boot_profile_setup true
+    start
+  end
+
+  # Summarize boot_sites per component (gem name, 'app', 'ruby' or
+  # 'other'), ordered by retained_memsize.
+  def self.boot_profile component_map = nil
+    require 'allocation_tracer/component_map'
+    component_map ||= (@component_map ||= ComponentMap.new)
+    profile = Hash.new{|h, k|
+      h[k] = {retained_count: 0, retained_memsize: 0, freed_count: 0, wb_unprotected_count: 0, wb_unprotected_memsize: 0}
+    }
+    boot_sites.each{|path, (retained_count, retained_memsize, freed_count, wb_unprotected_count, wb_unprotected_memsize)|
+      e = profile[(path && component_map.lookup(path)) || 'other']
+      e[:retained_count] += retained_count
+      e[:retained_memsize] += retained_memsize
+      e[:freed_count] += freed_count
+      e[:wb_unprotected_count] += wb_unprotected_count
+      e[:wb_unprotected_memsize] += wb_unprotected_memsize
+    }
+    profile.sort_by{|_, e| -e[:retained_memsize]}.to_h
+  end
+
+  module ForkHook
+    def _fork
+      ObjectSpace::AllocationTracer.boot_snapshot
+      pid = super
+      ObjectSpace::AllocationTracer.after_fork if pid == 0
+      pid
+    end
+  end
+  Process.singleton_class.prepend ForkHook if Process.respond_to?(:_fork)
+
   def self.collect_lifetime_table_stop
     ObjectSpace::AllocationTracer.stop
     result = ObjectSpace::AllocationTracer.lifetime_table
@@ -0,0 +1,44 @@
+require 'allocation_tracer'
+require 'rbconfig'
+
+# Map paths to gems and application components by the longest
+# registered prefix. Prefixes are kept in a trie of path segments.
+#
+#   map = ObjectSpace::AllocationTracer::ComponentMap.new(app_root: Dir.pwd)
+#   map.lookup '/gems/rack-3.0.8/lib/rack.rb' #=> "rack"
+class ObjectSpace::AllocationTracer::ComponentMap
+  # Components are gems in Gem.loaded_specs, 'ruby' (standard libraries)
+  # and 'app' (files under +app_root+). Gems under +app_root+ (such as
+  # vendor/bundle) are matched as gems because of the longer prefix.
+  def initialize app_root: nil
+    @root = {}
+    add RbConfig::CONFIG['rubylibdir'], 'ruby'
+    add app_root, 'app' if app_root
+    if defined?(Gem)
+      Gem.loaded_specs.each_value{|spec|
+        add spec.full_gem_path, spec.name
+      }
+    end
+  end
+
+  def add prefix, name
+    paths = [File.expand_path(prefix)]
+    paths << File.realpath(prefix) rescue nil # required paths are real paths
+    paths.uniq.each{|path|
+      node = path.split('/').inject(@root){|n, seg| n[seg] ||= {}}
+      node[:name] = name
+    }
+    self
+  end
+
+  # Return the component of +path+, or nil.
+  def lookup path
+    name = nil
+    path.split('/').inject(@root){|n, seg|
+      n = n[seg] or break
+      name = n[:name] || name
+      n
+    }
+    name
+  end
+end
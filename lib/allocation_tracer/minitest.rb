@@ -0,0 +1,20 @@
+require 'allocation_tracer'
+
+# Minitest assertion to check allocation budgets.
+#
+#   require 'allocation_tracer/minitest'
+#
+#   assert_allocations_at_most(12){ code }
+#   assert_allocations_at_most(12, type: :T_STRING){ code }
+#
+# Only objects allocated by the current thread are counted
+# (see ObjectSpace::AllocationTracer.scoped_count_table).
+module ObjectSpace::AllocationTracer::MinitestAssertions
+  def assert_allocations_at_most limit, type: nil, &block
+    table = ObjectSpace::AllocationTracer.scoped_count_table(&block)
+    count = (type ? Array(type) : table.keys).inject(0){|r, t| r + table.fetch(t)}
+    assert count <= limit, "Expected to allocate at most #{limit} #{type ? "#{Array(type).join('/')} " : ''}objects, but allocated #{count}"
+  end
+end
+
+Minitest::Test.include ObjectSpace::AllocationTracer::MinitestAssertions if defined?(Minitest::Test)
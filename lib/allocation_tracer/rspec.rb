@@ -0,0 +1,56 @@
+require 'allocation_tracer'
+
+# RSpec matcher to check allocation budgets.
+#
+#   require 'allocation_tracer/rspec'
+#
+#   expect{ code }.to allocate_at_most(12).objects
+#   expect{ code }.to allocate_at_most(12).objects.of_type(:T_STRING)
+#
+# Only objects allocated by the current thread are counted
+# (see ObjectSpace::AllocationTracer.scoped_count_table).
+module ObjectSpace::AllocationTracer::RSpecMatchers
+  class AllocateAtMost
+    def initialize limit
+      @limit = limit
+      @types = nil
+    end
+
+    def objects
+      self
+    end
+
+    def of_type *types
+      @types = types
+      self
+    end
+
+    def supports_block_expectations?
+      true
+    end
+
+    def matches? block
+      table = ObjectSpace::AllocationTracer.scoped_count_table(&block)
+      @actual = (@types || table.keys).inject(0){|r, type| r + table.fetch(type)}
+      @actual <= @limit
+    end
+
+    def description
+      "allocate at most #{@limit} #{@types ? @types.join('/') + ' ' : ''}objects"
+    end
+
+    def failure_message
+      "expected block to #{description}, but allocated #{@actual}"
+    end
+
+    def failure_message_when_negated
+      "expected block not to #{description}, but allocated #{@actual}"
+    end
+  end
+
+  def allocate_at_most limit
+    AllocateAtMost.new(limit)
+  end
+end
+
+RSpec.configure{|c| c.include ObjectSpace::AllocationTracer::RSpecMatchers} if defined?(RSpec.configure)
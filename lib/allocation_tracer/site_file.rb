@@ -0,0 +1,120 @@
+require 'allocation_tracer'
+
+# Site files keep results (per-site counters) in a compact binary format
+# to compare runs. Strings (paths, class names, ...) are stored once in
+# a dictionary and rows refer to them by index.
+#
+#   magic "ATR\0", version, dictionary size, key columns, value columns, rows (uint32)
+#   column names  (dictionary indexes)
+#   dictionary    (uint32 length + bytes for each string)
+#   rows          (tagged key fields + int64 values)
+#
+# Only integer value columns are stored.
+module ObjectSpace::AllocationTracer::SiteFile
+  MAGIC = "ATR\0".b
+  VERSION = 1
+
+  TAG_NIL = 0
+  TAG_INT = 1
+  TAG_STR = 2
+  TAG_SYM = 3
+
+  KEY_COLUMNS = ObjectSpace::AllocationTracer::KEY_COLUMNS
+
+  def self.write path, header, result
+    kcols = header.take_while{|c| KEY_COLUMNS.include?(c)}
+    vidx = (kcols.size...header.size).select{|i|
+      result.all?{|_k, v| Integer === v[i - kcols.size]}
+    }
+    dict = {}
+    intern = lambda{|s| dict[s] ||= dict.size}
+    cols = (kcols + vidx.map{|i| header[i]}).map{|c| intern[c.to_s]}
+
+    rows = ''.b
+    result.each{|k, v|
+      k.each{|e|
+        case e
+        when nil     then rows << [TAG_NIL].pack('C')
+        when Integer then rows << [TAG_INT, e].pack('Cq<')
+        when Symbol  then rows << [TAG_SYM, intern[e.to_s]].pack('CL<')
+        else              rows << [TAG_STR, intern[Module === e ? (e.name || e.inspect) : e.to_s]].pack('CL<')
+        end
+      }
+      rows << vidx.map{|i| v[i - kcols.size]}.pack('q<*')
+    }
+
+    File.open(path, 'wb'){|f|
+      f.write MAGIC
+      f.write [VERSION, dict.size, kcols.size, vidx.size, result.size].pack('L<*')
+      f.write cols.pack('L<*')
+      dict.each_key{|s| f.write [s.bytesize].pack('L<'); f.write s.b}
+      f.write rows
+    }
+  end
+
+  # Return [header, result] stored in +path+.
+  def self.read path
+    data = File.binread(path)
+    raise ArgumentError, "#{path} is not a site file" unless data.start_with?(MAGIC)
+    version, dsize, ksize, vsize, nrows = data.unpack('@4L<5')
+    raise ArgumentError, "unsupported site file version: #{version}" if version != VERSION
+
+    pos = 24
+    cols = data.unpack("@#{pos}L<#{ksize + vsize}")
+    pos += 4 * cols.size
+    dict = Array.new(dsize){
+      len = data.unpack("@#{pos}L<")[0]
+      s = data.byteslice(pos + 4, len).force_encoding(Encoding::UTF_8)
+      pos += 4 + len
+      s
+    }
+
+    result = {}
+    nrows.times{
+      k = Array.new(ksize){
+        case data.getbyte(pos)
+        when TAG_NIL then pos += 1; nil
+        when TAG_INT then pos += 9; data.unpack("@#{pos - 8}q<")[0]
+        when TAG_STR then pos += 5; dict[data.unpack("@#{pos - 4}L<")[0]]
+        when TAG_SYM then pos += 5; dict[data.unpack("@#{pos - 4}L<")[0]].to_sym
+        else raise ArgumentError, "broken site file: #{path}"
+        end
+      }
+      result[k] = data.unpack("@#{pos}q<#{vsize}")
+      pos += 8 * vsize
+    }
+    [cols.map{|i| dict[i].to_sym}, result]
+  end
+
+  # Compare two site files. Return rows of
+  # [key, before count, after count, growth (ratio or nil for new sites),
+  #  before retained bytes, after retained bytes, before average age, after average age]
+  # sorted by increased count. Retained bytes are nil if the file has no
+  # retained_memsize column (see ObjectSpace::AllocationTracer.retained_setup).
+  def self.diff before_path, after_path
+    bh, before = read(before_path)
+    ah, after = read(after_path)
+    kcols = bh.take_while{|c| KEY_COLUMNS.include?(c)}
+    if kcols != ah.take_while{|c| KEY_COLUMNS.include?(c)}
+      raise ArgumentError, "key columns are different: #{kcols} and #{ah.take_while{|c| KEY_COLUMNS.include?(c)}}"
+    end
+
+    column = lambda{|h, v, name| (i = h.index(name)) ? v[i - kcols.size] : 0}
+    stat = lambda{|h, v|
+      retained = h.include?(:retained_memsize) ? 0 : nil
+      if v
+        count = column[h, v, :count]
+        retained &&= column[h, v, :retained_memsize]
+        [count, retained, count > 0 ? column[h, v, :total_age].fdiv(count) : 0.0]
+      else
+        [0, retained, 0.0]
+      end
+    }
+
+    (before.keys | after.keys).map{|k|
+      bc, bm, ba = stat[bh, before[k]]
+      ac, am, aa = stat[ah, after[k]]
+      [k, bc, ac, bc > 0 ? ac.fdiv(bc) - 1 : nil, bm, am, ba, aa]
+    }.sort_by{|row| row[1] - row[2]}
+  end
+end
@@ -1,15 +1,16 @@
 require 'allocation_tracer'
 
 # ObjectSpace::AllocationTracer.setup(%i{path line})
+ObjectSpace::AllocationTracer.retained_setup true if ENV['RUBY_ALLOCATION_TRACER_SITES_OUT']
 ObjectSpace::AllocationTracer.trace
 
 at_exit{
   results = ObjectSpace::AllocationTracer.stop
-
-  puts ObjectSpace::AllocationTracer.header.join("\t")
-  results.sort_by{|k, v| k}.each{|k, v|
-    puts (k+v).join("\t")
-  }
+  if (file = ENV['RUBY_ALLOCATION_TRACER_SITES_OUT'])
+    ObjectSpace::AllocationTracer.save File.expand_path(file), results
+  else
+    ObjectSpace::AllocationTracer.output_result results
+  end
 }
 
 
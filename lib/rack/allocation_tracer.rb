@@ -6,51 +6,78 @@ require 'allocation_tracer'
 
 module Rack
   module AllocationTracerMiddleware
-    def self.new *args
-      TotalTracer.new *args
+    def self.new *args, **kw
+      TotalTracer.new *args, **kw
     end
 
     class Tracer
-      def initialize app
+      Snapshot = Struct.new(:result, :lifetime_table, :allocated_count_table, :freed_count_table,
+                            :thread_allocated_count_table, :elapsed_time, :taken_at)
+
+      # sortable columns of the page and their sort keys for sort_result
+      COLUMNS = [['count', 0], ['old_count', 1], ['average_age', [2, 0]], ['min_age', 3], ['max_age', 4], ['memsize', 5]]
+
+      # Pages are rendered from a snapshot refreshed at most once per
+      # +refresh_interval+ seconds by one request at a time. Making the
+      # result pauses the allocation hook (allocations meanwhile are not
+      # traced), so pages don't pause it more often than that.
+      def initialize app, refresh_interval: 10, per_page: 100
         @app = app
-        @sort_order = (0..7).to_a
+        @refresh_interval = refresh_interval
+        @per_page = per_page
+        @snapshot = nil
+        @refresh_lock = Mutex.new
       end
 
-      def allocation_trace_page result, env
-        if /\As=(\d+)/ =~ env["QUERY_STRING"]
-          top = $1.to_i
-          @sort_order.unshift top if @sort_order.delete top
+      def snapshot
+        if @snapshot.nil? || Process.clock_gettime(Process::CLOCK_MONOTONIC) - @snapshot.taken_at > @refresh_interval
+          if @refresh_lock.try_lock
+            begin
+              @snapshot = take_snapshot
+            ensure
+              @refresh_lock.unlock
+            end
+          elsif @snapshot.nil?
+            # wait for the first snapshot
+            @refresh_lock.synchronize{}
+          end
         end
+        @snapshot
+      end
 
-        table = result.map{|(file, line, klass), (count, oldcount, total_age, min_age, max_age, memsize)|
-          ["#{Rack::Utils.escape_html(file)}:#{'%04d' % line}",
-            Rack::Utils.escape_html(klass ? klass.name : '<internal>'),
-            count, oldcount, total_age / Float(count), min_age, max_age, memsize]
-        }
+      def take_snapshot
+        result = ObjectSpace::AllocationTracer.result
+        Snapshot.new(result,
+                     ObjectSpace::AllocationTracer.lifetime_table,
+                     ObjectSpace::AllocationTracer.allocated_count_table,
+                     ObjectSpace::AllocationTracer.freed_count_table,
+                     ObjectSpace::AllocationTracer.thread_allocated_count_table,
+                     ObjectSpace::AllocationTracer.elapsed_time,
+                     Process.clock_gettime(Process::CLOCK_MONOTONIC))
+      end
 
-        begin
-          table = table.sort_by{|vs|
-            ary = @sort_order.map{|i| Numeric === vs[i] ? -vs[i] : vs[i]}
-          }
-        rescue
-          ts = []
-          table.each{|*cols|
-            cols.each.with_index{|c, i|
-              h = (ts[i] ||= Hash.new(0))
-              h[c.class] += 1
-            }
-          }
-          return "<pre>Sorting error\n" + Rack::Utils.escape_html(h.inspect) + "</pre>"
-        end
+      def allocation_trace_page result, env
+        params = Rack::Utils.parse_query(env["QUERY_STRING"])
+        sort = COLUMNS[params['s'].to_i] || COLUMNS[0]
+        page = [params['page'].to_i, 0].max
+        per_page = (n = params['n'].to_i) > 0 ? n : @per_page
 
-        headers = %w(path class count old_count average_age min_age max_age memsize).map.with_index{|e, i|
-          "<th><a href='./?s=#{i}'>#{e}</a></th>"
+        rows = ObjectSpace::AllocationTracer.sort_result(result, sort[1], page * per_page, per_page)
+        body = rows.map{|(file, line, klass), (count, oldcount, total_age, min_age, max_age, memsize)|
+          "<tr><td>#{Rack::Utils.escape_html(file)}:#{'%04d' % line}</td>" \
+          "<td>#{Rack::Utils.escape_html(klass || '<internal>')}</td>" \
+          "<td>#{count}</td><td>#{oldcount}</td><td>#{'%.2f' % (total_age / Float(count))}</td>" \
+          "<td>#{min_age}</td><td>#{max_age}</td><td>#{memsize}</td></tr>"
         }.join("\n")
-        header = "<tr>#{headers}</tr>"
-        body = table.map{|cols|
-          "<tr>" + cols.map{|c| "<td>#{c}</td>"}.join("\n") + "</tr>"
-        }.join("\n")
-        "<table>#{header}#{body}</table>"
+
+        headers = ['<th>path</th>', '<th>class</th>'] + COLUMNS.map.with_index{|(e, _), i|
+          "<th><a href='./?s=#{i}&amp;n=#{per_page}'>#{e}</a></th>"
+        }
+        pages = "<p>#{result.size} rows. "
+        pages << "<a href='./?s=#{COLUMNS.index(sort)}&amp;n=#{per_page}&amp;page=#{page - 1}'>prev</a> " if page > 0
+        pages << "<a href='./?s=#{COLUMNS.index(sort)}&amp;n=#{per_page}&amp;page=#{page + 1}'>next</a>" if (page + 1) * per_page < result.size
+        pages << "</p>"
+        "#{pages}<table><tr>#{headers.join("\n")}</tr>#{body}</table>"
       end
 
       def count_table_page count_table
@@ -59,17 +86,26 @@ module Rack
       end
 
       def allocated_count_table_page
-        count_table_page ObjectSpace::AllocationTracer.allocated_count_table
+        count_table_page snapshot.allocated_count_table
       end
 
       def freed_count_table_page
-        count_table_page ObjectSpace::AllocationTracer.freed_count_table
+        count_table_page snapshot.freed_count_table
+      end
+
+      def thread_allocated_count_table_page
+        # counted since tracing was started (or cleared)
+        elapsed = snapshot.elapsed_time || 0
+        text = snapshot.thread_allocated_count_table.sort_by{|k, v| -v}.map{|k, v|
+          "%-20s\t%10d\t%10.1f/s" % [k, v, elapsed > 0 ? v / elapsed : 0]
+        }.join("\n")
+        "<pre>#{Rack::Utils.escape_html(text)}</pre>"
       end
 
       def lifetime_table_page
         table = []
         max_age = 0
-        ObjectSpace::AllocationTracer.lifetime_table.each{|type, ages|
+        (snapshot.lifetime_table || {}).each{|type, ages|
           max_age = [max_age, ages.size - 1].max
           table << [type, *ages]
         }
@@ -82,25 +118,19 @@ module Rack
 
       def call env
         if /\A\/allocation_tracer(?:\/|$)/ =~ env["PATH_INFO"]
-          result = ObjectSpace::AllocationTracer.result
-          ObjectSpace::AllocationTracer.pause
-
-          begin
-            html = case env["PATH_INFO"]
-                   when /lifetime_table/
-                     lifetime_table_page
-                   when /allocated_count_table/
-                     allocated_count_table_page
-                   when /freed_count_table/
-                     freed_count_table_page
-                   else
-                     allocation_trace_page result, env
-                   end
-            #
-            [200, {"Content-Type" => "text/html"}, [html]]
-          ensure
-            ObjectSpace::AllocationTracer.resume
-          end
+          html = case env["PATH_INFO"]
+                 when /lifetime_table/
+                   lifetime_table_page
+                 when /thread_allocated_count_table/
+                   thread_allocated_count_table_page
+                 when /allocated_count_table/
+                   allocated_count_table_page
+                 when /freed_count_table/
+                   freed_count_table_page
+                 else
+                   allocation_trace_page snapshot.result, env
+                 end
+          [200, {"Content-Type" => "text/html"}, [html]]
         else
           @app.call env
         end
@@ -108,10 +138,11 @@ module Rack
     end
 
     class TotalTracer < Tracer
-      def initialize *args
+      def initialize *args, **kw
         super
-        ObjectSpace::AllocationTracer.setup %i(path line class)
+        ObjectSpace::AllocationTracer.setup %i(path line class_name)
         ObjectSpace::AllocationTracer.lifetime_table_setup true
+        ObjectSpace::AllocationTracer.thread_count_setup true
         ObjectSpace::AllocationTracer.start
       end
     end
@@ -1,6 +1,18 @@
 require 'spec_helper'
 require 'tmpdir'
 require 'fileutils'
+require 'stringio'
+require 'json'
+require 'allocation_tracer/component_map'
+
+AllocationTracerSpecBase = Struct.new(:a)
+
+class AllocationTracerSpecMethods
+  def alloc
+    Object.new
+    3.times.map{ Object.new }
+  end
+end
 
 describe ObjectSpace::AllocationTracer do
   describe 'ObjectSpace::AllocationTracer.trace' do
@@ -167,6 +179,97 @@ describe ObjectSpace::AllocationTracer do
         expect(result[[__FILE__, line + 1, String]]).to eq [1, 0, 0, 0, 0, 0]
       end
 
+      it 'should work with class_name and class grouping' do
+        sub = Class.new(AllocationTracerSpecBase)
+        line = __LINE__ + 4
+        ObjectSpace::AllocationTracer.setup(%i(line class_name))
+        ObjectSpace::AllocationTracer.class_grouping_setup(anonymous: :superclass)
+        result = ObjectSpace::AllocationTracer.trace do
+          10.times{ sub.new(1); o = Object.new; def o.foo; end }
+        end
+        ObjectSpace::AllocationTracer.class_grouping_setup
+
+        expect(result[[line, 'AllocationTracerSpecBase']][0]).to be 10
+        expect(result[[line, 'Object']][0]).to be 10
+      end
+
+      it 'should work with thread' do
+        ObjectSpace::AllocationTracer.setup(%i(line thread))
+        ObjectSpace::AllocationTracer.thread_name_setup(/\Aspec-worker/ => 'workers')
+        line = __LINE__ + 2
+        result = ObjectSpace::AllocationTracer.trace do
+          3.times.map{|i| Thread.new{ Thread.current.name = "spec-worker-#{i}"; 100.times{ Object.new } } }.each(&:join)
+        end
+        ObjectSpace::AllocationTracer.thread_name_setup
+
+        expect(result[[line, 'workers']][0] >= 300).to be true
+        expect(result.keys.map(&:last).uniq.sort).to eq ['main', 'workers']
+      end
+
+      it 'should register threads only if needed' do
+        ObjectSpace::AllocationTracer.setup(%i(path line))
+        ObjectSpace::AllocationTracer.trace do
+          Object.new
+          expect(ObjectSpace::AllocationTracer.thread_allocated_count_table).to eq({})
+        end
+
+        ObjectSpace::AllocationTracer.thread_count_setup true
+        ObjectSpace::AllocationTracer.trace do
+          Object.new
+          expect(ObjectSpace::AllocationTracer.thread_allocated_count_table['main'] > 0).to be true
+          expect(ObjectSpace::AllocationTracer.elapsed_time >= 0).to be true
+        end
+        ObjectSpace::AllocationTracer.thread_count_setup false
+      end
+
+      it 'should keep tracing if a thread label raises' do
+        ObjectSpace::AllocationTracer.setup(%i(line thread))
+        ObjectSpace::AllocationTracer.thread_name_setup{|th| raise 'label' }
+        ObjectSpace::AllocationTracer.trace do
+          expect{ ObjectSpace::AllocationTracer.result }.to raise_error(RuntimeError, 'label')
+          ObjectSpace::AllocationTracer.thread_name_setup
+          line = __LINE__ + 1
+          Object.new
+          expect(ObjectSpace::AllocationTracer.result[[line, 'main']][0] >= 1).to be true
+        end
+      ensure
+        ObjectSpace::AllocationTracer.thread_name_setup
+      end
+
+      it 'should work with method' do
+        ObjectSpace::AllocationTracer.setup(%i(method type))
+        obj = AllocationTracerSpecMethods.new
+        result = ObjectSpace::AllocationTracer.trace do
+          obj.alloc
+        end
+
+        expect(result[[:T_OBJECT, 'AllocationTracerSpecMethods#alloc']][0]).to eq 4
+        expect(ObjectSpace::AllocationTracer.header.take(2)).to eq [:type, :method]
+      end
+
+      it 'should work with data_type' do
+        ObjectSpace::AllocationTracer.setup(%i(line data_type))
+        line = __LINE__ + 2
+        result = ObjectSpace::AllocationTracer.trace do
+          _ios = Array.new(10){ StringIO.new }
+          _objs = [Object.new]
+        end
+
+        expect(result[[line, 'strio']][0]).to eq 10
+        expect(result[[line, 'strio']][5]).to be > 0
+        expect(result[[line + 1, nil]][0]).to be >= 2
+      end
+
+      it 'should count memsize of living typed data without data_type' do
+        ObjectSpace::AllocationTracer.setup(%i(line class))
+        line = __LINE__ + 2
+        result = ObjectSpace::AllocationTracer.trace do
+          _ios = Array.new(10){ StringIO.new }
+        end
+
+        expect(result[[line, StringIO]][5]).to be > 0
+      end
+
       it 'should have correct headers' do
         ObjectSpace::AllocationTracer.setup(%i(path line))
         expect(ObjectSpace::AllocationTracer.header).to eq [:path, :line, :count, :old_count, :total_age, :min_age, :max_age, :total_memsize]
@@ -251,6 +354,540 @@ describe ObjectSpace::AllocationTracer do
     end
   end
 
+  describe 'promotion tracking' do
+    before do
+      ObjectSpace::AllocationTracer.promotion_tracking_setup true
+    end
+
+    after do
+      ObjectSpace::AllocationTracer.promotion_tracking_setup false
+    end
+
+    it 'should have promotion headers' do
+      ObjectSpace::AllocationTracer.setup(%i(path line))
+      expect(ObjectSpace::AllocationTracer.header).to eq [:path, :line, :count, :old_count, :total_age, :min_age, :max_age, :total_memsize, :promoted_count, :total_promotion_age, :died_old_count]
+    end
+
+    it 'should count promoted objects' do
+      a = nil
+      line = __LINE__ + 2
+      result = ObjectSpace::AllocationTracer.trace do
+        a = 'x' # it will be old object
+        32.times{GC.start}
+      end
+
+      count, old_count, _, _, max_age, _, promoted_count, total_promotion_age, died_old_count = *result[[__FILE__, line]]
+      expect(count).to be == 1
+      expect(old_count).to be == 1
+      expect(promoted_count).to be == 1
+      expect(total_promotion_age).to be >= 1
+      expect(total_promotion_age).to be <= max_age
+      expect(died_old_count).to be == 0
+    end
+  end
+
+  describe 'size distribution' do
+    after do
+      ObjectSpace::AllocationTracer.size_distribution_setup false
+    end
+
+    it 'should make size histograms per site' do
+      ObjectSpace::AllocationTracer.setup(%i(line type))
+      ObjectSpace::AllocationTracer.size_distribution_setup true
+      line = __LINE__ + 3
+      result = ObjectSpace::AllocationTracer.trace do
+        s = 'x'
+        100.times{ s * 8_000 }
+      end
+      expect(ObjectSpace::AllocationTracer.header.last(3)).to eq [:size_histogram, :slot_sizes, :non_embedded_count]
+
+      count, *, histogram, slot_sizes, non_embedded_count = result[[line, :T_STRING]]
+      expect(histogram[12]).to eq count
+      expect(slot_sizes.values.sum).to eq count
+      expect(non_embedded_count).to eq count
+    end
+  end
+
+  describe 'duplicate detection' do
+    after do
+      ObjectSpace::AllocationTracer.duplicate_detection_setup false
+    end
+
+    it 'should count distinct contents per site' do
+      ObjectSpace::AllocationTracer.setup(%i(line type))
+      ObjectSpace::AllocationTracer.duplicate_detection_setup true
+      keep = []
+      line = __LINE__ + 2
+      result = ObjectSpace::AllocationTracer.trace do
+        100.times{|i| keep << 'content-type' + ''; (i % 10).to_s }
+        GC.start
+      end
+      expect(ObjectSpace::AllocationTracer.header.last(3)).to eq [:content_count, :distinct_content_count, :duplicate_memsize]
+
+      *, content_count, distinct_count, duplicate_memsize = result[[line, :T_STRING]]
+      expect(content_count).to eq 400
+      expect(distinct_count).to eq 12 # 'content-type', '' and '0'..'9'
+      expect(duplicate_memsize).to be > 0
+    end
+
+    it 'should hash long living strings in full and skip long freed strings' do
+      ObjectSpace::AllocationTracer.setup(%i(line type))
+      ObjectSpace::AllocationTracer.duplicate_detection_setup true
+      keep = []
+      head = '<' * 100
+      tail = '>' * 100
+      line = __LINE__ + 2
+      result = ObjectSpace::AllocationTracer.trace do
+        10.times{|i| keep << "#{head}#{i}#{tail}"; "#{head}x#{tail}" }
+        GC.start
+      end
+
+      # living bodies differ only in the middle, and freed ones are skipped
+      *, content_count, distinct_count, duplicate_memsize = result[[line, :T_STRING]]
+      expect(content_count).to eq 10
+      expect(distinct_count).to eq 10
+      expect(duplicate_memsize).to eq 0
+      expect(keep.size).to eq 10
+    end
+  end
+
+  describe 'gc records' do
+    before do
+      ObjectSpace::AllocationTracer.gc_records_setup 4
+    end
+
+    after do
+      ObjectSpace::AllocationTracer.gc_records_setup false
+    end
+
+    it 'should record recent GCs with freed sites' do
+      line = __LINE__ + 3
+      ObjectSpace::AllocationTracer.trace do
+        8.times{
+          Array.new(1_000){ 'x' * 100 }
+          GC.start
+        }
+      end
+      records = ObjectSpace::AllocationTracer.gc_records
+
+      expect(records.size).to be == 4
+      expect(records.all?{|r| r[:major]}).to be true
+      expect(records.all?{|r| r[:mark_wall_time] >= 0 && r[:sweep_wall_time] >= 0}).to be true
+      expect(records.last[:freed_count]).to be >= 1_000
+      expect(records.last[:sites].assoc(__FILE__)[1]).to be == line
+    end
+  end
+
+  describe 'fork-aware mode', if: Process.respond_to?(:fork) do
+    before do
+      ObjectSpace::AllocationTracer.setup(%i(path line))
+      ObjectSpace::AllocationTracer.fork_setup true
+    end
+
+    after do
+      ObjectSpace::AllocationTracer.fork_setup false
+    end
+
+    it 'should trace only child allocations and merge reports' do
+      ObjectSpace::AllocationTracer.cluster_setup(4, 1 << 20) unless $cluster_segment_created
+      $cluster_segment_created = true
+
+      ObjectSpace::AllocationTracer.trace do
+        _parent = Array.new(1_000){ 'parent' * 2 }
+        line = __LINE__ + 3
+        pids = 2.times.map{
+          fork{
+            Array.new(100){ 'child' * 2 }
+            ObjectSpace::AllocationTracer.after_fork unless Process.respond_to?(:_fork)
+            ObjectSpace::AllocationTracer.publish
+            exit!(ObjectSpace::AllocationTracer.fork_info[:parent_objects] >= 1_000 ? 0 : 1)
+          }
+        }
+        pids.each{|pid|
+          Process.wait pid
+          expect($?.success?).to be true
+        }
+        result = ObjectSpace::AllocationTracer.cluster_result
+        expect(result[[__FILE__, line - 2]]).to be nil
+        expect(result[[__FILE__, line]][0]).to be >= 400 # 2 workers
+      end
+    end
+
+    it 'should count each freed parent-era object once' do
+      ObjectSpace::AllocationTracer.trace do
+        parent = Array.new(1_000){ 'parent' * 2 }
+        pid = fork{
+          ObjectSpace::AllocationTracer.after_fork unless Process.respond_to?(:_fork)
+          parent = nil
+          # untraced objects reuse addresses of freed parent-era objects
+          ObjectSpace::AllocationTracer.pause
+          4.times{ GC.start; Array.new(10_000){ 'child' * 2 } }
+          GC.start
+          ObjectSpace::AllocationTracer.resume
+          info = ObjectSpace::AllocationTracer.fork_info
+          exit!(info[:parent_freed_count] >= 1_000 && info[:parent_freed_count] <= info[:parent_objects] ? 0 : 1)
+        }
+        Process.wait pid
+        expect($?.success?).to be true
+      end
+    end
+  end
+
+  describe 'boot profile', if: Process.respond_to?(:fork) do
+    before do
+      ObjectSpace::AllocationTracer.setup(%i(path line))
+      ObjectSpace::AllocationTracer.boot_profile_setup true
+    end
+
+    after do
+      ObjectSpace::AllocationTracer.boot_profile_setup false
+      ObjectSpace::AllocationTracer.fork_setup false
+    end
+
+    it 'should report boot objects freed in a child process' do
+      ObjectSpace::AllocationTracer.trace do
+        kept = Array.new(1_000){ 'kept' * 2 }
+        dropped = Array.new(500){ 'dropped' * 2 }
+        GC.start # collect temporary strings before the snapshot
+        ObjectSpace::AllocationTracer.boot_snapshot unless Process.respond_to?(:_fork)
+        rd, wr = IO.pipe
+        pid = fork{
+          rd.close
+          ObjectSpace::AllocationTracer.after_fork unless Process.respond_to?(:_fork)
+          dropped = nil
+          GC.start
+          wr.write Marshal.dump([ObjectSpace::AllocationTracer.boot_sites[__FILE__],
+                                 ObjectSpace::AllocationTracer.boot_profile(ObjectSpace::AllocationTracer::ComponentMap.new(app_root: __dir__))])
+          exit!
+        }
+        wr.close
+        site, profile = Marshal.load(rd.read)
+        Process.wait pid
+
+        expect(site[0]).to be >= 1_500 # retained_count
+        expect(site[2]).to be >= 500   # freed_count
+        expect(site[2]).to be < 1_000
+        expect(profile['app'][:retained_count]).to eq site[0]
+        expect(profile['app'][:wb_unprotected_count]).to eq site[3]
+        expect(kept.size).to be 1_000
+      end
+    end
+  end
+
+  describe 'compaction', if: GC.respond_to?(:verify_compaction_references) do
+    it 'should keep tracking moved objects' do
+      ObjectSpace::AllocationTracer.setup(%i(path line class))
+      line = __LINE__ + 2
+      result = ObjectSpace::AllocationTracer.trace do
+        a = Array.new(1_000){ Object.new }
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+        a.clear
+        GC.start
+      end
+
+      count, _, _, _, _, memsize = *result[[__FILE__, line, Object]]
+      expect(count).to be >= 1_000
+      expect(memsize).to be >= 1_000 * GC::INTERNAL_CONSTANTS[:RVALUE_SIZE] # freed objects
+    end
+
+    it 'should not pin traced classes' do
+      ObjectSpace::AllocationTracer.setup(%i(line type class))
+      line = __LINE__ + 2
+      result = ObjectSpace::AllocationTracer.trace do
+        100.times{ Class.new.new }
+        a = Array.new(100){ Object.new }
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+        GC.start
+        a.clear
+      end
+
+      expect(result[[line, :T_OBJECT, nil]][0]).to be 100 # classes are freed
+      expect(result[[line + 1, :T_OBJECT, Object]][0]).to be 100
+    end
+  end
+
+  describe 'count-only mode' do
+    after do
+      ObjectSpace::AllocationTracer.setup(%i(path line))
+    end
+
+    it 'should count allocations without tracking objects' do
+      ObjectSpace::AllocationTracer.setup(%i(path line type), mode: :count_only)
+      freed = ObjectSpace::AllocationTracer.freed_count_table[:T_OBJECT]
+      line = __LINE__ + 2
+      result = ObjectSpace::AllocationTracer.trace do
+        1_000.times{ Object.new }
+        GC.start
+      end
+
+      expect(result[[__FILE__, line, :T_OBJECT]]).to eq [1_000, 0, 0, 0, 0, 0]
+      expect(ObjectSpace::AllocationTracer.freed_count_table[:T_OBJECT]).to eq freed
+    end
+
+    it 'should not accept data_type key' do
+      ObjectSpace::AllocationTracer.setup(%i(path line type))
+      expect{
+        ObjectSpace::AllocationTracer.setup(%i(path data_type), mode: :count_only)
+      }.to raise_error(ArgumentError)
+      expect(ObjectSpace::AllocationTracer.header.take(3)).to eq [:path, :line, :type]
+    end
+
+    it 'should count allocations of eval under their own paths' do
+      ObjectSpace::AllocationTracer.setup(%i(path type), mode: :count_only)
+      result = ObjectSpace::AllocationTracer.trace do
+        100.times{|i| eval('Object.new', nil, "eval#{i % 2}.rb") }
+      end
+
+      expect(result[['eval0.rb', :T_OBJECT]][0]).to eq 50
+      expect(result[['eval1.rb', :T_OBJECT]][0]).to eq 50
+    end
+  end
+
+  describe 'alarms' do
+    after do
+      ObjectSpace::AllocationTracer.alarm_setup nil
+    end
+
+    it 'should call the block when a site exceeds the threshold' do
+      events = []
+      ObjectSpace::AllocationTracer.setup(%i(path line))
+      ObjectSpace::AllocationTracer.alarm_setup(site: 1_000, types: {T_OBJECT: 1_000}){|e| events << e}
+      line = __LINE__ + 4
+      begin
+        GC.disable
+        ObjectSpace::AllocationTracer.trace do
+          2_000.times{ Object.new }
+          GC.start
+          Object.new # evaluated when GC starts, reported at the next safe point
+        end
+      ensure
+        GC.enable
+      end
+
+      expect(events.any?{|e| e[:line] == line && e[:count] >= 2_000}).to be true
+      expect(events.any?{|e| e[:type] == :T_OBJECT && e[:count] >= 2_000}).to be true
+    end
+
+    it 'should end long epochs without GC' do
+      events = []
+      ObjectSpace::AllocationTracer.setup(%i(path line))
+      ObjectSpace::AllocationTracer.alarm_setup(site: 1_000, interval: 0.1){|e| events << e}
+      line = __LINE__ + 4
+      begin
+        GC.disable
+        ObjectSpace::AllocationTracer.trace do
+          2_000.times{ Object.new }
+          20.times{ break unless events.empty?; sleep 0.1 }
+        end
+      ensure
+        GC.enable
+      end
+
+      expect(events.any?{|e| e[:line] == line && e[:count] >= 2_000}).to be true
+      expect(ObjectSpace::AllocationTracer.instance_variable_get(:@alarm_timer)).to be_nil
+    end
+  end
+
+  describe 'memory budget' do
+    after do
+      ObjectSpace::AllocationTracer.memory_budget_setup nil
+    end
+
+    it 'should degrade and expose dropped data' do
+      ObjectSpace::AllocationTracer.setup(%i(path line))
+      ObjectSpace::AllocationTracer.memory_budget_setup 2_000_000
+      keep = []
+      line = __LINE__ + 2
+      result = ObjectSpace::AllocationTracer.trace do
+        200_000.times{ keep << Object.new }
+      end
+      info = ObjectSpace::AllocationTracer.memory_budget_info
+
+      expect(info[:sampling_rate] > 1).to be true
+      expect(info[:evicted_count] > 0).to be true
+      expect(result[[__FILE__, line]][0] + info[:sampled_out_count] + info[:dropped_count] >= 200_000).to be true
+    end
+  end
+
+  describe 'control channel', if: Signal.list['USR2'] do
+    it 'should start, sample and dump by signal' do
+      Dir.mktmpdir{|dir|
+        control = File.join(dir, 'control')
+        out = File.join(dir, 'out.tsv')
+        ObjectSpace::AllocationTracer.setup(%i(path line))
+        ObjectSpace::AllocationTracer.control_setup control, signal: :USR2
+
+        File.write(control, "sampling 10\nstart\n")
+        Process.kill(:USR2, Process.pid)
+        sleep 0.1 until ObjectSpace::AllocationTracer.running?
+        line = __LINE__ + 1
+        1000.times{ Object.new }
+
+        File.write(control, "stop #{out}\nsampling 1\n")
+        Process.kill(:USR2, Process.pid)
+        sleep 0.1 while ObjectSpace::AllocationTracer.running?
+
+        row = File.readlines(out).map{|l| l.chomp.split("\t")}.find{|r| r[0] == __FILE__ && r[1] == line.to_s}
+        expect(row[2].to_i).to be_between(90, 110)
+      }
+    end
+
+    it 'should stop at the deadline and keep the previous handler' do
+      called = false
+      prev = Signal.trap(:USR1){ called = true }
+      Dir.mktmpdir{|dir|
+        control = File.join(dir, 'control')
+        out = File.join(dir, 'out.tsv')
+        ObjectSpace::AllocationTracer.setup(%i(path line))
+        ObjectSpace::AllocationTracer.control_setup control, signal: :USR1
+
+        File.write(control, "start 0.2 #{out}\n")
+        Process.kill(:USR1, Process.pid)
+        sleep 0.1 until ObjectSpace::AllocationTracer.running?
+        line = __LINE__; objs = Array.new(10){ Object.new }
+        # the result is dumped after tracing is stopped
+        rows = nil
+        50.times{
+          rows = File.readlines(out).map{|l| l.chomp.split("\t")} if File.exist?(out)
+          break if rows && rows.any?{|r| r[0] == __FILE__ && r[1] == line.to_s}
+          sleep 0.1
+        }
+
+        expect(rows[0]).to eq %w(path line count old_count total_age min_age max_age total_memsize)
+        expect(rows.find{|r| r[0] == __FILE__ && r[1] == line.to_s}[2].to_i).to be >= 10
+        expect(objs.size).to be 10
+        expect(ObjectSpace::AllocationTracer.running?).to be false
+        expect(called).to be true
+      }
+    ensure
+      Signal.trap(:USR1, prev)
+    end
+  end
+
+  describe 'site files' do
+    after do
+      ObjectSpace::AllocationTracer.retained_setup false
+    end
+
+    it 'should save results and compare them' do
+      require 'allocation_tracer/site_file'
+      ObjectSpace::AllocationTracer.setup(%i(path line class))
+      ObjectSpace::AllocationTracer.retained_setup true
+      keep = []
+      Dir.mktmpdir{|dir|
+        [10, 20].each{|n|
+          result = ObjectSpace::AllocationTracer.trace do
+            n.times{ keep << Object.new }
+          end
+          ObjectSpace::AllocationTracer.save "#{dir}/#{n}.atr", result
+        }
+
+        header, result = ObjectSpace::AllocationTracer::SiteFile.read("#{dir}/10.atr")
+        expect(header).to eq ObjectSpace::AllocationTracer.header
+        key, = result.find{|k, v| k[2] == 'Object'}
+        expect(result[key][0]).to eq 10
+
+        row = ObjectSpace::AllocationTracer::SiteFile.diff("#{dir}/10.atr", "#{dir}/20.atr").first
+        expect(row.take(4)).to eq [key, 10, 20, 1.0]
+        expect(row[4]).to be > 0
+        expect(row[5]).to eq row[4] * 2
+      }
+    end
+  end
+
+  describe 'retention hints', if: ObjectSpace::AllocationTracer.respond_to?(:retention_hints) do
+    it 'should find referrers of long-lived objects' do
+      ObjectSpace::AllocationTracer.start
+      begin
+        line = __LINE__ + 1
+        holder = AllocationTracerSpecBase.new([]); 100.times{|i| holder.a << i.to_s}
+        3.times{ GC.start }
+        hints = ObjectSpace::AllocationTracer.retention_hints(min_age: 2)
+      ensure
+        ObjectSpace::AllocationTracer.stop
+      end
+
+      hint = hints.find{|(path, l), _| l == line && path.end_with?(File.basename(__FILE__))}.last
+      expect(hint[:referrer_class]).to eq 'Array'
+      expect(hint[:referrer_line]).to eq line
+      expect(hint[:referrer_count]).to eq 100
+      expect(ObjectSpace::AllocationTracer.retention_scan_info[:complete]).to be true
+    end
+  end
+
+  describe 'ObjectSpace::AllocationTracer.scoped_count_table' do
+    it 'should count allocations of the current thread in nested scopes' do
+      inner = nil
+      outer = ObjectSpace::AllocationTracer.scoped_count_table do
+        Object.new
+        inner = ObjectSpace::AllocationTracer.scoped_count_table do
+          2.times{ Object.new }
+        end
+        Thread.new{ 10.times{ Object.new } }.join
+      end
+
+      expect(inner[:T_OBJECT]).to eq 2
+      expect(outer[:T_OBJECT]).to eq 3
+    end
+
+    it 'should forget scopes of abandoned fibers' do
+      10.times{
+        Fiber.new{ ObjectSpace::AllocationTracer.scoped_count_table{ Fiber.yield } }.resume
+      }
+      3.times{ GC.start }
+
+      counts = ObjectSpace::AllocationTracer.scoped_count_table{ 2.times{ Object.new } }
+      expect(counts[:T_OBJECT]).to eq 2
+      expect(counts[:T_IMEMO]).to eq 0
+    end
+  end
+
+  describe 'ObjectSpace::AllocationTracer.sort_result' do
+    it 'should return top rows' do
+      result = {['a', 1] => [3, 0, 30], ['b', 2] => [10, 0, 10], ['c', 3] => [5, 0, 100]}
+      expect(ObjectSpace::AllocationTracer.sort_result(result, 0, 0, 2)).to eq [[['b', 2], [10, 0, 10]], [['c', 3], [5, 0, 100]]]
+      expect(ObjectSpace::AllocationTracer.sort_result(result, 0, 2, 2)).to eq [[['a', 1], [3, 0, 30]]]
+      expect(ObjectSpace::AllocationTracer.sort_result(result, [2, 0], 0, 3).map(&:first)).to eq [['c', 3], ['a', 1], ['b', 2]]
+    end
+  end
+
+  describe 'ObjectSpace::AllocationTracer.write_json' do
+    it 'should write sites as NDJSON' do
+      line = __LINE__ + 3
+      io = StringIO.new
+      ObjectSpace::AllocationTracer.trace{
+        1_000.times{ "foo\"\n" + 'bar' }
+        ObjectSpace::AllocationTracer.write_json(io)
+      }
+      rows = io.string.lines.map{|l| JSON.parse(l)}
+      expect(rows.last.keys).to eq ['allocated_count_table', 'freed_count_table']
+      row = rows.find{|r| r['path'] == __FILE__ && r['line'] == line}
+      expect(row['count']).to eq 3_000
+    end
+
+    it 'should write one JSON object with format: :json' do
+      io = StringIO.new
+      ObjectSpace::AllocationTracer.trace{
+        Object.new
+        ObjectSpace::AllocationTracer.write_json(io, format: :json)
+      }
+      json = JSON.parse(io.string)
+      expect(json['header']).to eq ObjectSpace::AllocationTracer.header.map(&:to_s)
+      expect(json['sites'].size).to be > 0
+    end
+
+    it 'should escape bytes which are not UTF-8' do
+      io = StringIO.new
+      ObjectSpace::AllocationTracer.trace{
+        eval('Object.new', nil, "caf\u00e9\xff.rb".b)
+        ObjectSpace::AllocationTracer.write_json(io)
+      }
+      expect(io.string.b).to include "caf\u00e9\\u00ff.rb".b
+      rows = io.string.lines.map{|l| JSON.parse(l)}
+      expect(rows.any?{|r| r['path'] == "caf\u00e9\u00ff.rb"}).to be true
+    end
+  end
+
   describe 'ObjectSpace::AllocationTracer.allocated_count_table' do
     it 'should return a Hash object' do
       h = ObjectSpace::AllocationTracer.allocated_count_table